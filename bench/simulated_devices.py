@@ -0,0 +1,143 @@
+"""Benchmarks the signing pipeline against modelled storage devices, through
+--simulate, at several job counts. The devices delay reads the same way on
+every run, so throughput changes come from the scheduler, not the disk.
+
+    python3 simulated_devices.py [options] SIGNATURE
+
+Checks that every job count gives the same signature. --json saves the
+throughputs; --baseline compares against saved ones and fails if any is
+more than --tolerance slower, for CI.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# Everything but the size, which --size sets for all of them.
+SCENARIOS = {
+    # One spindle: a request at a time, a seek between non-adjacent reads,
+    # and up to half a rotation on top.
+    "hdd": "latency=uniform:0ms:4ms,bandwidth=150M,queue-depth=1,seek=8ms",
+    # Deep queue, short exponential latencies, a bus faster than the CPU.
+    "ssd": "latency=exp:80us,bandwidth=2G,queue-depth=32",
+    # A network filesystem over 1 Gbit/s: long-tailed round trips and the
+    # occasional stall that stragglers are re-issued for.
+    "network": "latency=lognormal:2ms:0.6,stall=0.01:250ms,bandwidth=110M,"
+               "queue-depth=16",
+    # Object storage: high latency, plenty of parallelism.
+    "object-store": "latency=lognormal:20ms:0.4,bandwidth=500M,queue-depth=64",
+}
+
+DEFAULT_JOBS = "1,2,4,8,16"
+
+
+def parse_size(text):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30, "T": 1 << 40}
+    if text[-1:].upper() in units:
+        return int(text[:-1]) * units[text[-1].upper()]
+    return int(text)
+
+
+def sign(binary, spec, jobs, output, block_size):
+    command = [binary, "--simulate", spec, "-o", output,
+               "--block-size", block_size, "-j", str(jobs)]
+    started = time.monotonic()
+    subprocess.run(command, check=True, stdin=subprocess.DEVNULL,
+                   stdout=subprocess.DEVNULL)
+    elapsed = time.monotonic() - started
+
+    with open(output, "rb") as f:
+        return elapsed, f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("binary", metavar="SIGNATURE")
+    parser.add_argument("--scenario", action="append", choices=SCENARIOS,
+                        help="run only this scenario; repeat for more")
+    parser.add_argument("--jobs", default=DEFAULT_JOBS,
+                        help="job counts, comma-separated (default: %s)"
+                        % DEFAULT_JOBS)
+    parser.add_argument("--size", default="256M",
+                        help="size of every device (default: 256M)")
+    parser.add_argument("--block-size", default="1M")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--repeat", type=int, default=1,
+                        help="runs of each, keeping the fastest (default: 1)")
+    parser.add_argument("--json", help="write the throughputs to this file")
+    parser.add_argument("--baseline",
+                        help="compare with throughputs saved with --json")
+    parser.add_argument("--tolerance", type=float, default=0.2,
+                        help="slowdown from the baseline that fails, as a "
+                        "fraction (default: 0.2)")
+    args = parser.parse_args()
+
+    binary = os.path.abspath(args.binary)
+    jobs_list = [int(jobs) for jobs in args.jobs.split(",")]
+    baseline = {}
+    results = {}
+    failures = []
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    with tempfile.TemporaryDirectory() as directory:
+        output = os.path.join(directory, "out.sig")
+
+        print("%-14s %5s %10s %10s %10s" % ("scenario", "jobs", "seconds",
+                                            "MB/s", "baseline"))
+
+        for name in args.scenario or SCENARIOS:
+            spec = "size=%s,seed=%d,%s" % (args.size, args.seed,
+                                           SCENARIOS[name])
+            expected = None
+            results[name] = {}
+
+            for jobs in jobs_list:
+                elapsed = float("inf")
+
+                for _ in range(args.repeat):
+                    seconds, signature = sign(binary, spec, jobs, output,
+                                              args.block_size)
+                    elapsed = min(elapsed, seconds)
+
+                    if expected is None:
+                        expected = signature
+                    elif signature != expected:
+                        failures.append("%s: -j%d signs differently"
+                                        % (name, jobs))
+
+                throughput = parse_size(args.size) / elapsed / 1e6
+                results[name][str(jobs)] = throughput
+
+                line = "%-14s %5d %10.3f %10.1f" % (name, jobs, elapsed,
+                                                   throughput)
+                previous = baseline.get(name, {}).get(str(jobs))
+
+                if previous:
+                    line += " %9.0f%%" % (100 * throughput / previous)
+
+                    if throughput < previous * (1 - args.tolerance):
+                        failures.append("%s: -j%d at %.1f MB/s, baseline "
+                                        "%.1f MB/s" % (name, jobs, throughput,
+                                                       previous))
+                print(line, flush=True)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+    for failure in failures:
+        print(failure, file=sys.stderr)
+
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,15 @@
+// Does nothing, but loads the same libraries as the tool, so that it takes
+// as long to run as starting the tool and exiting does.
+#include <boost/program_options.hpp>
+
+#include <thread>
+
+int
+main()
+{
+  boost::program_options::options_description options;
+
+  return std::thread::hardware_concurrency() == 0 && options.options().empty()
+           ? 1
+           : 0;
+}
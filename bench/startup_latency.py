@@ -0,0 +1,136 @@
+"""Measures the end-to-end latency of signing tiny files: process start,
+option parsing, reading, hashing and exit, as a script calling the tool per
+file sees it. Given several binaries, e.g. builds before and after a change,
+runs them in turn on the same files and compares them.
+
+    python3 startup_latency.py [options] SIGNATURE [SIGNATURE...]
+
+With --baseline, also times a program that only starts and exits, e.g.
+startup_floor, and with --max-ratio fails if any median is more than that
+many times the baseline's, to catch regressions on any machine.
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+DEFAULT_SIZES = ["0", "1K", "10K", "100K", "1M"]
+
+
+def parse_size(text):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    if text[-1:].upper() in units:
+        return int(text[:-1]) * units[text[-1].upper()]
+    return int(text)
+
+
+def time_run(command):
+    started = time.perf_counter()
+    subprocess.run(command, check=True, stdin=subprocess.DEVNULL,
+                   stdout=subprocess.DEVNULL)
+    return time.perf_counter() - started
+
+
+def percentile(samples, percent):
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * percent / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("binaries", nargs="+", metavar="SIGNATURE")
+    parser.add_argument("--runs", type=int, default=200,
+                        help="runs per binary and size (default: 200)")
+    parser.add_argument("--sizes", default=",".join(DEFAULT_SIZES),
+                        help="file sizes, comma-separated (default: %s)"
+                        % ",".join(DEFAULT_SIZES))
+    parser.add_argument("--block-size", default="1M")
+    parser.add_argument("--jobs", default="4",
+                        help="-j to pass, which tiny inputs shouldn't pay "
+                        "for (default: 4)")
+    parser.add_argument("--baseline", metavar="PROGRAM",
+                        help="program to compare the medians against")
+    parser.add_argument("--max-ratio", type=float,
+                        help="fail if any median is more than this many "
+                        "times the baseline's")
+    args = parser.parse_args()
+
+    if args.max_ratio and not args.baseline:
+        parser.error("--max-ratio requires --baseline")
+
+    binaries = [os.path.abspath(binary) for binary in args.binaries]
+    sizes = args.sizes.split(",")
+    failed = False
+
+    with tempfile.TemporaryDirectory() as directory:
+        output = os.path.join(directory, "out.sig")
+
+        header = "%8s" % "size"
+        if args.baseline:
+            header += "  %21s" % "baseline median / p90"
+        for i in range(len(binaries)):
+            header += "  %21s" % ("#%d median / p90 ms" % (i + 1))
+        if args.baseline:
+            header += "  %8s" % "max/base"
+        elif len(binaries) > 1:
+            header += "  %8s" % "last/#1"
+        print(header)
+
+        for size in sizes:
+            path = os.path.join(directory, "input-" + size)
+            with open(path, "wb") as f:
+                f.write(os.urandom(parse_size(size)))
+
+            commands = [[binary, "-i", path, "-o", output,
+                         "--block-size", args.block_size, "-j", args.jobs]
+                        for binary in binaries]
+            if args.baseline:
+                commands.insert(0, [os.path.abspath(args.baseline)])
+            samples = [[] for _ in commands]
+
+            # Warm up, then alternate, so that drift hits all alike.
+            for command in commands:
+                time_run(command)
+
+            for _ in range(args.runs):
+                for command, timings in zip(commands, samples):
+                    timings.append(time_run(command))
+
+            line = "%8s" % size
+            medians = []
+
+            for timings in samples:
+                median = statistics.median(timings) * 1000
+                medians.append(median)
+                line += "  %10.2f / %8.2f" % (median,
+                                              percentile(timings, 90) * 1000)
+
+            if args.baseline:
+                ratio = max(medians[1:]) / medians[0]
+                line += "  %8.2f" % ratio
+
+                if args.max_ratio and ratio > args.max_ratio:
+                    failed = True
+            elif len(binaries) > 1:
+                line += "  %7.0f%%" % (100 * medians[-1] / medians[0])
+            print(line, flush=True)
+
+    if args.baseline:
+        print("baseline: %s" % os.path.abspath(args.baseline))
+    for i, binary in enumerate(binaries):
+        print("#%d: %s" % (i + 1, binary))
+
+    if failed:
+        print("median latency above %.2f times the baseline's"
+              % args.max_ratio, file=sys.stderr)
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,545 @@
+#include "allocation.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "io_source.h"
+
+namespace {
+
+typedef std::vector<unsigned char> byte_vector;
+
+byte_vector
+read_bytes(int fd, std::uint64_t offset, std::size_t size)
+{
+  byte_vector data(size);
+
+  if (pread_full(fd, reinterpret_cast<char*>(data.data()), size, offset) !=
+      size) {
+    throw std::runtime_error(
+      "the filesystem metadata is past the end of the image");
+  }
+
+  return data;
+}
+
+std::uint64_t
+get_le(const unsigned char* data, unsigned int bytes)
+{
+  std::uint64_t value = 0;
+
+  for (unsigned int i = 0; i < bytes; i++) {
+    value |= std::uint64_t(data[i]) << (8 * i);
+  }
+
+  return value;
+}
+
+std::uint64_t
+get_be(const unsigned char* data, unsigned int bytes)
+{
+  std::uint64_t value = 0;
+
+  for (unsigned int i = 0; i < bytes; i++) {
+    value = value << 8 | data[i];
+  }
+
+  return value;
+}
+
+bool
+is_power_of_two(std::uint64_t value)
+{
+  return value && (value & (value - 1)) == 0;
+}
+
+const std::uint64_t ext4_superblock_offset = 1024;
+const std::uint64_t ext4_magic = 0xef53;
+
+const std::uint64_t ext4_compat_sparse_super2 = 0x200;
+const std::uint64_t ext4_incompat_recover = 0x4;
+const std::uint64_t ext4_incompat_meta_bg = 0x10;
+const std::uint64_t ext4_incompat_64bit = 0x80;
+const std::uint64_t ext4_ro_compat_sparse_super = 0x1;
+const std::uint64_t ext4_ro_compat_bigalloc = 0x200;
+
+// The group's block bitmap was never written: the kernel computes it from
+// where the group's metadata is.
+const std::uint64_t ext4_bg_block_uninit = 0x2;
+
+struct ext4_group
+{
+  std::uint64_t block_bitmap;
+  std::uint64_t inode_bitmap;
+  std::uint64_t inode_table;
+  std::uint64_t flags;
+};
+
+// The geometry of an ext2/3/4 filesystem, after the kernel's.
+class ext4_layout
+{
+public:
+  explicit ext4_layout(const byte_vector& superblock);
+
+  std::uint64_t group_first_block(std::uint64_t group) const
+  {
+    return first_data_block + group * blocks_per_group;
+  }
+
+  bool has_super(std::uint64_t group) const;
+  std::uint64_t descriptor_block(std::uint64_t index) const;
+  std::uint64_t base_metadata_blocks(std::uint64_t group) const;
+
+  std::uint64_t block_size;
+  std::uint64_t blocks_count;
+  std::uint64_t first_data_block;
+  std::uint64_t blocks_per_group;
+  std::uint64_t clusters_per_group;
+  std::uint64_t cluster_ratio;
+  std::uint64_t inode_table_blocks;
+  std::uint64_t groups;
+  std::uint64_t desc_size;
+  std::uint64_t desc_per_block;
+  std::uint64_t gdt_blocks;
+  std::uint64_t reserved_gdt_blocks;
+  std::uint64_t first_meta_bg;
+  std::uint64_t backup_groups[2];
+  std::uint64_t compat;
+  std::uint64_t incompat;
+  std::uint64_t ro_compat;
+};
+
+ext4_layout::ext4_layout(const byte_vector& superblock)
+{
+  auto sb = superblock.data();
+  auto corrupted = std::runtime_error("corrupted ext4 superblock");
+
+  auto log_block_size = get_le(sb + 0x18, 4);
+  auto log_cluster_size = get_le(sb + 0x1c, 4);
+
+  if (log_block_size > 6 || log_cluster_size > 16 + log_block_size) {
+    throw corrupted;
+  }
+
+  compat = get_le(sb + 0x5c, 4);
+  incompat = get_le(sb + 0x60, 4);
+  ro_compat = get_le(sb + 0x64, 4);
+
+  block_size = std::uint64_t(1024) << log_block_size;
+  blocks_count = get_le(sb + 0x04, 4);
+  first_data_block = get_le(sb + 0x14, 4);
+  blocks_per_group = get_le(sb + 0x20, 4);
+  clusters_per_group = blocks_per_group;
+  cluster_ratio = 1;
+
+  if (ro_compat & ext4_ro_compat_bigalloc) {
+    if (log_cluster_size < log_block_size) {
+      throw corrupted;
+    }
+
+    cluster_ratio = std::uint64_t(1) << (log_cluster_size - log_block_size);
+    clusters_per_group = get_le(sb + 0x24, 4);
+    blocks_per_group = clusters_per_group * cluster_ratio;
+  }
+
+  desc_size = 32;
+
+  if (incompat & ext4_incompat_64bit) {
+    blocks_count |= get_le(sb + 0x150, 4) << 32;
+    desc_size = get_le(sb + 0xfe, 2);
+  }
+
+  if (clusters_per_group == 0 || clusters_per_group > 8 * block_size ||
+      desc_size < 32 || desc_size > block_size ||
+      !is_power_of_two(desc_size) || first_data_block >= blocks_count) {
+    throw corrupted;
+  }
+
+  auto inodes_per_group = get_le(sb + 0x28, 4);
+  auto inode_size = get_le(sb + 0x4c, 4) == 0 ? 128 : get_le(sb + 0x58, 2);
+
+  inode_table_blocks =
+    (inodes_per_group * inode_size + block_size - 1) / block_size;
+
+  groups = (blocks_count - first_data_block + blocks_per_group - 1) /
+           blocks_per_group;
+  desc_per_block = block_size / desc_size;
+  gdt_blocks = (groups + desc_per_block - 1) / desc_per_block;
+  reserved_gdt_blocks = get_le(sb + 0xce, 2);
+  first_meta_bg = get_le(sb + 0x104, 4);
+  backup_groups[0] = get_le(sb + 0x24c, 4);
+  backup_groups[1] = get_le(sb + 0x250, 4);
+}
+
+bool
+ext4_layout::has_super(std::uint64_t group) const
+{
+  if (group == 0) {
+    return true;
+  }
+
+  if (compat & ext4_compat_sparse_super2) {
+    return group == backup_groups[0] || group == backup_groups[1];
+  }
+
+  if (group == 1 || !(ro_compat & ext4_ro_compat_sparse_super)) {
+    return true;
+  }
+
+  for (std::uint64_t base : { 3, 5, 7 }) {
+    auto power = base;
+
+    while (power < group) {
+      power *= base;
+    }
+
+    if (power == group) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Where the block of group descriptors with this index is: after the
+// block holding the superblock, or with meta_bg, in the first group it
+// describes. The superblock is in block 1 with 1 KiB blocks, even when
+// bigalloc makes the first data block 0.
+std::uint64_t
+ext4_layout::descriptor_block(std::uint64_t index) const
+{
+  auto superblock = ext4_superblock_offset / block_size;
+
+  if (!(incompat & ext4_incompat_meta_bg) || index < first_meta_bg) {
+    return superblock + 1 + index;
+  }
+
+  auto group = index * desc_per_block;
+
+  if (group == 0) {
+    return superblock + 1;
+  }
+
+  return group_first_block(group) + has_super(group);
+}
+
+// Blocks at the start of the group taken by a copy of the superblock and
+// the group descriptors, and the space reserved for them to grow.
+std::uint64_t
+ext4_layout::base_metadata_blocks(std::uint64_t group) const
+{
+  std::uint64_t count = has_super(group);
+
+  if (!(incompat & ext4_incompat_meta_bg) ||
+      group < first_meta_bg * desc_per_block) {
+    if (count) {
+      count += (incompat & ext4_incompat_meta_bg) ? first_meta_bg : gdt_blocks;
+      count += reserved_gdt_blocks;
+    }
+  } else {
+    auto first = group / desc_per_block * desc_per_block;
+
+    if (group == first || group == first + 1 ||
+        group == first + desc_per_block - 1) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+const std::uint64_t xfs_sb_magic = 0x58465342;   // "XFSB"
+const std::uint64_t xfs_agf_magic = 0x58414746;  // "XAGF"
+const std::uint64_t xfs_abtb_magic = 0x41425442; // "ABTB"
+const std::uint64_t xfs_ab3b_magic = 0x41423342; // "AB3B"
+const std::uint64_t xfs_null_block = 0xffffffff;
+
+}
+
+allocation_map::allocation_map(int fd)
+{
+  if (!is_seekable(fd)) {
+    throw std::invalid_argument("filesystem images should be seekable");
+  }
+
+  auto start = read_bytes(fd, 0, 2048);
+
+  if (get_be(start.data(), 4) == xfs_sb_magic) {
+    name = "xfs";
+    read_xfs(fd);
+  } else if (get_le(start.data() + ext4_superblock_offset + 0x38, 2) ==
+             ext4_magic) {
+    name = "ext4";
+    read_ext4(fd);
+  } else {
+    throw std::runtime_error("the input is neither an ext4 nor an XFS image");
+  }
+}
+
+allocation_map::allocation_map(const std::string& format,
+                               std::uint64_t size,
+                               extent_list allocated)
+  : name(format)
+  , fs_size(size)
+  , extents(std::move(allocated))
+{
+  normalize(1);
+}
+
+// Blocks in groups with a block bitmap are allocated if their bit is set;
+// in the others, only the group's own metadata is, and whatever other
+// groups keep there with flex_bg.
+void
+allocation_map::read_ext4(int fd)
+{
+  ext4_layout fs(read_bytes(fd, ext4_superblock_offset, 1024));
+
+  if (fs.incompat & ext4_incompat_recover) {
+    throw std::runtime_error(
+      "the ext4 journal needs recovery: mount the image or run e2fsck first");
+  }
+
+  auto corrupted = std::runtime_error("corrupted ext4 group descriptors");
+  fs_size = fs.blocks_count * fs.block_size;
+
+  // In clusters, which is what the bitmaps count with bigalloc.
+  auto use = [&](std::uint64_t first, std::uint64_t count) {
+    auto ratio = fs.cluster_ratio;
+    auto end = (first + count + ratio - 1) / ratio * ratio;
+    extents.emplace_back(first / ratio * ratio, end);
+  };
+
+  std::vector<ext4_group> groups;
+  groups.reserve(fs.groups);
+
+  for (std::uint64_t i = 0; i < fs.gdt_blocks; i++) {
+    auto location = fs.descriptor_block(i);
+    if (location >= fs.blocks_count) {
+      throw corrupted;
+    }
+
+    auto block = read_bytes(fd, location * fs.block_size, fs.block_size);
+
+    for (std::uint64_t j = 0;
+         j < fs.desc_per_block && groups.size() < fs.groups;
+         j++) {
+      auto desc = block.data() + j * fs.desc_size;
+      ext4_group group{ get_le(desc + 0x00, 4),
+                        get_le(desc + 0x04, 4),
+                        get_le(desc + 0x08, 4),
+                        get_le(desc + 0x12, 2) };
+
+      if (fs.desc_size >= 64) {
+        group.block_bitmap |= get_le(desc + 0x20, 4) << 32;
+        group.inode_bitmap |= get_le(desc + 0x24, 4) << 32;
+        group.inode_table |= get_le(desc + 0x28, 4) << 32;
+      }
+
+      if (group.block_bitmap >= fs.blocks_count ||
+          group.inode_bitmap >= fs.blocks_count ||
+          group.inode_table + fs.inode_table_blocks > fs.blocks_count) {
+        throw corrupted;
+      }
+
+      groups.push_back(group);
+    }
+  }
+
+  use(0, fs.first_data_block);
+
+  for (auto& group : groups) {
+    use(group.block_bitmap, 1);
+    use(group.inode_bitmap, 1);
+    use(group.inode_table, fs.inode_table_blocks);
+  }
+
+  for (std::uint64_t i = 0; i < fs.groups; i++) {
+    auto first = fs.group_first_block(i);
+
+    if (groups[i].flags & ext4_bg_block_uninit) {
+      use(first, fs.base_metadata_blocks(i));
+      continue;
+    }
+
+    auto bitmap = read_bytes(
+      fd, groups[i].block_bitmap * fs.block_size, fs.block_size);
+    auto clusters = std::min(
+      fs.clusters_per_group,
+      (fs.blocks_count - first + fs.cluster_ratio - 1) / fs.cluster_ratio);
+
+    for (std::uint64_t bit = 0; bit < clusters;) {
+      if (!(bitmap[bit / 8] >> (bit % 8) & 1)) {
+        bit++;
+        continue;
+      }
+
+      auto run = bit;
+      while (run < clusters && bitmap[run / 8] >> (run % 8) & 1) {
+        run++;
+      }
+
+      use(first + bit * fs.cluster_ratio, (run - bit) * fs.cluster_ratio);
+      bit = run;
+    }
+  }
+
+  normalize(fs.block_size);
+}
+
+// Everything but the extents in the free-space B+tree sorted by block
+// number is allocated, including the B+trees themselves and the log.
+void
+allocation_map::read_xfs(int fd)
+{
+  auto sb = read_bytes(fd, 0, 512);
+  auto corrupted = std::runtime_error("corrupted XFS free-space B+tree");
+
+  auto block_size = get_be(sb.data() + 4, 4);
+  auto dblocks = get_be(sb.data() + 8, 8);
+  auto ag_blocks = get_be(sb.data() + 84, 4);
+  auto ag_count = get_be(sb.data() + 88, 4);
+  auto version = get_be(sb.data() + 100, 2) & 0xf;
+  auto sector_size = get_be(sb.data() + 102, 2);
+
+  if (!is_power_of_two(block_size) || block_size < 512 ||
+      block_size > 65536 || !is_power_of_two(sector_size) ||
+      sector_size < 512 || sector_size > block_size || ag_blocks == 0 ||
+      ag_count == 0 || dblocks > ag_blocks * ag_count || version < 4) {
+    throw std::runtime_error("corrupted XFS superblock");
+  }
+
+  fs_size = dblocks * block_size;
+
+  // Version 5 filesystems have checksums, and longer block headers for them.
+  std::uint64_t header_size = version >= 5 ? 56 : 16;
+  auto btree_magic = version >= 5 ? xfs_ab3b_magic : xfs_abtb_magic;
+  auto max_leaf_records = (block_size - header_size) / 8;
+  auto max_node_records = (block_size - header_size) / 12;
+
+  for (std::uint64_t ag = 0; ag < ag_count; ag++) {
+    auto ag_offset = ag * ag_blocks * block_size;
+    auto agf = read_bytes(fd, ag_offset + sector_size, 64);
+
+    auto length = get_be(agf.data() + 12, 4);
+    auto block = get_be(agf.data() + 16, 4);
+    auto levels = get_be(agf.data() + 28, 4);
+
+    if (get_be(agf.data(), 4) != xfs_agf_magic ||
+        get_be(agf.data() + 8, 4) != ag || length > ag_blocks ||
+        ag * ag_blocks + length > dblocks || levels == 0 || levels > 16) {
+      throw std::runtime_error("corrupted XFS allocation group header");
+    }
+
+    auto read_btree_block = [&](std::uint64_t level) {
+      if (block >= length) {
+        throw corrupted;
+      }
+
+      auto data = read_bytes(fd, ag_offset + block * block_size, block_size);
+      auto records = get_be(data.data() + 6, 2);
+
+      if (get_be(data.data(), 4) != btree_magic ||
+          get_be(data.data() + 4, 2) != level ||
+          records > (level ? max_node_records : max_leaf_records) ||
+          (level && records == 0)) {
+        throw corrupted;
+      }
+
+      return data;
+    };
+
+    // Down the leftmost pointers, then along the leaves.
+    for (auto level = levels - 1; level > 0; level--) {
+      auto node = read_btree_block(level);
+      block = get_be(node.data() + header_size + max_node_records * 8, 4);
+    }
+
+    std::uint64_t next = 0;
+    std::uint64_t leaves = 0;
+
+    while (block != xfs_null_block) {
+      if (++leaves > length) {
+        throw corrupted;
+      }
+
+      auto leaf = read_btree_block(0);
+      auto records = get_be(leaf.data() + 6, 2);
+
+      for (std::uint64_t i = 0; i < records; i++) {
+        auto record = leaf.data() + header_size + i * 8;
+        auto first = get_be(record, 4);
+        auto count = get_be(record + 4, 4);
+
+        if (first < next || first + count > length) {
+          throw corrupted;
+        }
+
+        if (first > next) {
+          extents.emplace_back(ag * ag_blocks + next, ag * ag_blocks + first);
+        }
+        next = first + count;
+      }
+
+      block = get_be(leaf.data() + 12, 4);
+    }
+
+    if (next < length) {
+      extents.emplace_back(ag * ag_blocks + next, ag * ag_blocks + length);
+    }
+  }
+
+  normalize(block_size);
+}
+
+void
+allocation_map::normalize(std::uint64_t unit)
+{
+  std::sort(extents.begin(), extents.end());
+
+  std::size_t kept = 0;
+
+  for (auto& extent : extents) {
+    auto begin = extent.first * unit;
+    auto end = std::min(extent.second * unit, fs_size);
+
+    if (begin >= end) {
+      continue;
+    }
+
+    if (kept && extents[kept - 1].second >= begin) {
+      extents[kept - 1].second = std::max(extents[kept - 1].second, end);
+    } else {
+      extents[kept++] = { begin, end };
+    }
+  }
+
+  extents.resize(kept);
+}
+
+std::uint64_t
+allocation_map::allocated_bytes() const
+{
+  std::uint64_t total = 0;
+
+  for (auto& extent : extents) {
+    total += extent.second - extent.first;
+  }
+
+  return total;
+}
+
+bool
+allocation_map::is_free(std::uint64_t offset, std::uint64_t size) const
+{
+  if (offset + size > fs_size) {
+    return false;
+  }
+
+  auto next = std::partition_point(
+    extents.begin(), extents.end(), [&](const auto& extent) {
+      return extent.second <= offset;
+    });
+
+  return next == extents.end() || next->first >= offset + size;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The parts of an image that hold data. For a filesystem image, that is
+// what the filesystem has allocated, read from its own metadata: the block
+// bitmaps of ext2/3/4, or the free-space B+trees of XFS. Only cleanly
+// unmounted images can be trusted: the metadata of a mounted or crashed
+// filesystem may be behind what it really uses.
+class allocation_map
+{
+public:
+  typedef std::vector<std::pair<std::uint64_t, std::uint64_t>> extent_list;
+
+  // Reads the metadata of the filesystem in fd, which has to be seekable.
+  // Throws std::runtime_error if it isn't ext4 or XFS, or if the metadata
+  // is inconsistent or waits for journal recovery.
+  explicit allocation_map(int fd);
+
+  // Allocated [begin, end) byte ranges, in any order, of an image of some
+  // other format, which covers `size` bytes.
+  allocation_map(const std::string& format,
+                 std::uint64_t size,
+                 extent_list allocated);
+
+  // "ext4", "xfs", or the format given.
+  const std::string& filesystem() const { return name; }
+
+  // Bytes covered by the filesystem, which may be fewer than in the image.
+  std::uint64_t size() const { return fs_size; }
+
+  std::uint64_t allocated_bytes() const;
+
+  // Whether nothing in [offset, offset + size) is allocated. Bytes past the
+  // end of the filesystem count as allocated.
+  bool is_free(std::uint64_t offset, std::uint64_t size) const;
+
+private:
+  void read_ext4(int fd);
+  void read_xfs(int fd);
+
+  // Sorts and merges the extents, which are given in units of `unit` bytes.
+  void normalize(std::uint64_t unit);
+
+  std::string name;
+  std::uint64_t fs_size = 0;
+
+  // Allocated [begin, end) byte ranges, sorted and disjoint.
+  extent_list extents;
+};
@@ -0,0 +1,397 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+
+#include "io_source.h"
+#include "uring.h"
+
+namespace {
+
+// Bytes read by each chain: most files are expected to fit.
+const std::size_t chain_read_size = 64 * 1024;
+
+// Chains each worker keeps in flight, each with up to two submission entries
+// at a time and a fixed-file slot of its own.
+const unsigned int chains_in_flight = 128;
+
+// Paths a worker takes from the list at a time.
+const std::size_t path_batch = 64;
+
+enum chain_op : unsigned int
+{
+  op_open,
+  op_read,
+  op_close,
+  chain_length
+};
+
+void
+checksum_plain(const std::string& path,
+               std::vector<char>& buffer,
+               file_checksum& result)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    result.error = errno;
+    return;
+  }
+
+  owned_fd file(fd, "open");
+  boost::crc_32_type csum;
+  std::uint64_t offset = 0;
+
+  buffer.resize(buffer_size);
+
+  try {
+    for (;;) {
+      auto n_read = pread_full(file, buffer.data(), buffer.size(), offset);
+      csum.process_bytes(buffer.data(), n_read);
+      offset += n_read;
+
+      if (n_read < buffer.size()) {
+        break;
+      }
+    }
+  } catch (const std::system_error& ex) {
+    result.error = ex.code().value();
+    return;
+  }
+
+  result.crc = csum.checksum();
+  result.size = offset;
+}
+
+class batch_run
+{
+public:
+  batch_run(const std::vector<std::string>& paths,
+            std::vector<file_checksum>& results)
+    : paths(paths)
+    , results(results)
+  {}
+
+  void work(bool use_uring);
+
+private:
+  // A worker's current batch of paths.
+  struct cursor
+  {
+    std::size_t next = 0;
+    std::size_t end = 0;
+  };
+
+  struct chain
+  {
+    std::size_t path;
+    int results[chain_length];
+
+    // What was last submitted, and how many of its completions are still
+    // to come.
+    enum
+    {
+      opening,
+      reading,
+      closing
+    } stage;
+    unsigned int outstanding;
+
+    boost::crc_32_type csum;
+    std::uint64_t offset;
+    std::unique_ptr<char[]> buffer{ new char[chain_read_size] };
+  };
+
+  bool next_path(cursor& batch, std::size_t& path);
+  void work_plain();
+  void work_uring(uring& ring);
+  void submit(uring& ring, unsigned int slot, chain& c);
+  void submit_read(uring& ring, unsigned int slot, chain& c);
+  void submit_close(uring& ring, unsigned int slot, chain& c);
+  bool advance(uring& ring,
+               unsigned int slot,
+               chain& c,
+               std::vector<char>& buffer);
+
+  const std::vector<std::string>& paths;
+  std::vector<file_checksum>& results;
+  std::atomic<std::size_t> next{ 0 };
+};
+
+// Takes paths from the shared list a batch at a time, so that workers
+// don't contend on it for every file.
+bool
+batch_run::next_path(cursor& batch, std::size_t& path)
+{
+  if (batch.next == batch.end) {
+    batch.next = next.fetch_add(path_batch, std::memory_order_relaxed);
+    batch.end = std::min(batch.next + path_batch, paths.size());
+
+    if (batch.next >= paths.size()) {
+      batch.next = batch.end;
+      return false;
+    }
+  }
+
+  path = batch.next++;
+  return true;
+}
+
+void
+batch_run::work(bool use_uring)
+{
+  if (use_uring) {
+    std::unique_ptr<uring> ring;
+
+    try {
+      ring = std::make_unique<uring>(chains_in_flight * chain_length);
+      ring->register_files(chains_in_flight);
+    } catch (const std::system_error&) {
+      ring.reset();
+    }
+
+    if (ring) {
+      work_uring(*ring);
+      return;
+    }
+  }
+
+  work_plain();
+}
+
+void
+batch_run::work_plain()
+{
+  std::vector<char> buffer;
+  cursor batch;
+  std::size_t path;
+
+  while (next_path(batch, path)) {
+    checksum_plain(paths[path], buffer, results[path]);
+  }
+}
+
+void
+batch_run::work_uring(uring& ring)
+{
+  std::vector<chain> chains(chains_in_flight);
+  std::vector<unsigned int> free_slots;
+  std::vector<char> buffer;
+  cursor batch;
+  unsigned int in_flight = 0;
+  bool exhausted = false;
+
+  for (unsigned int slot = chains_in_flight; slot > 0; slot--) {
+    free_slots.push_back(slot - 1);
+  }
+
+  for (;;) {
+    while (!exhausted && !free_slots.empty()) {
+      auto slot = free_slots.back();
+      auto& c = chains[slot];
+
+      if (!next_path(batch, c.path)) {
+        exhausted = true;
+        break;
+      }
+
+      free_slots.pop_back();
+      submit(ring, slot, c);
+      in_flight++;
+    }
+
+    if (in_flight == 0) {
+      break;
+    }
+
+    ring.enter(1);
+
+    while (auto cqe = ring.peek()) {
+      auto slot = cqe->user_data / chain_length;
+      auto op = cqe->user_data % chain_length;
+      auto& c = chains[slot];
+
+      c.results[op] = cqe->res;
+      ring.seen();
+
+      if (--c.outstanding == 0 && advance(ring, slot, c, buffer)) {
+        free_slots.push_back(slot);
+        in_flight--;
+      }
+    }
+  }
+}
+
+// Queues the open and the first read of one file, linked. The link is hard,
+// so that whatever the open returns, the read completes without cancelling
+// anything after it; the rest of the file is read, and the slot closed, as
+// the completions come in. The file is only ever opened once, so whatever
+// replaces it meanwhile isn't mixed in.
+//
+// There is no statx: it walks the path again, which costs a quarter of the
+// throughput on small files, and a short read tells the size all the same.
+void
+batch_run::submit(uring& ring, unsigned int slot, chain& c)
+{
+  auto open = ring.get_sqe();
+
+  open->opcode = IORING_OP_OPENAT;
+  open->fd = AT_FDCWD;
+  open->addr = reinterpret_cast<std::uint64_t>(paths[c.path].c_str());
+  open->open_flags = O_RDONLY | O_CLOEXEC;
+  open->file_index = slot + 1;
+  open->flags = IOSQE_IO_HARDLINK;
+  open->user_data = slot * chain_length + op_open;
+
+  c.csum.reset();
+  c.offset = 0;
+  submit_read(ring, slot, c);
+  c.stage = chain::opening;
+  c.outstanding = 2;
+}
+
+void
+batch_run::submit_read(uring& ring, unsigned int slot, chain& c)
+{
+  auto read = ring.get_sqe();
+
+  read->opcode = IORING_OP_READ;
+  read->fd = slot;
+  read->flags = IOSQE_FIXED_FILE;
+  read->addr = reinterpret_cast<std::uint64_t>(c.buffer.get());
+  read->len = chain_read_size;
+  read->off = c.offset;
+  read->user_data = slot * chain_length + op_read;
+
+  c.stage = chain::reading;
+  c.outstanding = 1;
+}
+
+void
+batch_run::submit_close(uring& ring, unsigned int slot, chain& c)
+{
+  auto close = ring.get_sqe();
+
+  close->opcode = IORING_OP_CLOSE;
+  close->file_index = slot + 1;
+  close->user_data = slot * chain_length + op_close;
+
+  c.stage = chain::closing;
+  c.outstanding = 1;
+}
+
+// Acts on the completions of what a chain last submitted. Returns true once
+// the file is done with and its slot is empty again.
+bool
+batch_run::advance(uring& ring,
+                   unsigned int slot,
+                   chain& c,
+                   std::vector<char>& buffer)
+{
+  auto& result = results[c.path];
+
+  if (c.stage == chain::closing) {
+    return true;
+  }
+
+  if (c.stage == chain::opening) {
+    auto opened = c.results[op_open];
+
+    // Kernels that can't open into a fixed slot reject the request itself.
+    if (opened == -EINVAL) {
+      checksum_plain(paths[c.path], buffer, result);
+      return true;
+    }
+
+    // Nothing was opened, and the read failed for want of a file.
+    if (opened < 0) {
+      result.error = -opened;
+      return true;
+    }
+  }
+
+  auto n_read = c.results[op_read];
+
+  if (n_read < 0) {
+    result.error = -n_read;
+    submit_close(ring, slot, c);
+    return false;
+  }
+
+  c.csum.process_bytes(c.buffer.get(), n_read);
+  c.offset += n_read;
+
+  if (std::size_t(n_read) == chain_read_size) {
+    submit_read(ring, slot, c);
+    return false;
+  }
+
+  result.crc = c.csum.checksum();
+  result.size = c.offset;
+  submit_close(ring, slot, c);
+  return false;
+}
+}
+
+std::vector<file_checksum>
+checksum_files(const std::vector<std::string>& paths,
+               unsigned int concurrency,
+               io_method io)
+{
+  if (concurrency <= 0) {
+    throw std::invalid_argument("concurrency should be positive");
+  }
+
+  if (io != io_method::uring && io != io_method::pread) {
+    throw std::invalid_argument("files are read with io_uring or pread");
+  }
+
+  std::vector<file_checksum> results(paths.size());
+  batch_run run(paths, results);
+
+  bool use_uring = io == io_method::uring && uring::supported();
+  auto workers = std::min<std::size_t>(
+    concurrency, (paths.size() + path_batch - 1) / path_batch);
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::exception_ptr error;
+
+  auto work = [&]() {
+    try {
+      run.work(use_uring);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  };
+
+  for (unsigned int i = 1; i < workers; i++) {
+    threads.push_back(std::thread(work));
+  }
+
+  work();
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  return results;
+}
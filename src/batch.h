@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "signature.h"
+
+struct file_checksum
+{
+  std::uint32_t crc = 0;
+  std::uint64_t size = 0;
+
+  // The errno of whatever failed, or zero.
+  int error = 0;
+};
+
+// Computes the CRC-32 of every file in `paths`, in the same order, on up to
+// `concurrency` threads. Meant for many small files, where the system calls
+// around each read cost more than the read: with io_method::uring, every
+// file is opened into a fixed-file slot and read by linked requests, many
+// files per submission, and read on through the same slot if larger than
+// the first read. io_method::pread, and kernels without io_uring, do it all
+// with plain system calls; other methods are rejected.
+std::vector<file_checksum>
+checksum_files(const std::vector<std::string>& paths,
+               unsigned int concurrency,
+               io_method io);
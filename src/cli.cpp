@@ -1,9 +1,22 @@
+#include <algorithm>
+#include <cctype>
 #include <cerrno>
+#include <chrono>
 #include <cstddef>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <sstream>
 #include <system_error>
 #include <thread>
+#include <vector>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -11,7 +24,19 @@
 #include <boost/program_options.hpp>
 #include <boost/safe_numerics/checked_integer.hpp>
 
+#include "allocation.h"
+#include "batch.h"
+#include "consensus.h"
+#include "diff.h"
+#include "history.h"
+#include "http.h"
+#include "metrics.h"
+#include "pack.h"
+#include "parity.h"
+#include "repair.h"
+#include "sigcache.h"
 #include "signature.h"
+#include "simulated_device.h"
 #include "unique_resource/unique_resource.hpp"
 
 namespace po = boost::program_options;
@@ -93,22 +118,180 @@ open_fd(const char* path, Args... args)
   return std_experimental::make_unique_resource(std::move(fd), &close);
 }
 
+void
+print_summary(const signature_summary& summary,
+              const signature_options& options,
+              const std::string& input_name)
+{
+  if (options.file_digest) {
+    auto flags = std::cout.flags();
+
+    std::cout << std::hex << std::setfill('0') << std::setw(8)
+              << summary.file_digest << "  " << input_name << std::endl;
+    std::cout.flags(flags);
+  }
+}
+
+// Makes the blocks added to the pack findable by the next run.
+void
+save_pack(const signature_options& options)
+{
+  if (options.pack) {
+    options.pack->save_index();
+
+    std::cerr << "packed " << options.pack->blocks_added() << " new blocks, "
+              << options.pack->bytes_added() << " bytes" << std::endl;
+  }
+}
+
+void
+write_heatmap(const signature_summary& summary, const std::string& path)
+{
+  if (path.empty()) {
+    return;
+  }
+
+  std::ofstream stream;
+  stream.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+  stream.open(path);
+
+  auto suffix = std::string(".json");
+  if (path.size() >= suffix.size() &&
+      path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+    write_heatmap_json(stream, summary.heatmap);
+  } else {
+    write_heatmap_csv(stream, summary.heatmap);
+  }
+}
+
+// Signing a small file takes less time than building the option table of
+// process_command_line(), so a plain signing run, with at most -i, -o,
+// --block-size and -j, given separately from their values or as
+// positionals, is parsed by hand. Returns false without doing anything if
+// the command line has anything else, or anything to report an error about,
+// leaving it to process_command_line().
+bool
+sign_plain_command_line(int argc, char* argv[])
+{
+  const char* input_path = nullptr;
+  const char* output_path = nullptr;
+  const char* block_size_text = nullptr;
+  const char* jobs_text = nullptr;
+  const char** positionals[] = { &input_path, &output_path, &block_size_text };
+  std::size_t positional = 0;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    const char** value;
+
+    if (arg == "-i" || arg == "--input") {
+      value = &input_path;
+    } else if (arg == "-o" || arg == "--output") {
+      value = &output_path;
+    } else if (arg == "--block-size") {
+      value = &block_size_text;
+    } else if (arg == "-j" || arg == "--jobs") {
+      value = &jobs_text;
+    } else if (arg.empty() || arg[0] == '-' ||
+               positional == std::size(positionals)) {
+      return false;
+    } else {
+      value = positionals[positional++];
+
+      if (*value) {
+        return false;
+      }
+
+      *value = argv[i];
+      continue;
+    }
+
+    if (*value || ++i == argc || argv[i][0] == '-') {
+      return false;
+    }
+
+    *value = argv[i];
+  }
+
+  if (!input_path || !output_path) {
+    return false;
+  }
+
+  signature_options signature;
+  signature.concurrency = std::thread::hardware_concurrency() + 1;
+
+  if (block_size_text) {
+    std::istringstream stream(block_size_text);
+    human_readable_size block_size;
+
+    if (!(stream >> block_size) || stream.peek() != EOF) {
+      return false;
+    }
+    signature.block_size = block_size.bytes;
+  }
+
+  if (jobs_text) {
+    std::istringstream stream(jobs_text);
+
+    if (!std::isdigit(static_cast<unsigned char>(jobs_text[0])) ||
+        !(stream >> signature.concurrency) || stream.peek() != EOF) {
+      return false;
+    }
+  }
+
+  auto out_file =
+    open_fd(output_path,
+            O_WRONLY | O_CREAT,
+            S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  auto in_file = open_fd(input_path, O_RDONLY);
+
+  generate_signature(std::vector<int>{ in_file }, out_file, signature);
+  return true;
+}
+
 void
 process_command_line(int argc, char* argv[])
 {
-  std::string input_path, output_path;
+  std::vector<std::string> input_paths, mirror_paths;
+  std::string output_path, simulate, url, io, format, heatmap_path;
+  std::string metrics_listen, metrics_path, entropy_path, copy_path;
+  std::string parity_path, pack_path, recipe_path, placement;
+  double metrics_interval;
+  bool skip_free;
   human_readable_size block_size;
-  unsigned int jobs;
+  signature_options signature;
 
   po::options_description options;
 
   // clang-format off
   options.add_options()
     ("help,h", "produce help message")
-    ("input,i", po::value(&input_path)->required(), "input file")
+    ("input,i", po::value(&input_paths), "input file; repeat to sign the concatenation of several")
     ("output,o", po::value(&output_path)->required(), "output file")
     ("block-size", po::value(&block_size)->default_value({1024 * 1024}), "block size")
-    ("jobs,j", po::value(&jobs)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+    ("jobs,j", po::value(&signature.concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+    ("io", po::value(&io)->default_value("pread"), "how to read the input: pread, mmap, io_uring, direct, memory or stream")
+    ("placement", po::value(&placement)->default_value("none"), "where jobs run: none, or cores to pin one per physical core before using SMT siblings, with jobs sharing an L3 cache on neighbouring parts of the input")
+    ("format", po::value(&format)->default_value("raw"), "what the input is: raw, or qcow2 to sign the virtual disk in it")
+    ("mirror", po::value(&mirror_paths), "an identical copy of the input, e.g. on another device, to spread reads over; repeat for more")
+    ("cross-check", po::bool_switch(&signature.mirror_cross_check), "also read every block from a second mirror, and fail if they differ")
+    ("skip-free", po::bool_switch(&skip_free), "the input is an ext4 or XFS image: don't read blocks the filesystem has nothing in, and sign them as zeroed")
+    ("url", po::value(&url), "read the input from this http:// URL, with a Range request per claim and a connection per job, instead of from a file")
+    ("simulate", po::value(&simulate), "read from a simulated device instead of the input file, e.g. size=1G,latency=exp:2ms,bandwidth=150M,queue-depth=1,seek=8ms")
+    ("file-digest", po::bool_switch(&signature.file_digest), "also print the CRC-32 of the whole input")
+    ("copy-to", po::value(&copy_path), "also copy the input to this file while signing it")
+    ("parity", po::value(&parity_path), "also write erasure-coding parity to this file, for the rebuild subcommand")
+    ("parity-group", po::value(&signature.parity_group)->default_value(signature.parity_group), "number of blocks covered by each set of parity blocks")
+    ("parity-count", po::value(&signature.parity_count)->default_value(signature.parity_count), "parity blocks per group: 1 for XOR, more for Reed-Solomon")
+    ("pack", po::value(&pack_path), "also append blocks not already there to this pack file, indexed in the same path with .idx appended")
+    ("recipe", po::value(&recipe_path), "with --pack, write where each block of the input is in the pack to this file")
+    ("entropy-output", po::value(&entropy_path), "also write the estimated entropy of each block, in bits per byte, as floats to this file")
+    ("heatmap", po::value(&heatmap_path), "write per-region read latency and throughput to this file, as JSON if it ends with .json, CSV otherwise")
+    ("heatmap-bins", po::value(&signature.heatmap_bins)->default_value(100), "number of regions in the heatmap")
+    ("straggler-percentile", po::value(&signature.straggler_percentile)->default_value(signature.straggler_percentile), "re-issue reads slower than twice this latency percentile (0 to disable)")
+    ("metrics-listen", po::value(&metrics_listen), "serve Prometheus metrics over HTTP on this host:port")
+    ("metrics-file", po::value(&metrics_path), "write Prometheus metrics to this file, for a textfile collector")
+    ("metrics-interval", po::value(&metrics_interval)->default_value(10), "seconds between writes of --metrics-file")
   ;
   // clang-format on
 
@@ -126,29 +309,912 @@ process_command_line(int argc, char* argv[])
 
   if (vm.count("help")) {
     std::cerr << "Usage: " << argv[0] << " [options...]" << std::endl;
+    std::cerr << "       " << argv[0]
+              << " verify|diff|rebuild|repair|consensus|history|cache|batch [options...]"
+              << std::endl;
     std::cerr << options << std::endl;
     return;
   }
 
   po::notify(vm);
 
-  auto in_file = open_fd(input_path.c_str(), O_RDONLY);
+  if (vm.count("input") + vm.count("simulate") + vm.count("url") != 1) {
+    throw po::error("exactly one of --input, --simulate and --url is required");
+  }
+
+  if (mirror_paths.empty() && signature.mirror_cross_check) {
+    throw po::error("--cross-check requires --mirror");
+  }
+
+  if (!mirror_paths.empty() && input_paths.size() != 1) {
+    throw po::error("--mirror requires a single --input");
+  }
+
+  if (skip_free && input_paths.size() != 1) {
+    throw po::error("--skip-free requires a single --input");
+  }
+
+  signature.format = parse_input_format(format);
+
+  if (signature.format != input_format::raw &&
+      (input_paths.size() != 1 || skip_free)) {
+    throw po::error("--format requires a single --input, without --skip-free");
+  }
 
   auto out_file =
     open_fd(output_path.c_str(),
             O_WRONLY | O_CREAT,
             S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 
-  generate_signature(in_file, out_file, block_size.bytes, jobs);
+  std::optional<decltype(out_file)> entropy_file;
+
+  if (!entropy_path.empty()) {
+    entropy_file.emplace(
+      open_fd(entropy_path.c_str(),
+              O_WRONLY | O_CREAT,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH));
+    signature.fd_entropy = *entropy_file;
+  }
+
+  std::optional<decltype(out_file)> copy_file;
+
+  if (!copy_path.empty()) {
+    copy_file.emplace(
+      open_fd(copy_path.c_str(),
+              O_WRONLY | O_CREAT | O_TRUNC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH));
+    signature.fd_copy = *copy_file;
+  }
+
+  std::optional<decltype(out_file)> parity_file;
+
+  if (!parity_path.empty()) {
+    parity_file.emplace(
+      open_fd(parity_path.c_str(),
+              O_WRONLY | O_CREAT | O_TRUNC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH));
+    signature.fd_parity = *parity_file;
+  }
+
+  std::optional<decltype(out_file)> recipe_file;
+
+  if (!recipe_path.empty()) {
+    if (pack_path.empty()) {
+      throw po::error("--recipe requires --pack");
+    }
+
+    recipe_file.emplace(
+      open_fd(recipe_path.c_str(),
+              O_WRONLY | O_CREAT,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH));
+    signature.fd_recipe = *recipe_file;
+  }
+
+  if (!pack_path.empty()) {
+    signature.pack = std::make_shared<block_pack>(pack_path);
+  }
+
+  signature.block_size = block_size.bytes;
+  signature.io = parse_io_method(io);
+  signature.placement = parse_thread_placement(placement);
+
+  if (heatmap_path.empty()) {
+    signature.heatmap_bins = 0;
+  }
+
+  if (metrics_interval <= 0) {
+    throw po::error("--metrics-interval should be positive");
+  }
+
+  std::unique_ptr<metrics_exporter> exporter;
+
+  if (!metrics_listen.empty() || !metrics_path.empty()) {
+    signature.metrics =
+      std::make_shared<signing_metrics>(std::max(1u, signature.concurrency));
+    exporter = std::make_unique<metrics_exporter>(
+      signature.metrics,
+      metrics_listen,
+      metrics_path,
+      std::chrono::milliseconds(std::int64_t(metrics_interval * 1000)));
+  }
+
+  if (vm.count("simulate")) {
+    auto device = std::make_shared<simulated_device>(
+      parse_simulated_device(simulate));
+
+    auto summary = generate_signature(device, out_file, signature);
+    save_pack(signature);
+    print_summary(summary, signature, "-");
+    write_heatmap(summary, heatmap_path);
+    return;
+  }
+
+  if (vm.count("url")) {
+    auto object = std::make_shared<http_object>(url);
+
+    auto summary = generate_signature(object, out_file, signature);
+    save_pack(signature);
+    print_summary(summary, signature, url);
+    write_heatmap(summary, heatmap_path);
+    return;
+  }
+
+  std::vector<decltype(open_fd("", O_RDONLY))> in_files;
+  std::vector<int> in_fds;
+  std::string input_name;
+
+  in_files.reserve(input_paths.size());
+
+  for (auto& path : input_paths) {
+    in_files.push_back(open_fd(path.c_str(), O_RDONLY));
+    in_fds.push_back(in_files.back());
+    input_name += (input_name.empty() ? "" : " ") + path;
+  }
+
+  std::vector<decltype(open_fd("", O_RDONLY))> mirror_files;
+
+  mirror_files.reserve(mirror_paths.size());
+
+  for (auto& path : mirror_paths) {
+    mirror_files.push_back(open_fd(path.c_str(), O_RDONLY));
+    signature.fd_mirrors.push_back(mirror_files.back());
+  }
+
+  if (skip_free) {
+    auto allocation = std::make_shared<allocation_map>(in_fds[0]);
+
+    std::cerr << allocation->filesystem() << ": "
+              << allocation->allocated_bytes() << " of " << allocation->size()
+              << " bytes allocated" << std::endl;
+    signature.allocation = std::move(allocation);
+  }
+
+  auto summary = generate_signature(in_fds, out_file, signature);
+  save_pack(signature);
+  print_summary(summary, signature, input_name);
+  write_heatmap(summary, heatmap_path);
+
+  for (auto block : summary.mirror_mismatches) {
+    std::cerr << "block " << block << " at offset " << block * block_size.bytes
+              << " differs between mirrors" << std::endl;
+  }
+
+  if (!summary.mirror_mismatches.empty()) {
+    throw std::runtime_error(std::to_string(summary.mirror_mismatches.size()) +
+                             " blocks differ between mirrors");
+  }
+}
+
+void
+print_verify_result(const verify_result& result,
+                    const verify_options& verify,
+                    std::size_t block_size)
+{
+  auto flags = std::cout.flags();
+
+  for (auto block : result.bad_blocks) {
+    std::cout << "block " << block << " at offset " << block * block_size
+              << " does not match" << std::endl;
+  }
+
+  std::cout << std::fixed << std::setprecision(1) << "checked "
+            << result.blocks_checked << " of " << result.blocks_total
+            << " blocks ("
+            << (result.blocks_total
+                  ? 100.0 * result.blocks_checked / result.blocks_total
+                  : 100.0)
+            << "%) in " << result.elapsed.count() / 1000.0 << " s, seed "
+            << verify.seed << std::endl;
+
+  std::cout << result.bad_blocks.size() << " corrupted; with "
+            << std::defaultfloat << std::setprecision(6)
+            << 100 * verify.confidence
+            << "% confidence, at most " << std::fixed << std::setprecision(3)
+            << 100 * result.corrupted_bound << "% of ";
+
+  if (result.run_blocks == 1) {
+    std::cout << "the blocks are corrupted" << std::endl;
+  } else {
+    std::cout << "the " << result.runs_total << " runs of "
+              << result.run_blocks << " blocks have a corrupted block"
+              << std::endl;
+  }
+
+  std::cout.flags(flags);
 }
 
+int
+verify_command(int argc, char* argv[])
+{
+  std::string input_path, signature_path, io, format;
+  human_readable_size block_size;
+  signature_options signature;
+  verify_options verify;
+  double time_budget;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("input,i", po::value(&input_path)->required(), "input file")
+    ("signature,s", po::value(&signature_path)->required(), "signature of the input")
+    ("block-size", po::value(&block_size)->default_value({1024 * 1024}), "block size the signature was made with")
+    ("jobs,j", po::value(&signature.concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+    ("io", po::value(&io)->default_value("pread"), "how to read the input: pread, mmap, io_uring, direct or memory")
+    ("format", po::value(&format)->default_value("raw"), "what the input is: raw, or qcow2 to check the virtual disk in it")
+    ("coverage", po::value(&verify.coverage)->default_value(verify.coverage), "fraction of the blocks to check")
+    ("time-budget", po::value(&time_budget)->default_value(0), "stop checking after this many seconds (0 for no limit)")
+    ("seed", po::value(&verify.seed), "seed of the random sample (random by default)")
+    ("confidence", po::value(&verify.confidence)->default_value(verify.confidence), "confidence of the bound on corrupted runs of blocks")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("input", 1);
+  positional.add("signature", 1);
+  positional.add("block-size", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: verify [options...]" << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  if (!vm.count("seed")) {
+    std::random_device random;
+    verify.seed = (std::uint64_t(random()) << 32) | random();
+  }
+
+  signature.block_size = block_size.bytes;
+  signature.io = parse_io_method(io);
+  signature.format = parse_input_format(format);
+  verify.time_budget =
+    std::chrono::milliseconds(std::int64_t(time_budget * 1000));
+
+  auto in_file = open_fd(input_path.c_str(), O_RDONLY);
+  auto signature_file = open_fd(signature_path.c_str(), O_RDONLY);
+
+  auto result = verify_signature(in_file, signature_file, signature, verify);
+  print_verify_result(result, verify, signature.block_size);
+
+  // Nothing checked proves nothing, e.g. with a budget too short to read
+  // anything.
+  if (result.blocks_checked == 0 && result.blocks_total != 0) {
+    std::cerr << "no blocks were checked" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return result.bad_blocks.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Prints byte ranges of the input, as they were when signed: a changed
+// range ending at the last block may be shorter than shown.
+void
+print_diff(const signature_diff& diff, std::size_t block_size)
+{
+  for (auto& range : diff.changed) {
+    std::cout << "changed " << range.first * block_size << ' '
+              << (range.first + range.count) * block_size << std::endl;
+  }
+
+  if (diff.blocks_b > diff.blocks_a) {
+    std::cout << "added " << diff.blocks_a * block_size << ' '
+              << diff.blocks_b * block_size << std::endl;
+  } else if (diff.blocks_a > diff.blocks_b) {
+    std::cout << "removed " << diff.blocks_b * block_size << ' '
+              << diff.blocks_a * block_size << std::endl;
+  }
+}
+
+int
+diff_command(int argc, char* argv[])
+{
+  std::string old_path, new_path;
+  human_readable_size block_size;
+  unsigned int concurrency;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("old", po::value(&old_path)->required(), "signature to compare against")
+    ("new", po::value(&new_path)->required(), "signature to compare")
+    ("block-size", po::value(&block_size)->default_value({1024 * 1024}), "block size of both signatures, to report offsets in bytes")
+    ("jobs,j", po::value(&concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("old", 1);
+  positional.add("new", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: diff [options...] OLD NEW" << std::endl;
+    std::cerr << "Prints the byte ranges that differ, one per line, as "
+                 "'changed|added|removed START END'."
+              << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  auto old_file = open_fd(old_path.c_str(), O_RDONLY);
+  auto new_file = open_fd(new_path.c_str(), O_RDONLY);
+
+  auto diff = diff_signatures(old_file, new_file, concurrency);
+  print_diff(diff, block_size.bytes);
+
+  bool same = diff.changed.empty() && diff.blocks_a == diff.blocks_b;
+  return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int
+rebuild_command(int argc, char* argv[])
+{
+  std::string input_path, signature_path, parity_path;
+  unsigned int concurrency;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("input,i", po::value(&input_path)->required(), "input file to repair in place")
+    ("signature,s", po::value(&signature_path)->required(), "signature of the input")
+    ("parity,p", po::value(&parity_path)->required(), "parity written along with the signature")
+    ("jobs,j", po::value(&concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("input", 1);
+  positional.add("signature", 1);
+  positional.add("parity", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: rebuild [options...]" << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  auto in_file = open_fd(input_path.c_str(), O_RDWR);
+  auto signature_file = open_fd(signature_path.c_str(), O_RDONLY);
+  auto parity_file = open_fd(parity_path.c_str(), O_RDONLY);
+
+  auto result =
+    rebuild_from_parity(in_file, signature_file, parity_file, concurrency);
+
+  for (auto block : result.rebuilt) {
+    std::cout << "rebuilt block " << block << std::endl;
+  }
+
+  for (auto block : result.unrecoverable) {
+    std::cout << "cannot rebuild block " << block << std::endl;
+  }
+
+  return result.unrecoverable.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int
+repair_command(int argc, char* argv[])
+{
+  std::string target_path, good_path, signature_path, io;
+  human_readable_size block_size;
+  signature_options signature;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("target", po::value(&target_path)->required(), "corrupted copy, repaired in place")
+    ("good", po::value(&good_path)->required(), "good copy to take the blocks from")
+    ("signature,s", po::value(&signature_path), "signature of the good data; without one, both copies are signed and compared")
+    ("block-size", po::value(&block_size)->default_value({1024 * 1024}), "block size")
+    ("jobs,j", po::value(&signature.concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+    ("io", po::value(&io)->default_value("pread"), "how to read the inputs: pread, mmap, io_uring, direct or memory")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("target", 1);
+  positional.add("good", 1);
+  positional.add("signature", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: repair [options...] TARGET GOOD [SIGNATURE]"
+              << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  signature.block_size = block_size.bytes;
+  signature.io = parse_io_method(io);
+
+  auto target_file = open_fd(target_path.c_str(), O_RDWR);
+  auto good_file = open_fd(good_path.c_str(), O_RDONLY);
+  std::optional<decltype(good_file)> signature_file;
+
+  if (!signature_path.empty()) {
+    signature_file.emplace(open_fd(signature_path.c_str(), O_RDONLY));
+  }
+
+  auto result = repair_from_replica(
+    target_file, good_file, signature_file ? *signature_file : -1, signature);
+
+  for (auto& range : result.repaired) {
+    std::cout << "repaired " << range.first * signature.block_size << ' '
+              << (range.first + range.count) * signature.block_size
+              << std::endl;
+  }
+
+  for (auto block : result.unrecoverable) {
+    std::cout << "good copy of block " << block << " is corrupted too"
+              << std::endl;
+  }
+
+  for (auto block : result.failed) {
+    std::cout << "block " << block << " still corrupted after writing"
+              << std::endl;
+  }
+
+  std::cerr << result.bytes_written << " bytes written" << std::endl;
+
+  bool ok = result.unrecoverable.empty() && result.failed.empty();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int
+consensus_command(int argc, char* argv[])
+{
+  std::vector<std::string> paths;
+  human_readable_size block_size;
+  unsigned int concurrency;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("signature", po::value(&paths)->required(), "signatures of the replicas")
+    ("block-size", po::value(&block_size)->default_value({1024 * 1024}), "block size of the signatures, to report offsets in bytes")
+    ("jobs,j", po::value(&concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("signature", -1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: consensus [options...] SIGNATURE..." << std::endl;
+    std::cerr << "Prints the byte ranges where replicas diverge, with the "
+                 "ones that disagree with the majority."
+              << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  std::vector<decltype(open_fd("", O_RDONLY))> files;
+  std::vector<int> fds;
+
+  files.reserve(paths.size());
+
+  for (auto& path : paths) {
+    files.push_back(open_fd(path.c_str(), O_RDONLY));
+    fds.push_back(files.back());
+  }
+
+  bool diverged = false;
+
+  signature_consensus(fds, concurrency, [&](const consensus_range& range) {
+    diverged = true;
+
+    std::cout << range.first * block_size.bytes << ' '
+              << (range.first + range.count) * block_size.bytes
+              << (range.no_majority ? " no majority:" : " wrong:");
+
+    for (unsigned int i = 0; i < paths.size(); i++) {
+      if (range.disagreeing & (std::uint64_t(1) << i)) {
+        std::cout << ' ' << paths[i];
+      }
+    }
+
+    std::cout << '\n';
+  });
+
+  std::cout.flush();
+  return diverged ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+std::ostream&
+print_checksum(std::ostream& stream, std::uint32_t checksum)
+{
+  char text[9];
+  std::snprintf(text, sizeof(text), "%08x", checksum);
+  return stream << text;
+}
+
+int
+history_command(int argc, char* argv[])
+{
+  std::string action, store, argument, output_path, label;
+  std::uint64_t first_block, block_count;
+  unsigned int concurrency;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("action", po::value(&action)->required(), "init, add, list, get or log")
+    ("store", po::value(&store)->required(), "history directory")
+    ("argument", po::value(&argument), "signature to init/add, or version to get")
+    ("output,o", po::value(&output_path), "output file for get")
+    ("label,l", po::value(&label)->default_value(""), "label of the version to init/add, such as its date")
+    ("block,b", po::value(&first_block)->default_value(0), "first block to log")
+    ("count,c", po::value(&block_count)->default_value(1), "number of blocks to log")
+    ("jobs,j", po::value(&concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("action", 1);
+  positional.add("store", 1);
+  positional.add("argument", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: history init|add STORE SIGNATURE [options...]\n"
+                 "       history list STORE\n"
+                 "       history get STORE VERSION -o OUTPUT\n"
+                 "       history log STORE [--block N] [--count N]"
+              << std::endl;
+    std::cerr << "Keeps successive signatures of the same data as deltas, "
+                 "and answers when blocks changed."
+              << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  if ((action == "init" || action == "add" || action == "get") &&
+      argument.empty()) {
+    throw std::invalid_argument(action + " needs a third argument");
+  }
+
+  if (action == "init") {
+    auto signature_file = open_fd(argument.c_str(), O_RDONLY);
+    signature_history::create(store, signature_file, label);
+    return EXIT_SUCCESS;
+  }
+
+  signature_history history(store);
+
+  if (action == "add") {
+    auto signature_file = open_fd(argument.c_str(), O_RDONLY);
+    auto version = history.add(signature_file, label, concurrency);
+
+    std::cout << "version " << version << ": "
+              << history.versions()[version].changes << " changed blocks"
+              << std::endl;
+  } else if (action == "list") {
+    for (auto& version : history.versions()) {
+      std::cout << version.number << ' '
+                << (version.label.empty() ? "-" : version.label) << ' '
+                << version.blocks << " blocks, " << version.changes
+                << " changed\n";
+    }
+    std::cout.flush();
+  } else if (action == "get") {
+    if (output_path.empty()) {
+      throw std::invalid_argument("get needs --output");
+    }
+
+    auto out_file =
+      open_fd(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    history.reconstruct(std::stoul(argument), out_file);
+  } else if (action == "log") {
+    for (auto& change : history.changes(first_block, block_count)) {
+      auto& version = history.versions()[change.version];
+
+      std::cout << change.version << ' '
+                << (version.label.empty() ? "-" : version.label) << ' '
+                << change.block << ' ';
+
+      switch (change.kind) {
+        case block_change_kind::changed:
+          print_checksum(std::cout, change.before) << " -> ";
+          print_checksum(std::cout, change.after) << '\n';
+          break;
+        case block_change_kind::appeared:
+          print_checksum(std::cout << "appeared ", change.after) << '\n';
+          break;
+        case block_change_kind::removed:
+          print_checksum(std::cout << "removed ", change.before) << '\n';
+          break;
+      }
+    }
+    std::cout.flush();
+  } else {
+    throw std::invalid_argument("unknown history action: " + action);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Parses FIRST or FIRST-LAST, inclusive, adding the blocks to `blocks`.
+void
+parse_block_range(const std::string& text, std::vector<std::uint64_t>& blocks)
+{
+  auto dash = text.find('-');
+
+  std::size_t parsed;
+  auto first = std::stoull(text.substr(0, dash), &parsed);
+  auto last = first;
+
+  if (dash != std::string::npos) {
+    last = std::stoull(text.substr(dash + 1), &parsed);
+    parsed += dash + 1;
+  }
+
+  if (parsed != text.size() || last < first) {
+    throw std::invalid_argument("bad block range '" + text + "'");
+  }
+
+  for (auto block = first; block <= last; block++) {
+    blocks.push_back(block);
+  }
+}
+
+int
+cache_command(int argc, char* argv[])
+{
+  std::string input_path, cache_path, io;
+  std::vector<std::string> ranges;
+  human_readable_size block_size;
+  signature_options signature;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("input,i", po::value(&input_path)->required(), "input file")
+    ("blocks", po::value(&ranges)->required(), "blocks to print, as N or FIRST-LAST")
+    ("cache", po::value(&cache_path), "cache file (default: the input path with .sigcache appended)")
+    ("block-size", po::value(&block_size)->default_value({1024 * 1024}), "block size")
+    ("jobs,j", po::value(&signature.concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+    ("io", po::value(&io)->default_value("pread"), "how to read the blocks not cached yet: pread, mmap, io_uring, direct or memory")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("input", 1);
+  positional.add("blocks", -1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: cache [options...] INPUT BLOCKS..." << std::endl;
+    std::cerr << "Prints the checksums of some blocks, reading only those "
+                 "not cached yet."
+              << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  if (cache_path.empty()) {
+    cache_path = input_path + ".sigcache";
+  }
+
+  std::vector<std::uint64_t> blocks;
+
+  for (auto& range : ranges) {
+    parse_block_range(range, blocks);
+  }
+
+  signature.block_size = block_size.bytes;
+  signature.io = parse_io_method(io);
+
+  auto in_file = open_fd(input_path.c_str(), O_RDONLY);
+  signature_cache cache(in_file, cache_path, signature);
+
+  auto checksums = cache.lookup(blocks);
+
+  for (std::size_t i = 0; i < blocks.size(); i++) {
+    print_checksum(std::cout << blocks[i] << ' ', checksums[i]) << '\n';
+  }
+  std::cout.flush();
+
+  std::cerr << "read " << cache.last_computed() << " blocks, "
+            << cache.valid_blocks() << " of " << cache.blocks()
+            << " now cached" << std::endl;
+
+  return EXIT_SUCCESS;
+}
+
+int
+batch_command(int argc, char* argv[])
+{
+  std::vector<std::string> inputs;
+  std::string list_path, io;
+  unsigned int concurrency;
+
+  po::options_description options;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "produce help message")
+    ("input", po::value(&inputs), "files to checksum; directories are walked recursively")
+    ("files-from", po::value(&list_path), "also checksum the files listed in this file, one per line, or - for standard input")
+    ("io", po::value(&io)->default_value("io_uring"), "how to read the files: io_uring, or pread for plain system calls")
+    ("jobs,j", po::value(&concurrency)->default_value(std::thread::hardware_concurrency() + 1), "number of concurrent jobs")
+  ;
+  // clang-format on
+
+  po::positional_options_description positional;
+  positional.add("input", -1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+              .options(options)
+              .positional(positional)
+              .run(),
+            vm);
+
+  if (vm.count("help")) {
+    std::cerr << "Usage: batch [options...] PATH..." << std::endl;
+    std::cerr << "Prints the CRC-32 of every file, for many small files."
+              << std::endl;
+    std::cerr << options << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  po::notify(vm);
+
+  std::vector<std::string> paths;
+
+  for (auto& input : inputs) {
+    if (!std::filesystem::is_directory(input)) {
+      paths.push_back(input);
+      continue;
+    }
+
+    for (auto& entry : std::filesystem::recursive_directory_iterator(input)) {
+      if (entry.is_regular_file()) {
+        paths.push_back(entry.path().string());
+      }
+    }
+  }
+
+  if (!list_path.empty()) {
+    std::ifstream list_file;
+    std::istream* list = &std::cin;
+
+    if (list_path != "-") {
+      list_file.open(list_path);
+      if (!list_file) {
+        throw std::system_error(errno, std::generic_category(), list_path);
+      }
+      list = &list_file;
+    }
+
+    std::string line;
+    while (std::getline(*list, line)) {
+      if (!line.empty()) {
+        paths.push_back(line);
+      }
+    }
+  }
+
+  auto results = checksum_files(paths, concurrency, parse_io_method(io));
+  bool failed = false;
+
+  for (std::size_t i = 0; i < paths.size(); i++) {
+    if (results[i].error) {
+      std::cerr << paths[i] << ": " << std::strerror(results[i].error)
+                << std::endl;
+      failed = true;
+    } else {
+      print_checksum(std::cout, results[i].crc) << "  " << paths[i] << '\n';
+    }
+  }
+
+  std::cout.flush();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Run with the subcommand's name as argv[0].
+const struct
+{
+  const char* name;
+  int (*run)(int argc, char* argv[]);
+} subcommands[] = {
+  { "verify", verify_command },
+  { "diff", diff_command },
+  { "rebuild", rebuild_command },
+  { "repair", repair_command },
+  { "consensus", consensus_command },
+  { "history", history_command },
+  { "cache", cache_command },
+  { "batch", batch_command },
+};
+
 }
 
 int
 main(int argc, char* argv[])
 {
   try {
-    process_command_line(argc, argv);
+    for (auto& subcommand : subcommands) {
+      if (argc > 1 && std::string(argv[1]) == subcommand.name) {
+        return subcommand.run(argc - 1, argv + 1);
+      }
+    }
+
+    if (!sign_plain_command_line(argc, argv)) {
+      process_command_line(argc, argv);
+    }
     return EXIT_SUCCESS;
   } catch (const std::exception& ex) {
     std::cerr << ex.what() << std::endl;
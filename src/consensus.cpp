@@ -0,0 +1,381 @@
+#include "consensus.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIGNATURE_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define SIGNATURE_HAVE_X86_SIMD 0
+#endif
+
+#include "io_source.h"
+
+namespace {
+
+// Checksums per window. Each window is voted on by one worker, and its
+// pages are released once done.
+const std::size_t consensus_window = 1 << 20;
+
+const unsigned int max_replicas = 64;
+
+class mapped_checksums
+{
+public:
+  explicit mapped_checksums(int fd);
+  ~mapped_checksums();
+
+  mapped_checksums(const mapped_checksums&) = delete;
+  mapped_checksums& operator=(const mapped_checksums&) = delete;
+
+  const std::uint32_t* data() const { return checksums; }
+  std::uint64_t size() const { return count; }
+
+  // Drops the pages of [from, to) from our address space.
+  void release(std::uint64_t from, std::uint64_t to) const;
+
+private:
+  const std::uint32_t* checksums = nullptr;
+  std::uint64_t count;
+};
+
+mapped_checksums::mapped_checksums(int fd)
+{
+  auto size = fd_size(fd);
+
+  if (size % sizeof(std::uint32_t) != 0) {
+    throw std::runtime_error("not a signature: size isn't a multiple of 4");
+  }
+
+  count = size / sizeof(std::uint32_t);
+
+  if (count == 0) {
+    return;
+  }
+
+  auto mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), "mmap");
+  }
+
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  checksums = static_cast<const std::uint32_t*>(mapping);
+}
+
+mapped_checksums::~mapped_checksums()
+{
+  if (checksums) {
+    munmap(const_cast<std::uint32_t*>(checksums),
+           count * sizeof(std::uint32_t));
+  }
+}
+
+void
+mapped_checksums::release(std::uint64_t from, std::uint64_t to) const
+{
+  static const std::uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+  to = std::min(to, count);
+  if (from >= to) {
+    return;
+  }
+
+  // Only whole pages inside the range, so that neighbours are unaffected.
+  auto start =
+    (from * sizeof(std::uint32_t) + page_size - 1) & ~(page_size - 1);
+  auto end = (to * sizeof(std::uint32_t)) & ~(page_size - 1);
+
+  if (to == count) {
+    end = count * sizeof(std::uint32_t);
+  }
+
+  if (start < end) {
+    auto base = reinterpret_cast<char*>(const_cast<std::uint32_t*>(checksums));
+    madvise(base + start, end - start, MADV_DONTNEED);
+  }
+}
+
+// Finders return the first index in [from, to) where the replicas don't all
+// agree, or to. All replicas have to extend to `to`.
+typedef std::uint64_t (*find_function)(const std::uint32_t* const* replicas,
+                                       unsigned int n,
+                                       std::uint64_t from,
+                                       std::uint64_t to);
+
+std::uint64_t
+find_scalar(const std::uint32_t* const* replicas,
+            unsigned int n,
+            std::uint64_t from,
+            std::uint64_t to)
+{
+  for (auto i = from; i < to; i++) {
+    for (unsigned int r = 1; r < n; r++) {
+      if (replicas[r][i] != replicas[0][i]) {
+        return i;
+      }
+    }
+  }
+
+  return to;
+}
+
+#if SIGNATURE_HAVE_X86_SIMD
+
+__attribute__((target("sse2"))) std::uint64_t
+find_sse2(const std::uint32_t* const* replicas,
+          unsigned int n,
+          std::uint64_t from,
+          std::uint64_t to)
+{
+  auto i = from;
+
+  for (; i + 4 <= to; i += 4) {
+    auto first = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(replicas[0] + i));
+    auto all = _mm_set1_epi32(-1);
+
+    for (unsigned int r = 1; r < n; r++) {
+      auto other = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(replicas[r] + i));
+      all = _mm_and_si128(all, _mm_cmpeq_epi32(first, other));
+    }
+
+    if (_mm_movemask_epi8(all) != 0xffff) {
+      break;
+    }
+  }
+
+  return find_scalar(replicas, n, i, to);
+}
+
+__attribute__((target("avx2"))) std::uint64_t
+find_avx2(const std::uint32_t* const* replicas,
+          unsigned int n,
+          std::uint64_t from,
+          std::uint64_t to)
+{
+  auto i = from;
+
+  for (; i + 8 <= to; i += 8) {
+    auto first = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(replicas[0] + i));
+    auto all = _mm256_set1_epi32(-1);
+
+    for (unsigned int r = 1; r < n; r++) {
+      auto other = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(replicas[r] + i));
+      all = _mm256_and_si256(all, _mm256_cmpeq_epi32(first, other));
+    }
+
+    if (unsigned(_mm256_movemask_epi8(all)) != 0xffffffff) {
+      break;
+    }
+  }
+
+  return find_scalar(replicas, n, i, to);
+}
+
+#endif
+
+find_function
+select_find()
+{
+#if SIGNATURE_HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    return find_avx2;
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    return find_sse2;
+  }
+#endif
+
+  return find_scalar;
+}
+
+// Votes on a single block among the replicas that have it.
+consensus_range
+vote(const std::vector<const mapped_checksums*>& replicas, std::uint64_t block)
+{
+  unsigned int present = 0;
+  unsigned int best_votes = 0;
+  std::uint32_t best = 0;
+  std::uint64_t absent = 0;
+
+  for (unsigned int r = 0; r < replicas.size(); r++) {
+    if (block >= replicas[r]->size()) {
+      absent |= std::uint64_t(1) << r;
+      continue;
+    }
+
+    present++;
+
+    auto value = replicas[r]->data()[block];
+    unsigned int votes = 0;
+
+    for (unsigned int other = 0; other < replicas.size(); other++) {
+      votes += block < replicas[other]->size() &&
+               replicas[other]->data()[block] == value;
+    }
+
+    if (votes > best_votes) {
+      best_votes = votes;
+      best = value;
+    }
+  }
+
+  consensus_range result{ block, 1, absent, 2 * best_votes <= replicas.size() };
+
+  for (unsigned int r = 0; r < replicas.size(); r++) {
+    if (block < replicas[r]->size() && replicas[r]->data()[block] != best) {
+      result.disagreeing |= std::uint64_t(1) << r;
+    }
+  }
+
+  return result;
+}
+
+bool
+extends(const consensus_range& last, const consensus_range& next)
+{
+  return last.first + last.count == next.first &&
+         last.disagreeing == next.disagreeing &&
+         last.no_majority == next.no_majority;
+}
+
+void
+append(std::vector<consensus_range>& ranges, const consensus_range& range)
+{
+  if (!ranges.empty() && extends(ranges.back(), range)) {
+    ranges.back().count += range.count;
+  } else {
+    ranges.push_back(range);
+  }
+}
+
+}
+
+void
+signature_consensus(const std::vector<int>& fds,
+                    unsigned int concurrency,
+                    const std::function<void(const consensus_range&)>& report)
+{
+  if (fds.size() < 2 || fds.size() > max_replicas) {
+    throw std::invalid_argument("consensus needs 2 to 64 signatures");
+  }
+
+  if (concurrency <= 0) {
+    throw std::invalid_argument("concurrency should be positive");
+  }
+
+  static const auto find = select_find();
+
+  std::vector<std::unique_ptr<mapped_checksums>> mapped;
+  std::vector<const mapped_checksums*> replicas;
+  std::vector<const std::uint32_t*> columns;
+  std::uint64_t common = std::numeric_limits<std::uint64_t>::max();
+  std::uint64_t longest = 0;
+
+  for (auto fd : fds) {
+    mapped.push_back(std::make_unique<mapped_checksums>(fd));
+    replicas.push_back(mapped.back().get());
+    columns.push_back(mapped.back()->data());
+
+    common = std::min(common, mapped.back()->size());
+    longest = std::max(longest, mapped.back()->size());
+  }
+
+  auto num_windows = (longest + consensus_window - 1) / consensus_window;
+  std::vector<std::vector<consensus_range>> window_ranges(concurrency);
+  std::optional<consensus_range> pending;
+
+  // Windows are voted on a round at a time, one per worker, and reported
+  // in order before the next round starts.
+  for (std::uint64_t round = 0; round < num_windows; round += concurrency) {
+    auto windows = std::min<std::uint64_t>(concurrency, num_windows - round);
+    std::mutex mutex;
+    std::exception_ptr error;
+
+    auto work = [&](unsigned int slot) {
+      try {
+        auto from = (round + slot) * consensus_window;
+        auto to = std::min<std::uint64_t>(from + consensus_window, longest);
+        auto& ranges = window_ranges[slot];
+
+        ranges.clear();
+
+        for (auto block = from; block < to; block++) {
+          if (block < common) {
+            block =
+              find(columns.data(), columns.size(), block, std::min(to, common));
+            if (block == to) {
+              break;
+            }
+          }
+
+          auto range = vote(replicas, block);
+          if (range.disagreeing) {
+            append(ranges, range);
+          }
+        }
+
+        for (auto replica : replicas) {
+          replica->release(from, to);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int slot = 1; slot < windows; slot++) {
+      threads.push_back(std::thread(work, slot));
+    }
+
+    work(0);
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+
+    // A range can continue into the next window, so each one is only
+    // reported once it can't grow any more.
+    for (unsigned int slot = 0; slot < windows; slot++) {
+      for (auto& range : window_ranges[slot]) {
+        if (pending && extends(*pending, range)) {
+          pending->count += range.count;
+        } else {
+          if (pending) {
+            report(*pending);
+          }
+          pending = range;
+        }
+      }
+    }
+  }
+
+  if (pending) {
+    report(*pending);
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Consecutive blocks on which the same replicas disagree with the majority.
+struct consensus_range
+{
+  std::uint64_t first;
+  std::uint64_t count;
+
+  // Bit i is set if replica i differs from the majority, or lacks the
+  // blocks altogether.
+  std::uint64_t disagreeing;
+
+  // No checksum was held by more than half of the replicas: disagreeing
+  // then marks those that differ from the most common one.
+  bool no_majority;
+};
+
+// Votes block by block over up to 64 signatures of replicas of the same
+// data, calling report for each range where they diverge, in order. The
+// signatures are processed in windows, so memory stays bounded however
+// long they are.
+void
+signature_consensus(const std::vector<int>& fds,
+                    unsigned int concurrency,
+                    const std::function<void(const consensus_range&)>& report);
@@ -0,0 +1,159 @@
+#include "crc_combine.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const std::uint32_t polynomial = 0xedb88320;
+
+// Below this many parts a single thread is faster than starting more.
+const std::uint64_t parallel_threshold = 1 << 16;
+
+// a * b modulo the polynomial, bit-reflected.
+std::uint32_t
+multiply(std::uint32_t a, std::uint32_t b)
+{
+  std::uint32_t product = 0;
+  std::uint32_t mask = std::uint32_t(1) << 31;
+
+  for (;;) {
+    if (a & mask) {
+      product ^= b;
+
+      if ((a & (mask - 1)) == 0) {
+        break;
+      }
+    }
+
+    mask >>= 1;
+    b = b & 1 ? (b >> 1) ^ polynomial : b >> 1;
+  }
+
+  return product;
+}
+
+// x^(2^n) for n = 0..31; the sequence repeats after that.
+struct power_table
+{
+  power_table()
+  {
+    std::uint32_t power = std::uint32_t(1) << 30;
+
+    for (auto& entry : powers) {
+      entry = power;
+      power = multiply(power, power);
+    }
+  }
+
+  std::uint32_t powers[32];
+};
+
+const power_table powers_of_two;
+
+std::uint32_t
+combine_range(const std::uint32_t* crcs,
+              std::uint64_t count,
+              std::uint32_t op,
+              std::uint32_t last_op)
+{
+  auto crc = crcs[0];
+
+  for (std::uint64_t i = 1; i < count; i++) {
+    crc = crc32_combine_op(crc, crcs[i], i + 1 == count ? last_op : op);
+  }
+
+  return crc;
+}
+
+}
+
+std::uint32_t
+crc32_shift(std::uint64_t length)
+{
+  std::uint32_t op = std::uint32_t(1) << 31;
+  unsigned int k = 3;
+
+  for (; length; length >>= 1, k++) {
+    if (length & 1) {
+      op = multiply(powers_of_two.powers[k & 31], op);
+    }
+  }
+
+  return op;
+}
+
+std::uint32_t
+crc32_combine_op(std::uint32_t crc_a, std::uint32_t crc_b, std::uint32_t op)
+{
+  return multiply(op, crc_a) ^ crc_b;
+}
+
+std::uint32_t
+crc32_combine(std::uint32_t crc_a, std::uint32_t crc_b, std::uint64_t length_b)
+{
+  return crc32_combine_op(crc_a, crc_b, crc32_shift(length_b));
+}
+
+crc32_accumulator::crc32_accumulator(std::uint64_t usual_length)
+  : usual_length(usual_length)
+  , usual_op(crc32_shift(usual_length))
+{}
+
+// The CRC of nothing is zero, and combining zero with anything yields that
+// anything, so the first part needs no special case.
+void
+crc32_accumulator::add(std::uint32_t part, std::uint64_t length)
+{
+  auto op = length == usual_length ? usual_op : crc32_shift(length);
+
+  crc = crc32_combine_op(crc, part, op);
+}
+
+std::uint32_t
+crc32_combine_all(const std::uint32_t* crcs,
+                  std::uint64_t count,
+                  std::uint64_t length,
+                  std::uint64_t last_length,
+                  unsigned int concurrency)
+{
+  if (count == 0) {
+    return 0;
+  }
+
+  auto op = crc32_shift(length);
+  auto last_op = crc32_shift(last_length);
+
+  if (count < parallel_threshold || concurrency < 2) {
+    return combine_range(crcs, count, op, last_op);
+  }
+
+  // Each thread folds a contiguous run of parts, then the runs are folded
+  // with the operators for their own lengths.
+  auto per_thread = (count + concurrency - 1) / concurrency;
+  auto threads_used = (count + per_thread - 1) / per_thread;
+
+  std::vector<std::uint32_t> partial(threads_used);
+  std::vector<std::thread> threads;
+
+  for (std::uint64_t t = 0; t < threads_used; t++) {
+    threads.push_back(std::thread([&, t]() {
+      auto first = t * per_thread;
+      auto n = std::min(per_thread, count - first);
+      auto range_last_op = first + n == count ? last_op : op;
+
+      partial[t] = combine_range(crcs + first, n, op, range_last_op);
+    }));
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto run_op = crc32_shift(per_thread * length);
+  auto last_run = count - (threads_used - 1) * per_thread;
+  auto last_run_op = crc32_shift((last_run - 1) * length + last_length);
+
+  return combine_range(partial.data(), threads_used, run_op, last_run_op);
+}
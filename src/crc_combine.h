@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+// Arithmetic on CRC-32 (the zlib/PNG one, boost::crc_32_type) values as
+// polynomials over GF(2), after zlib's crc32_combine(). It allows computing
+// the CRC of a concatenation from the CRCs of its parts and their lengths,
+// without touching the data.
+
+// Returns the operator shifting a CRC over `length` bytes.
+std::uint32_t
+crc32_shift(std::uint64_t length);
+
+// Returns the CRC of A followed by B, given crc(A), crc(B) and the operator
+// for the length of B.
+std::uint32_t
+crc32_combine_op(std::uint32_t crc_a, std::uint32_t crc_b, std::uint32_t op);
+
+std::uint32_t
+crc32_combine(std::uint32_t crc_a, std::uint32_t crc_b, std::uint64_t length_b);
+
+// Folds the CRCs of consecutive parts, usually all of the same length, into
+// the CRC of their concatenation.
+class crc32_accumulator
+{
+public:
+  explicit crc32_accumulator(std::uint64_t usual_length);
+
+  void add(std::uint32_t crc, std::uint64_t length);
+  std::uint32_t value() const { return crc; }
+
+private:
+  const std::uint64_t usual_length;
+  const std::uint32_t usual_op;
+  std::uint32_t crc = 0;
+};
+
+// Combines CRCs of consecutive parts, all `length` bytes long except for the
+// last one, which is `last_length` bytes long. Large inputs are reduced in
+// parallel on up to `concurrency` threads.
+std::uint32_t
+crc32_combine_all(const std::uint32_t* crcs,
+                  std::uint64_t count,
+                  std::uint64_t length,
+                  std::uint64_t last_length,
+                  unsigned int concurrency);
@@ -0,0 +1,322 @@
+#include "diff.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIGNATURE_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define SIGNATURE_HAVE_X86_SIMD 0
+#endif
+
+#include "io_source.h"
+
+namespace {
+
+// Checksums compared per task: large enough that scheduling costs nothing,
+// small enough to spread a single large file over all workers.
+const std::size_t diff_chunk = 1 << 20;
+
+class mapped_signature
+{
+public:
+  explicit mapped_signature(int fd);
+  ~mapped_signature();
+
+  mapped_signature(const mapped_signature&) = delete;
+  mapped_signature& operator=(const mapped_signature&) = delete;
+
+  const std::uint32_t* checksums() const { return data; }
+  std::uint64_t size() const { return count; }
+
+private:
+  const std::uint32_t* data = nullptr;
+  std::uint64_t count;
+};
+
+mapped_signature::mapped_signature(int fd)
+{
+  auto size = fd_size(fd);
+
+  if (size % sizeof(std::uint32_t) != 0) {
+    throw std::runtime_error("not a signature: size isn't a multiple of 4");
+  }
+
+  count = size / sizeof(std::uint32_t);
+
+  if (count == 0) {
+    return;
+  }
+
+  auto mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), "mmap");
+  }
+
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  data = static_cast<const std::uint32_t*>(mapping);
+}
+
+mapped_signature::~mapped_signature()
+{
+  if (data) {
+    munmap(const_cast<std::uint32_t*>(data), count * sizeof(std::uint32_t));
+  }
+}
+
+// Each finder returns the index of the first checksum in [0, n) that differs
+// (or, if differ is false, that matches), or n if there is none.
+typedef std::size_t (*find_function)(const std::uint32_t* a,
+                                     const std::uint32_t* b,
+                                     std::size_t n,
+                                     bool differ);
+
+std::size_t
+find_scalar(const std::uint32_t* a,
+            const std::uint32_t* b,
+            std::size_t n,
+            bool differ)
+{
+  std::size_t i = 0;
+
+  while (i < n && (a[i] != b[i]) != differ) {
+    i++;
+  }
+
+  return i;
+}
+
+#if SIGNATURE_HAVE_X86_SIMD
+
+__attribute__((target("sse2"))) std::size_t
+find_sse2(const std::uint32_t* a,
+          const std::uint32_t* b,
+          std::size_t n,
+          bool differ)
+{
+  const unsigned int lanes = 4;
+  unsigned int wanted = differ ? 0xffff : 0;
+  std::size_t i = 0;
+
+  for (; i + 4 * lanes <= n; i += 4 * lanes) {
+    auto a_words = reinterpret_cast<const __m128i*>(a + i);
+    auto b_words = reinterpret_cast<const __m128i*>(b + i);
+
+    auto eq0 = _mm_cmpeq_epi32(_mm_loadu_si128(a_words + 0),
+                               _mm_loadu_si128(b_words + 0));
+    auto eq1 = _mm_cmpeq_epi32(_mm_loadu_si128(a_words + 1),
+                               _mm_loadu_si128(b_words + 1));
+    auto eq2 = _mm_cmpeq_epi32(_mm_loadu_si128(a_words + 2),
+                               _mm_loadu_si128(b_words + 2));
+    auto eq3 = _mm_cmpeq_epi32(_mm_loadu_si128(a_words + 3),
+                               _mm_loadu_si128(b_words + 3));
+
+    // Looking for a difference, all lanes equal means skip; looking for a
+    // match, all lanes different does.
+    auto all = differ ? _mm_and_si128(_mm_and_si128(eq0, eq1),
+                                      _mm_and_si128(eq2, eq3))
+                      : _mm_or_si128(_mm_or_si128(eq0, eq1),
+                                     _mm_or_si128(eq2, eq3));
+
+    if (unsigned(_mm_movemask_epi8(all)) != wanted) {
+      break;
+    }
+  }
+
+  return i + find_scalar(a + i, b + i, n - i, differ);
+}
+
+__attribute__((target("avx2"))) std::size_t
+find_avx2(const std::uint32_t* a,
+          const std::uint32_t* b,
+          std::size_t n,
+          bool differ)
+{
+  const unsigned int lanes = 8;
+  unsigned int wanted = differ ? 0xffffffff : 0;
+  std::size_t i = 0;
+
+  for (; i + 4 * lanes <= n; i += 4 * lanes) {
+    auto a_words = reinterpret_cast<const __m256i*>(a + i);
+    auto b_words = reinterpret_cast<const __m256i*>(b + i);
+
+    auto eq0 = _mm256_cmpeq_epi32(_mm256_loadu_si256(a_words + 0),
+                                  _mm256_loadu_si256(b_words + 0));
+    auto eq1 = _mm256_cmpeq_epi32(_mm256_loadu_si256(a_words + 1),
+                                  _mm256_loadu_si256(b_words + 1));
+    auto eq2 = _mm256_cmpeq_epi32(_mm256_loadu_si256(a_words + 2),
+                                  _mm256_loadu_si256(b_words + 2));
+    auto eq3 = _mm256_cmpeq_epi32(_mm256_loadu_si256(a_words + 3),
+                                  _mm256_loadu_si256(b_words + 3));
+
+    auto all = differ ? _mm256_and_si256(_mm256_and_si256(eq0, eq1),
+                                         _mm256_and_si256(eq2, eq3))
+                      : _mm256_or_si256(_mm256_or_si256(eq0, eq1),
+                                        _mm256_or_si256(eq2, eq3));
+
+    if (unsigned(_mm256_movemask_epi8(all)) != wanted) {
+      break;
+    }
+  }
+
+  return i + find_scalar(a + i, b + i, n - i, differ);
+}
+
+#endif
+
+find_function
+select_find()
+{
+#if SIGNATURE_HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    return find_avx2;
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    return find_sse2;
+  }
+#endif
+
+  return find_scalar;
+}
+
+// Appends the differing ranges of [from, to), merging with the last range
+// if they touch.
+void
+diff_range(find_function find,
+           const std::uint32_t* a,
+           const std::uint32_t* b,
+           std::uint64_t from,
+           std::uint64_t to,
+           std::vector<block_range>& ranges)
+{
+  auto position = from;
+
+  while (position < to) {
+    position += find(a + position, b + position, to - position, true);
+    if (position == to) {
+      break;
+    }
+
+    auto end =
+      position + find(a + position, b + position, to - position, false);
+
+    if (!ranges.empty() &&
+        ranges.back().first + ranges.back().count == position) {
+      ranges.back().count += end - position;
+    } else {
+      ranges.push_back({ position, end - position });
+    }
+
+    position = end;
+  }
+}
+
+}
+
+std::vector<block_range>
+diff_checksums(const std::uint32_t* a,
+               const std::uint32_t* b,
+               std::uint64_t count,
+               unsigned int concurrency)
+{
+  if (concurrency <= 0) {
+    throw std::invalid_argument("concurrency should be positive");
+  }
+
+  static const auto find = select_find();
+
+  auto common = count;
+  auto num_chunks = (common + diff_chunk - 1) / diff_chunk;
+
+  // Ranges of each chunk, merged in order once all are done.
+  std::vector<std::vector<block_range>> chunk_ranges(num_chunks);
+  std::atomic<std::uint64_t> next_chunk{ 0 };
+  std::mutex mutex;
+  std::exception_ptr error;
+
+  auto work = [&]() {
+    try {
+      for (;;) {
+        auto chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= num_chunks) {
+          break;
+        }
+
+        auto from = chunk * diff_chunk;
+        auto to = std::min<std::uint64_t>(from + diff_chunk, common);
+
+        diff_range(find, a, b, from, to, chunk_ranges[chunk]);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  auto workers = std::min<std::uint64_t>(concurrency, num_chunks);
+
+  for (unsigned int i = 1; i < workers; i++) {
+    threads.push_back(std::thread(work));
+  }
+
+  work();
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  std::vector<block_range> changed;
+
+  for (auto& ranges : chunk_ranges) {
+    for (auto& range : ranges) {
+      if (!changed.empty() &&
+          changed.back().first + changed.back().count == range.first) {
+        changed.back().count += range.count;
+      } else {
+        changed.push_back(range);
+      }
+    }
+  }
+
+  return changed;
+}
+
+signature_diff
+diff_signatures(int fd_a, int fd_b, unsigned int concurrency)
+{
+  if (concurrency <= 0) {
+    throw std::invalid_argument("concurrency should be positive");
+  }
+
+  mapped_signature a(fd_a), b(fd_b);
+
+  signature_diff result;
+  result.blocks_a = a.size();
+  result.blocks_b = b.size();
+  result.changed = diff_checksums(a.checksums(),
+                                  b.checksums(),
+                                  std::min(a.size(), b.size()),
+                                  concurrency);
+
+  return result;
+}
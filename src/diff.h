@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Consecutive blocks that differ between two signatures.
+struct block_range
+{
+  std::uint64_t first;
+  std::uint64_t count;
+};
+
+struct signature_diff
+{
+  std::uint64_t blocks_a = 0;
+  std::uint64_t blocks_b = 0;
+
+  // Blocks present in both signatures but with different checksums, in
+  // order. Blocks past the end of the shorter signature are not included.
+  std::vector<block_range> changed;
+};
+
+// Ranges where two arrays of checksums differ, over the first `count`.
+std::vector<block_range>
+diff_checksums(const std::uint32_t* a,
+               const std::uint32_t* b,
+               std::uint64_t count,
+               unsigned int concurrency);
+
+// Compares two signature files of the same block size.
+signature_diff
+diff_signatures(int fd_a, int fd_b, unsigned int concurrency);
@@ -0,0 +1,85 @@
+#include "heatmap.h"
+
+#include <algorithm>
+
+namespace {
+
+double
+mean_latency_ms(const heatmap_bin& bin)
+{
+  return bin.reads ? bin.read_ns / 1e6 / bin.reads : 0;
+}
+
+double
+throughput_mib_s(const heatmap_bin& bin)
+{
+  return bin.read_ns ? bin.bytes / double(1 << 20) / (bin.read_ns / 1e9) : 0;
+}
+
+}
+
+std::vector<heatmap_bin>
+bin_samples(const std::vector<std::vector<read_sample>>& samples,
+            std::uint64_t input_size,
+            unsigned int bins)
+{
+  std::vector<heatmap_bin> result;
+
+  if (input_size == 0 || bins == 0) {
+    return result;
+  }
+
+  auto bin_size = std::max<std::uint64_t>(1, (input_size + bins - 1) / bins);
+  result.resize((input_size + bin_size - 1) / bin_size);
+
+  for (std::size_t i = 0; i < result.size(); i++) {
+    result[i].offset = i * bin_size;
+    result[i].length = std::min(bin_size, input_size - result[i].offset);
+  }
+
+  for (const auto& thread_samples : samples) {
+    for (const auto& sample : thread_samples) {
+      auto& bin = result[std::min<std::uint64_t>(sample.offset / bin_size,
+                                                 result.size() - 1)];
+
+      bin.reads++;
+      bin.bytes += sample.size;
+      bin.read_ns += sample.read_ns;
+      bin.max_read_ns = std::max(bin.max_read_ns, sample.read_ns);
+    }
+  }
+
+  return result;
+}
+
+void
+write_heatmap_csv(std::ostream& stream, const std::vector<heatmap_bin>& bins)
+{
+  stream << "offset,length,reads,bytes,mean_latency_ms,max_latency_ms,"
+            "throughput_mib_s\n";
+
+  for (const auto& bin : bins) {
+    stream << bin.offset << ',' << bin.length << ',' << bin.reads << ','
+           << bin.bytes << ',' << mean_latency_ms(bin) << ','
+           << bin.max_read_ns / 1e6 << ',' << throughput_mib_s(bin) << '\n';
+  }
+}
+
+void
+write_heatmap_json(std::ostream& stream, const std::vector<heatmap_bin>& bins)
+{
+  stream << "[\n";
+
+  for (std::size_t i = 0; i < bins.size(); i++) {
+    const auto& bin = bins[i];
+
+    stream << "  {\"offset\": " << bin.offset << ", \"length\": " << bin.length
+           << ", \"reads\": " << bin.reads << ", \"bytes\": " << bin.bytes
+           << ", \"mean_latency_ms\": " << mean_latency_ms(bin)
+           << ", \"max_latency_ms\": " << bin.max_read_ns / 1e6
+           << ", \"throughput_mib_s\": " << throughput_mib_s(bin) << "}"
+           << (i + 1 < bins.size() ? ",\n" : "\n");
+  }
+
+  stream << "]\n";
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// One read as seen by a worker: how long it took to get `size` bytes at
+// `offset`, not counting the time spent hashing them.
+struct read_sample
+{
+  std::uint64_t offset;
+  std::uint64_t size;
+  std::int64_t read_ns;
+};
+
+// Read statistics of one contiguous region of the input.
+struct heatmap_bin
+{
+  std::uint64_t offset = 0;
+  std::uint64_t length = 0;
+  std::uint64_t reads = 0;
+  std::uint64_t bytes = 0;
+  std::int64_t read_ns = 0;
+  std::int64_t max_read_ns = 0;
+};
+
+// Spreads samples over `bins` equal regions of the input, by the offset each
+// read started at.
+std::vector<heatmap_bin>
+bin_samples(const std::vector<std::vector<read_sample>>& samples,
+            std::uint64_t input_size,
+            unsigned int bins);
+
+void
+write_heatmap_csv(std::ostream& stream, const std::vector<heatmap_bin>& bins);
+
+void
+write_heatmap_json(std::ostream& stream, const std::vector<heatmap_bin>& bins);
@@ -0,0 +1,520 @@
+#include "history.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "diff.h"
+#include "io_source.h"
+
+namespace {
+
+const char history_magic[8] = { 'C', 'R', 'C', 'H', 'I', 'S', 'T', 1 };
+
+enum file_kind : std::uint32_t
+{
+  kind_base = 1,
+  kind_delta = 2,
+  kind_head = 3,
+};
+
+// Starts every file of the store. Base and head files follow it with
+// `blocks` checksums; deltas with the fence index, then `entries` entries.
+struct file_header
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t kind;
+  std::uint64_t blocks;
+  std::uint64_t entries;
+
+  // Blocks covered by the fence index: the longer of this version and the
+  // previous one.
+  std::uint64_t span;
+  char label[history_label_size];
+};
+
+static_assert(sizeof(file_header) == 64, "history header layout");
+
+struct entry
+{
+  std::uint64_t block;
+  std::uint32_t before;
+  std::uint32_t after;
+};
+
+static_assert(sizeof(entry) == 16, "history entry layout");
+
+// Blocks per fence: fence i is the index of the first entry at or past
+// block i * fence_blocks.
+const std::uint64_t fence_blocks = 1 << 16;
+
+std::uint64_t
+fence_count(std::uint64_t span)
+{
+  return (span + fence_blocks - 1) / fence_blocks + 1;
+}
+
+std::string
+base_path(const std::string& dir)
+{
+  return dir + "/base";
+}
+
+std::string
+head_path(const std::string& dir)
+{
+  return dir + "/head";
+}
+
+std::string
+delta_path(const std::string& dir, unsigned int version)
+{
+  char name[32];
+  std::snprintf(name, sizeof(name), "/delta.%06u", version);
+  return dir + name;
+}
+
+file_header
+make_header(file_kind kind,
+            unsigned int version,
+            std::uint64_t blocks,
+            const std::string& label)
+{
+  if (label.size() > history_label_size) {
+    throw std::invalid_argument("label is longer than " +
+                                std::to_string(history_label_size) +
+                                " characters");
+  }
+
+  file_header header{};
+  std::memcpy(header.magic, history_magic, sizeof(header.magic));
+  header.version = version;
+  header.kind = kind;
+  header.blocks = blocks;
+  header.span = blocks;
+  std::memcpy(header.label, label.data(), label.size());
+
+  return header;
+}
+
+std::string
+header_label(const file_header& header)
+{
+  return std::string(header.label,
+                     strnlen(header.label, sizeof(header.label)));
+}
+
+bool
+file_exists(const std::string& path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+// A whole signature file, mapped; it must stay open only while mapped.
+class mapped_signature_file
+{
+public:
+  explicit mapped_signature_file(int fd)
+    : size(fd_size(fd))
+  {
+    if (size % sizeof(std::uint32_t) != 0) {
+      throw std::runtime_error("not a signature: size isn't a multiple of 4");
+    }
+
+    if (size == 0) {
+      return;
+    }
+
+    auto mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    data = static_cast<const std::uint32_t*>(mapping);
+  }
+
+  ~mapped_signature_file()
+  {
+    if (data) {
+      munmap(const_cast<std::uint32_t*>(data), size);
+    }
+  }
+
+  mapped_signature_file(const mapped_signature_file&) = delete;
+  mapped_signature_file& operator=(const mapped_signature_file&) = delete;
+
+  const std::uint32_t* checksums() const { return data; }
+  std::uint64_t blocks() const { return size / sizeof(std::uint32_t); }
+
+private:
+  unsigned_off_t size;
+  const std::uint32_t* data = nullptr;
+};
+
+}
+
+struct signature_history::mapped_file
+{
+  mapped_file(const std::string& path, file_kind kind);
+  ~mapped_file() { munmap(data, size); }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  const file_header& header() const
+  {
+    return *static_cast<const file_header*>(data);
+  }
+
+  template<typename T>
+  const T* at(std::uint64_t offset) const
+  {
+    return reinterpret_cast<const T*>(static_cast<const char*>(data) +
+                                      offset);
+  }
+
+  const std::uint32_t* checksums() const
+  {
+    return at<std::uint32_t>(sizeof(file_header));
+  }
+
+  void* data;
+  std::uint64_t size;
+};
+
+signature_history::mapped_file::mapped_file(const std::string& path,
+                                            file_kind kind)
+{
+  owned_fd fd(open(path.c_str(), O_RDONLY), "open");
+  size = fd_size(fd);
+
+  if (size < sizeof(file_header)) {
+    throw std::runtime_error(path + ": truncated history file");
+  }
+
+  data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), "mmap");
+  }
+
+  auto& h = header();
+  std::uint64_t expected = sizeof(file_header);
+
+  if (kind == kind_delta) {
+    expected += fence_count(h.span) * sizeof(std::uint64_t) +
+                h.entries * sizeof(entry);
+  } else {
+    expected += h.blocks * sizeof(std::uint32_t);
+  }
+
+  if (std::memcmp(h.magic, history_magic, sizeof(h.magic)) != 0 ||
+      h.kind != kind || size != expected) {
+    munmap(data, size);
+    throw std::runtime_error(path + ": not a signature history file");
+  }
+}
+
+struct signature_history::delta
+{
+  std::unique_ptr<mapped_file> file;
+  std::uint64_t previous_blocks;
+
+  const std::uint64_t* fences() const
+  {
+    return file->at<std::uint64_t>(sizeof(file_header));
+  }
+
+  const entry* entries() const
+  {
+    return file->at<entry>(sizeof(file_header) +
+                           fence_count(file->header().span) *
+                             sizeof(std::uint64_t));
+  }
+
+  // Entries for blocks in [first, last), found through the fences and a
+  // binary search within the first range.
+  std::pair<const entry*, const entry*> find(std::uint64_t first,
+                                             std::uint64_t last) const
+  {
+    auto& h = file->header();
+    auto begin = entries(), end = begin + h.entries;
+
+    if (first >= h.span || first >= last) {
+      return { end, end };
+    }
+
+    auto fence = fences();
+    auto from = begin + fence[first / fence_blocks];
+    auto to = last >= h.span ? end
+                             : begin + fence[(last - 1) / fence_blocks + 1];
+
+    from = std::lower_bound(
+      from, to, first, [](const entry& e, std::uint64_t block) {
+        return e.block < block;
+      });
+    to = std::lower_bound(
+      from, to, last, [](const entry& e, std::uint64_t block) {
+        return e.block < block;
+      });
+
+    return { from, to };
+  }
+};
+
+void
+signature_history::create(const std::string& dir,
+                          int fd_signature,
+                          const std::string& label)
+{
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::system_error(errno, std::generic_category(), "mkdir");
+  }
+
+  if (file_exists(base_path(dir))) {
+    throw std::runtime_error(dir + ": already holds a signature history");
+  }
+
+  mapped_signature_file signature(fd_signature);
+  auto header = make_header(kind_base, 0, signature.blocks(), label);
+  auto size = signature.blocks() * sizeof(std::uint32_t);
+
+  write_file_atomically(base_path(dir),
+                        { { &header, sizeof(header) },
+                          { signature.checksums(), size } });
+
+  header.kind = kind_head;
+  write_file_atomically(head_path(dir),
+                        { { &header, sizeof(header) },
+                          { signature.checksums(), size } });
+}
+
+signature_history::signature_history(const std::string& dir)
+  : dir(dir)
+{
+  load();
+}
+
+signature_history::~signature_history() = default;
+
+void
+signature_history::load()
+{
+  base = std::make_unique<mapped_file>(base_path(dir), kind_base);
+  deltas.clear();
+  list.clear();
+
+  auto& base_header = base->header();
+  list.push_back({ 0,
+                   header_label(base_header),
+                   base_header.blocks,
+                   base_header.blocks });
+
+  for (unsigned int version = 1;; version++) {
+    auto path = delta_path(dir, version);
+    if (!file_exists(path)) {
+      break;
+    }
+
+    delta d{ std::make_unique<mapped_file>(path, kind_delta),
+             list.back().blocks };
+    auto& h = d.file->header();
+
+    if (h.version != version ||
+        h.span != std::max(h.blocks, d.previous_blocks)) {
+      throw std::runtime_error(path + ": not a signature history file");
+    }
+
+    list.push_back({ version, header_label(h), h.blocks, h.entries });
+    deltas.push_back(std::move(d));
+  }
+
+  // The head is rewritten after every new delta: if that didn't happen,
+  // redo it from the base.
+  head.reset();
+
+  if (file_exists(head_path(dir))) {
+    head = std::make_unique<mapped_file>(head_path(dir), kind_head);
+
+    if (head->header().version != list.back().number) {
+      head.reset();
+    }
+  }
+
+  if (!head) {
+    auto checksums = checksums_at(list.back().number);
+    write_head(list.back().number, checksums.data(), checksums.size());
+    head = std::make_unique<mapped_file>(head_path(dir), kind_head);
+  }
+}
+
+void
+signature_history::write_head(unsigned int version,
+                              const std::uint32_t* checksums,
+                              std::uint64_t blocks) const
+{
+  auto header = make_header(kind_head, version, blocks, list[version].label);
+
+  write_file_atomically(head_path(dir),
+                        { { &header, sizeof(header) },
+                          { checksums, blocks * sizeof(std::uint32_t) } });
+}
+
+unsigned int
+signature_history::add(int fd_signature,
+                       const std::string& label,
+                       unsigned int concurrency)
+{
+  mapped_signature_file signature(fd_signature);
+
+  auto version = list.back().number + 1;
+  auto old_blocks = head->header().blocks;
+  auto new_blocks = signature.blocks();
+  auto old_checksums = head->checksums();
+  auto new_checksums = signature.checksums();
+  auto common = std::min(old_blocks, new_blocks);
+
+  auto header = make_header(kind_delta, version, new_blocks, label);
+  header.span = std::max(old_blocks, new_blocks);
+
+  std::vector<entry> entries;
+
+  for (auto& range :
+       diff_checksums(old_checksums, new_checksums, common, concurrency)) {
+    for (auto block = range.first; block < range.first + range.count;
+         block++) {
+      entries.push_back(
+        { block, old_checksums[block], new_checksums[block] });
+    }
+  }
+
+  for (auto block = common; block < header.span; block++) {
+    entries.push_back({ block,
+                        block < old_blocks ? old_checksums[block] : 0,
+                        block < new_blocks ? new_checksums[block] : 0 });
+  }
+
+  header.entries = entries.size();
+
+  std::vector<std::uint64_t> fences(fence_count(header.span));
+  std::size_t next = 0;
+
+  for (std::size_t i = 0; i < fences.size(); i++) {
+    while (next < entries.size() && entries[next].block < i * fence_blocks) {
+      next++;
+    }
+    fences[i] = next;
+  }
+
+  write_file_atomically(
+    delta_path(dir, version),
+    { { &header, sizeof(header) },
+      { fences.data(), fences.size() * sizeof(std::uint64_t) },
+      { entries.data(), entries.size() * sizeof(entry) } });
+
+  list.push_back({ version, label, new_blocks, entries.size() });
+  write_head(version, new_checksums, new_blocks);
+
+  load();
+  return version;
+}
+
+std::vector<std::uint32_t>
+signature_history::checksums_at(unsigned int version) const
+{
+  if (version >= list.size()) {
+    throw std::out_of_range("no version " + std::to_string(version) +
+                            " in the history");
+  }
+
+  std::uint64_t forward = 0, backward = 0;
+
+  for (unsigned int v = 1; v < list.size(); v++) {
+    (v <= version ? forward : backward) += list[v].changes;
+  }
+
+  // Walking back needs the head, which may be missing while loading.
+  bool from_head = head && backward < forward;
+  auto& start = from_head ? *head : *base;
+
+  std::vector<std::uint32_t> result(start.checksums(),
+                                    start.checksums() + start.header().blocks);
+
+  if (from_head) {
+    for (auto v = list.back().number; v > version; v--) {
+      auto& d = deltas[v - 1];
+      auto h = d.file->header();
+
+      result.resize(d.previous_blocks);
+
+      auto e = d.entries();
+      for (std::uint64_t i = 0; i < h.entries; i++) {
+        if (e[i].block < d.previous_blocks) {
+          result[e[i].block] = e[i].before;
+        }
+      }
+    }
+  } else {
+    for (unsigned int v = 1; v <= version; v++) {
+      auto& d = deltas[v - 1];
+      auto h = d.file->header();
+
+      result.resize(h.blocks);
+
+      auto e = d.entries();
+      for (std::uint64_t i = 0; i < h.entries; i++) {
+        if (e[i].block < h.blocks) {
+          result[e[i].block] = e[i].after;
+        }
+      }
+    }
+  }
+
+  return result;
+}
+
+void
+signature_history::reconstruct(unsigned int version, int fd_out) const
+{
+  auto checksums = checksums_at(version);
+  auto size = checksums.size() * sizeof(std::uint32_t);
+
+  pwrite_full(
+    fd_out, reinterpret_cast<const char*>(checksums.data()), size, 0);
+
+  if (ftruncate(fd_out, size) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+}
+
+std::vector<block_change>
+signature_history::changes(std::uint64_t first, std::uint64_t count) const
+{
+  std::vector<block_change> result;
+  auto last = first + std::min(count, ~first);
+
+  for (auto& d : deltas) {
+    auto& h = d.file->header();
+    auto found = d.find(first, last);
+
+    for (auto e = found.first; e != found.second; e++) {
+      auto kind = e->block >= d.previous_blocks ? block_change_kind::appeared
+                  : e->block >= h.blocks        ? block_change_kind::removed
+                                                : block_change_kind::changed;
+
+      result.push_back({ h.version, e->block, kind, e->before, e->after });
+    }
+  }
+
+  return result;
+}
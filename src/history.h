@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A store of successive signatures of the same data, in a directory: the
+// first one in full, then only the checksums that changed from one version
+// to the next. Every delta holds its entries sorted by block, with the
+// checksum before and after, and a fence index over ranges of blocks, so
+// the store can be walked forwards from the base or backwards from a full
+// copy of the latest version, and looked up by block with a binary search
+// over the mapped files.
+struct history_version
+{
+  unsigned int number;
+  std::string label;
+  std::uint64_t blocks;
+
+  // Checksums that changed since the previous version, including blocks
+  // that appeared or went away. The base counts all of its blocks.
+  std::uint64_t changes;
+};
+
+enum class block_change_kind
+{
+  changed,
+  appeared,
+  removed,
+};
+
+struct block_change
+{
+  unsigned int version;
+  std::uint64_t block;
+  block_change_kind kind;
+
+  // Zero when the block didn't exist on that side.
+  std::uint32_t before;
+  std::uint32_t after;
+};
+
+// Labels are stored in the fixed-size headers of the files.
+const std::size_t history_label_size = 24;
+
+class signature_history
+{
+public:
+  // Starts a store in `dir`, which is created if missing and must not hold
+  // one already, with the signature in fd_signature as version 0.
+  static void create(const std::string& dir,
+                     int fd_signature,
+                     const std::string& label);
+
+  explicit signature_history(const std::string& dir);
+  ~signature_history();
+
+  signature_history(const signature_history&) = delete;
+  signature_history& operator=(const signature_history&) = delete;
+
+  // Records the signature in fd_signature as the next version and returns
+  // its number.
+  unsigned int add(int fd_signature,
+                   const std::string& label,
+                   unsigned int concurrency);
+
+  const std::vector<history_version>& versions() const { return list; }
+
+  // Writes out the signature as it was at `version`, starting from
+  // whichever end of the history is closer.
+  void reconstruct(unsigned int version, int fd_out) const;
+
+  // Every change to blocks [first, first + count), by version, then block.
+  std::vector<block_change> changes(std::uint64_t first,
+                                    std::uint64_t count) const;
+
+private:
+  struct mapped_file;
+  struct delta;
+
+  void load();
+  std::vector<std::uint32_t> checksums_at(unsigned int version) const;
+  void write_head(unsigned int version,
+                  const std::uint32_t* checksums,
+                  std::uint64_t blocks) const;
+
+  std::string dir;
+  std::unique_ptr<mapped_file> base;
+  std::unique_ptr<mapped_file> head;
+  std::vector<delta> deltas;
+  std::vector<history_version> list;
+};
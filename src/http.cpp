@@ -0,0 +1,408 @@
+#include "http.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+// Headers longer than this are taken as garbage.
+const std::size_t max_header_size = 64 * 1024;
+
+const std::size_t header_chunk = 16 * 1024;
+
+// Reads that stall for this long fail, so that a dead server doesn't hang
+// the worker forever.
+const int receive_timeout_seconds = 60;
+
+std::string
+lowercase(std::string text)
+{
+  std::transform(text.begin(), text.end(), text.begin(), [](char c) {
+    return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+  });
+  return text;
+}
+
+std::string
+trim(const std::string& text)
+{
+  auto first = text.find_first_not_of(" \t");
+  if (first == std::string::npos) {
+    return "";
+  }
+
+  return text.substr(first, text.find_last_not_of(" \t") - first + 1);
+}
+
+std::uint64_t
+parse_number(const std::string& text)
+{
+  if (text.empty() || text.find_first_not_of("0123456789") != text.npos) {
+    throw std::runtime_error("malformed HTTP header value '" + text + "'");
+  }
+
+  return std::stoull(text);
+}
+
+}
+
+http_object::http_object(const std::string& url)
+  : location(url)
+{
+  const std::string scheme = "http://";
+
+  if (url.compare(0, scheme.size(), scheme) != 0) {
+    throw std::invalid_argument("only http:// URLs are supported");
+  }
+
+  auto rest = url.substr(scheme.size());
+  auto slash = rest.find('/');
+
+  host_header = rest.substr(0, slash);
+  path = slash == std::string::npos ? "/" : rest.substr(slash);
+  path = path.substr(0, path.find('#'));
+
+  std::string host = host_header;
+  std::string port = "80";
+
+  if (!host.empty() && host[0] == '[') {
+    auto bracket = host.find(']');
+    if (bracket == std::string::npos) {
+      throw std::invalid_argument("malformed URL " + url);
+    }
+
+    if (bracket + 1 < host.size() && host[bracket + 1] == ':') {
+      port = host.substr(bracket + 2);
+    }
+    host = host.substr(1, bracket - 1);
+  } else if (host.find(':') != std::string::npos) {
+    port = host.substr(host.find(':') + 1);
+    host = host.substr(0, host.find(':'));
+  }
+
+  if (host.empty() || port.empty()) {
+    throw std::invalid_argument("malformed URL " + url);
+  }
+
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo* addresses;
+  auto error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+  if (error) {
+    throw std::runtime_error(url + ": " + gai_strerror(error));
+  }
+
+  std::memcpy(&address, addresses->ai_addr, addresses->ai_addrlen);
+  address_length = addresses->ai_addrlen;
+  freeaddrinfo(addresses);
+
+  connection probe(*this);
+  connection::response parsed;
+
+  probe.open();
+
+  if (!probe.send_request(0, 0) || !probe.read_headers(parsed)) {
+    throw std::runtime_error(url + ": connection closed by the server");
+  }
+
+  if (parsed.status == 200) {
+    throw std::runtime_error(url + ": the server ignores range requests");
+  }
+
+  // An empty object has no byte 0 to return.
+  if ((parsed.status != 206 && parsed.status != 416) || !parsed.has_total) {
+    throw std::runtime_error(url + ": HTTP status " +
+                             std::to_string(parsed.status));
+  }
+
+  object_size = parsed.total;
+}
+
+http_object::connection::connection(const http_object& object)
+  : object(object)
+{}
+
+http_object::connection::~connection()
+{
+  reset();
+}
+
+void
+http_object::connection::open()
+{
+  fd = socket(object.address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(), "socket");
+  }
+
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+  timeval timeout = { receive_timeout_seconds, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (connect(fd,
+              reinterpret_cast<const sockaddr*>(&object.address),
+              object.address_length) != 0) {
+    auto connect_errno = errno;
+    reset();
+    throw std::system_error(
+      connect_errno, std::generic_category(), object.location);
+  }
+}
+
+void
+http_object::connection::reset()
+{
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  pending.clear();
+  body_left = 0;
+}
+
+// Returns false if the server has closed the connection.
+bool
+http_object::connection::send_request(std::uint64_t first, std::uint64_t last)
+{
+  auto request = "GET " + object.path + " HTTP/1.1\r\n" +
+                 "Host: " + object.host_header + "\r\n" +
+                 "Range: bytes=" + std::to_string(first) + "-" +
+                 std::to_string(last) + "\r\n\r\n";
+  std::size_t sent = 0;
+
+  while (sent < request.size()) {
+    auto n =
+      send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EPIPE || errno == ECONNRESET) {
+        return false;
+      }
+
+      throw std::system_error(errno, std::generic_category(), "send");
+    }
+
+    sent += n;
+  }
+
+  return true;
+}
+
+// Returns false if the connection closed before anything was received.
+bool
+http_object::connection::read_headers(response& parsed)
+{
+  std::size_t end;
+
+  while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+    if (pending.size() > max_header_size) {
+      throw std::runtime_error(object.location + ": HTTP headers too long");
+    }
+
+    char chunk[header_chunk];
+    auto n = recv(fd, chunk, sizeof(chunk), 0);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0 && pending.empty() && (n == 0 || errno == ECONNRESET)) {
+      return false;
+    }
+
+    if (n < 0) {
+      throw std::system_error(errno, std::generic_category(), "recv");
+    }
+
+    if (n == 0) {
+      throw std::runtime_error(object.location +
+                               ": connection closed mid-response");
+    }
+
+    pending.append(chunk, n);
+  }
+
+  auto headers = pending.substr(0, end);
+  pending.erase(0, end + 4);
+
+  std::size_t line_start = 0;
+  bool first_line = true;
+  bool has_length = false;
+
+  while (line_start <= headers.size()) {
+    auto line_end = headers.find("\r\n", line_start);
+    if (line_end == std::string::npos) {
+      line_end = headers.size();
+    }
+
+    auto line = headers.substr(line_start, line_end - line_start);
+    line_start = line_end + 2;
+
+    if (first_line) {
+      // HTTP/1.1 206 Partial Content
+      if (line.compare(0, 5, "HTTP/") != 0 || line.size() < 12) {
+        throw std::runtime_error(object.location + ": not an HTTP response");
+      }
+
+      parsed.status = parse_number(line.substr(9, 3));
+      parsed.keep_alive = line.compare(0, 8, "HTTP/1.0") != 0;
+      first_line = false;
+      continue;
+    }
+
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+
+    auto name = lowercase(trim(line.substr(0, colon)));
+    auto value = trim(line.substr(colon + 1));
+
+    if (name == "content-length") {
+      parsed.length = parse_number(value);
+      has_length = true;
+    } else if (name == "connection") {
+      parsed.keep_alive = lowercase(value) != "close";
+    } else if (name == "transfer-encoding" &&
+               lowercase(value) != "identity") {
+      throw std::runtime_error(object.location + ": transfer encoding " +
+                               value + " isn't supported");
+    } else if (name == "content-range") {
+      // bytes FIRST-LAST/TOTAL, or bytes */TOTAL
+      auto slash = value.find('/');
+      if (value.compare(0, 6, "bytes ") != 0 || slash == std::string::npos) {
+        throw std::runtime_error("malformed Content-Range '" + value + "'");
+      }
+
+      auto range = value.substr(6, slash - 6);
+      auto total = value.substr(slash + 1);
+
+      if (range != "*") {
+        auto dash = range.find('-');
+        if (dash == std::string::npos) {
+          throw std::runtime_error("malformed Content-Range '" + value + "'");
+        }
+
+        parsed.range_first = parse_number(range.substr(0, dash));
+        parsed.range_last = parse_number(range.substr(dash + 1));
+        parsed.has_range = true;
+      }
+
+      if (total != "*") {
+        parsed.total = parse_number(total);
+        parsed.has_total = true;
+      }
+    }
+  }
+
+  if (!has_length) {
+    throw std::runtime_error(object.location + ": no Content-Length");
+  }
+
+  body_left = parsed.length;
+  close_after_body = !parsed.keep_alive;
+  return true;
+}
+
+void
+http_object::connection::request(std::uint64_t offset, std::size_t size)
+{
+  if (body_left) {
+    reset();
+  }
+
+  for (bool retried = false;; retried = true) {
+    bool reused = fd != -1;
+    response parsed;
+
+    if (!reused) {
+      open();
+    }
+
+    if (send_request(offset, offset + size - 1) && read_headers(parsed)) {
+      if (parsed.status == 200) {
+        throw std::runtime_error(object.location +
+                                 ": the server ignores range requests");
+      }
+
+      if (parsed.status != 206) {
+        throw std::runtime_error(object.location + ": HTTP status " +
+                                 std::to_string(parsed.status));
+      }
+
+      if (!parsed.has_range || parsed.range_first != offset ||
+          parsed.range_last != offset + size - 1 || parsed.length != size) {
+        throw std::runtime_error(object.location +
+                                 ": the server sent another range");
+      }
+
+      return;
+    }
+
+    reset();
+
+    if (!reused || retried) {
+      throw std::runtime_error(object.location +
+                               ": connection closed by the server");
+    }
+  }
+}
+
+void
+http_object::connection::receive(char* data, std::size_t size)
+{
+  if (size > body_left) {
+    throw std::logic_error("receiving past the end of the body");
+  }
+
+  auto buffered = std::min(size, pending.size());
+  std::memcpy(data, pending.data(), buffered);
+  pending.erase(0, buffered);
+
+  std::size_t done = buffered;
+
+  while (done < size) {
+    auto n = recv(fd, data + done, size - done, MSG_WAITALL);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      auto recv_errno = errno;
+      reset();
+
+      if (n == 0) {
+        throw std::runtime_error(object.location +
+                                 ": connection closed mid-response");
+      }
+      throw std::system_error(recv_errno, std::generic_category(), "recv");
+    }
+
+    done += n;
+  }
+
+  body_left -= size;
+
+  if (body_left == 0 && close_after_body) {
+    reset();
+  }
+}
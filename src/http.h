@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <sys/socket.h>
+
+// An object on an HTTP/1.1 server, read in ranges. Only plain http:// URLs
+// are supported: there is no TLS.
+class http_object
+{
+public:
+  // Resolves the host of the URL, and asks the server for the size of the
+  // object with a one-byte Range request, which also checks that the server
+  // honours ranges.
+  explicit http_object(const std::string& url);
+
+  const std::string& url() const { return location; }
+  std::uint64_t size() const { return object_size; }
+
+  // A connection to the server, kept alive from one request to the next.
+  // Not thread-safe: every reader has its own.
+  class connection
+  {
+  public:
+    explicit connection(const http_object& object);
+    ~connection();
+
+    connection(const connection&) = delete;
+    connection& operator=(const connection&) = delete;
+
+    // Sends a GET for `size` bytes at `offset` and reads the headers of the
+    // response, which has to be exactly that range. A connection the server
+    // closed while idle is reopened and the request sent again.
+    void request(std::uint64_t offset, std::size_t size);
+
+    // Receives the next `size` bytes of the body.
+    void receive(char* data, std::size_t size);
+
+    // Drops the connection, e.g. when the rest of a body isn't wanted.
+    void reset();
+
+  private:
+    struct response
+    {
+      unsigned int status = 0;
+      std::uint64_t length = 0;
+      std::uint64_t range_first = 0;
+      std::uint64_t range_last = 0;
+      std::uint64_t total = 0;
+      bool has_range = false;
+      bool has_total = false;
+      bool keep_alive = true;
+    };
+
+    friend class http_object;
+
+    void open();
+    bool send_request(std::uint64_t first, std::uint64_t last);
+    bool read_headers(response& parsed);
+
+    const http_object& object;
+    int fd = -1;
+    bool close_after_body = false;
+    std::uint64_t body_left = 0;
+
+    // Received past the headers, not handed out yet.
+    std::string pending;
+  };
+
+private:
+  std::string location;
+  std::string host_header;
+  std::string path;
+
+  sockaddr_storage address;
+  socklen_t address_length;
+
+  std::uint64_t object_size = 0;
+};
@@ -0,0 +1,467 @@
+#include "io_source.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const std::size_t direct_alignment = 4096;
+
+}
+
+unsigned_off_t
+fd_size(int fd)
+{
+  struct stat input_stat;
+  if (fstat(fd, &input_stat) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fstat");
+  }
+
+  if (S_ISBLK(input_stat.st_mode)) {
+    auto end = lseek(fd, 0, SEEK_END);
+    if (end == -1) {
+      throw std::system_error(errno, std::generic_category(), "lseek");
+    }
+
+    return end;
+  }
+
+  return input_stat.st_size;
+}
+
+bool
+is_seekable(int fd)
+{
+  struct stat input_stat;
+  if (fstat(fd, &input_stat) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fstat");
+  }
+
+  return S_ISREG(input_stat.st_mode) || S_ISBLK(input_stat.st_mode);
+}
+
+owned_fd::owned_fd(int fd, const char* what)
+  : fd(fd)
+{
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+}
+
+owned_fd::~owned_fd()
+{
+  close(fd);
+}
+
+file_lock::file_lock(int fd)
+  : fd(fd)
+{
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      throw std::system_error(errno, std::generic_category(), "flock");
+    }
+  }
+}
+
+file_lock::~file_lock()
+{
+  flock(fd, LOCK_UN);
+}
+
+std::size_t
+pread_full(int fd, char* buffer, std::size_t count, unsigned_off_t offset)
+{
+  std::size_t done = 0;
+
+  while (done < count) {
+    auto n_read = pread(fd, buffer + done, count - done, offset + done);
+
+    if (n_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      throw std::system_error(errno, std::generic_category(), "pread");
+    }
+
+    if (n_read == 0) {
+      break;
+    }
+
+    done += n_read;
+  }
+
+  return done;
+}
+
+std::size_t
+read_full(int fd, char* buffer, std::size_t count)
+{
+  std::size_t done = 0;
+
+  while (done < count) {
+    auto n_read = ::read(fd, buffer + done, count - done);
+
+    if (n_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      throw std::system_error(errno, std::generic_category(), "read");
+    }
+
+    if (n_read == 0) {
+      break;
+    }
+
+    done += n_read;
+  }
+
+  return done;
+}
+
+void
+pwrite_full(int fd, const char* data, std::size_t count, unsigned_off_t offset)
+{
+  auto write_end = data + count;
+
+  while (data != write_end) {
+    auto n_written = pwrite(fd, data, write_end - data, offset);
+
+    if (n_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      throw std::system_error(errno, std::generic_category(), "pwrite");
+    }
+
+    offset += n_written;
+    data += n_written;
+  }
+}
+
+void
+write_file_atomically(
+  const std::string& path,
+  const std::vector<std::pair<const void*, std::size_t>>& pieces)
+{
+  // A name of its own, so that concurrent writers don't clobber each
+  // other's temporary file: the last rename wins as a whole.
+  std::string tmp_path = path + ".XXXXXX";
+  owned_fd fd(mkstemp(&tmp_path[0]), "mkstemp");
+
+  try {
+    unsigned_off_t offset = 0;
+
+    if (fchmod(fd, 0644) != 0) {
+      throw std::system_error(errno, std::generic_category(), "fchmod");
+    }
+
+    for (auto& piece : pieces) {
+      pwrite_full(
+        fd, static_cast<const char*>(piece.first), piece.second, offset);
+      offset += piece.second;
+    }
+
+    if (fdatasync(fd) != 0) {
+      throw std::system_error(errno, std::generic_category(), "fdatasync");
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+      throw std::system_error(errno, std::generic_category(), "rename");
+    }
+  } catch (...) {
+    unlink(tmp_path.c_str());
+    throw;
+  }
+}
+
+pread_source::pread_source(int fd)
+  : fd(dup(fd), "dup")
+{}
+
+pread_source::reader::reader(int fd)
+  : fd(fd)
+{}
+
+borrowed_reader::borrowed_reader(const char* data,
+                                 unsigned_off_t size,
+                                 bool advise)
+  : data(data)
+  , data_size(size)
+  , advise(advise)
+{}
+
+void
+borrowed_reader::will_need(unsigned_off_t offset, std::size_t size)
+{
+  static const unsigned_off_t page_size = sysconf(_SC_PAGESIZE);
+
+  auto start = offset & ~(page_size - 1);
+  auto length = offset + size - start;
+
+  // Only a hint: failing it changes nothing but speed.
+  madvise(const_cast<char*>(data) + start, length, MADV_WILLNEED);
+}
+
+mmap_source::mmap_source(int fd)
+  : data_size(fd_size(fd))
+{
+  if (data_size == 0) {
+    return;
+  }
+
+  if (data_size > std::numeric_limits<std::size_t>::max()) {
+    throw std::system_error(
+      EFBIG, std::generic_category(), "input too large to map");
+  }
+
+  auto mapping = mmap(nullptr, data_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), "mmap");
+  }
+
+  data = static_cast<const char*>(mapping);
+}
+
+mmap_source::~mmap_source()
+{
+  if (data) {
+    munmap(const_cast<char*>(data), data_size);
+  }
+}
+
+memory_source::memory_source(const char* data, std::size_t size)
+  : data(data)
+  , data_size(size)
+{}
+
+memory_source::memory_source(int fd)
+{
+  auto size = fd_size(fd);
+
+  if (size > owned.max_size()) {
+    throw std::system_error(
+      EFBIG, std::generic_category(), "input too large to load");
+  }
+
+  owned.resize(size);
+  owned.resize(pread_full(fd, owned.data(), owned.size(), 0));
+
+  data = owned.data();
+  data_size = owned.size();
+}
+
+uring_source::uring_source(int fd)
+  : fd(dup(fd), "dup")
+{}
+
+uring_source::reader::reader(int fd)
+  : fd(fd)
+  , buffers(new char[depth * chunk_size])
+  , slots(new slot[depth]())
+  , iovecs(new iovec[depth])
+  , ring(new uring(depth))
+{}
+
+void
+uring_source::reader::begin(unsigned_off_t offset, std::size_t size)
+{
+  next_offset = offset;
+  end = offset + size;
+  head = 0;
+  in_flight = 0;
+  returned = false;
+
+  for (unsigned int i = 0; i < depth && next_offset < end; i++) {
+    submit(i);
+  }
+}
+
+void
+uring_source::reader::submit(unsigned int index)
+{
+  auto& s = slots[index];
+
+  if (!s.busy) {
+    s.offset = next_offset;
+    s.length = std::min<unsigned_off_t>(end - next_offset, chunk_size);
+    s.filled = 0;
+    s.busy = true;
+    next_offset += s.length;
+  }
+
+  s.done = false;
+  s.error = 0;
+
+  // Also resumes short reads, from where they stopped.
+  iovecs[index].iov_base = buffers.get() + index * chunk_size + s.filled;
+  iovecs[index].iov_len = s.length - s.filled;
+
+  auto sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(&iovecs[index]);
+  sqe->len = 1;
+  sqe->off = s.offset + s.filled;
+  sqe->user_data = index;
+
+  in_flight++;
+}
+
+void
+uring_source::reader::reap(bool wait)
+{
+  ring->enter(wait ? 1 : 0);
+
+  while (auto cqe = ring->peek()) {
+    auto& s = slots[cqe->user_data];
+    auto result = cqe->res;
+    ring->seen();
+    in_flight--;
+
+    if (result < 0) {
+      s.error = -result;
+      s.done = true;
+    } else if (result == 0) {
+      s.done = true;
+    } else {
+      s.filled += result;
+      s.done = s.filled == s.length;
+
+      // Short reads are resumed, unless the reader is being drained.
+      if (!s.done && s.busy) {
+        submit(&s - slots.get());
+      } else {
+        s.done = true;
+      }
+    }
+  }
+}
+
+const char*
+uring_source::reader::next(std::size_t& size)
+{
+  if (returned) {
+    slots[head].busy = false;
+
+    if (next_offset < end) {
+      submit(head);
+    }
+
+    head = (head + 1) % depth;
+    returned = false;
+  }
+
+  auto& s = slots[head];
+  if (!s.busy) {
+    return nullptr;
+  }
+
+  while (!s.done) {
+    reap(true);
+  }
+
+  if (s.error) {
+    throw std::system_error(s.error, std::generic_category(), "io_uring read");
+  }
+
+  if (s.filled < s.length) {
+    // End of input: nothing after this slot is worth delivering.
+    next_offset = end;
+  }
+
+  if (s.filled == 0) {
+    return nullptr;
+  }
+
+  returned = true;
+  size = s.filled;
+  return buffers.get() + head * chunk_size;
+}
+
+// The kernel writes into our buffers until the reads complete, so they must
+// all be reaped before the buffers are reused or freed.
+void
+uring_source::reader::finish()
+{
+  for (unsigned int i = 0; i < depth; i++) {
+    slots[i].busy = false;
+  }
+
+  while (in_flight) {
+    reap(true);
+  }
+
+  returned = false;
+}
+
+namespace {
+
+// O_DIRECT is a property of the open file description, so setting it on a
+// dup would affect the caller's descriptor too: open the file anew instead.
+int
+reopen_direct(int fd)
+{
+  auto path = "/proc/self/fd/" + std::to_string(fd);
+  return open(path.c_str(), O_RDONLY | O_DIRECT);
+}
+
+}
+
+direct_source::direct_source(int fd)
+  : fd(dup(fd), "dup")
+  , direct_fd(reopen_direct(fd), "O_DIRECT open")
+{}
+
+direct_source::reader::reader(int fd)
+  : fd(fd)
+  , buffer(nullptr, &std::free)
+{
+  void* memory;
+  auto error = posix_memalign(&memory, direct_alignment, buffer_size);
+
+  if (error) {
+    throw std::system_error(error, std::generic_category(), "posix_memalign");
+  }
+
+  buffer.reset(static_cast<char*>(memory));
+}
+
+stream_source::stream_source(int fd)
+  : fd(dup(fd), "dup")
+{}
+
+stream_source::reader::reader(int fd)
+  : fd(fd)
+  , buffer(new char[buffer_size])
+{}
+
+http_source::http_source(std::shared_ptr<const http_object> object)
+  : object(std::move(object))
+{}
+
+http_source::reader::reader(const http_object& object)
+  : object(object)
+  , connection(std::make_unique<http_object::connection>(object))
+  , buffer(new char[buffer_size])
+{}
+
+simulated_source::simulated_source(std::shared_ptr<simulated_device> device)
+  : device(std::move(device))
+{}
+
+simulated_source::reader::reader(simulated_device& device)
+  : device(device)
+  , buffer(new char[buffer_size])
+{}
@@ -0,0 +1,1065 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "simulated_device.h"
+#include "uring.h"
+
+typedef std::make_unsigned<off_t>::type unsigned_off_t;
+
+// Sources are what generate_signature() reads from. A source is shared by
+// all workers and only describes the input:
+//
+//   static constexpr bool seekable;
+//   unsigned_off_t size() const;
+//   reader make_reader() const;
+//
+// Each worker reads through its own reader, which owns whatever buffers or
+// rings the access method needs:
+//
+//   template<typename Consumer>
+//   std::size_t read(unsigned_off_t offset, std::size_t size,
+//                    Consumer&& consume);
+//
+// read() calls consume(const char* data, std::size_t size) on consecutive
+// pieces of [offset, offset + size), in order, and returns the number of
+// bytes delivered: fewer than requested only at the end of the input, or if
+// consume returned false to abandon the read. Readers of mapped sources lend
+// out pointers into the mapping; the others copy into their own buffers.
+//
+// Sources are template parameters all the way down, so the hashing loop
+// makes no virtual calls.
+
+// Data is handed to consumers in pieces of at most this size.
+const std::size_t buffer_size = 1 << 20;
+
+unsigned_off_t
+fd_size(int fd);
+
+// Sources keep descriptors of their own (usually dups of the caller's), so
+// that they stay valid for workers that outlive the generate_signature()
+// call. Throws, naming the call that failed, if fd is -1.
+class owned_fd
+{
+public:
+  owned_fd(int fd, const char* what);
+  ~owned_fd();
+
+  owned_fd(const owned_fd&) = delete;
+  owned_fd& operator=(const owned_fd&) = delete;
+
+  operator int() const { return fd; }
+
+private:
+  int fd;
+};
+
+// Holds an exclusive flock(2) on a file, so that processes sharing it don't
+// update it at the same time. Waits for the lock if another process has it.
+class file_lock
+{
+public:
+  explicit file_lock(int fd);
+  ~file_lock();
+
+  file_lock(const file_lock&) = delete;
+  file_lock& operator=(const file_lock&) = delete;
+
+private:
+  int fd;
+};
+
+// Like pread(2) and read(2), but retry after signals and short reads, and
+// throw on errors: fewer bytes than requested means end of input.
+std::size_t
+pread_full(int fd, char* buffer, std::size_t count, unsigned_off_t offset);
+
+std::size_t
+read_full(int fd, char* buffer, std::size_t count);
+
+void
+pwrite_full(int fd, const char* data, std::size_t count, unsigned_off_t offset);
+
+// Writes the pieces into a uniquely named temporary file next to `path`,
+// syncs it and renames it over `path`, so readers never see a partial file.
+void
+write_file_atomically(
+  const std::string& path,
+  const std::vector<std::pair<const void*, std::size_t>>& pieces);
+
+// Reads with pread(2) into a buffer of its own.
+class pread_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  explicit pread_source(int fd);
+
+  class reader
+  {
+  public:
+    explicit reader(int fd);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    int fd;
+    std::unique_ptr<char[]> buffer;
+    std::size_t buffer_capacity = 0;
+  };
+
+  unsigned_off_t size() const { return fd_size(fd); }
+  reader make_reader() const { return reader(fd); }
+
+private:
+  owned_fd fd;
+};
+
+// Lends out pointers into memory that stays valid for the life of the
+// source: a file mapping or a caller's buffer.
+class borrowed_reader
+{
+public:
+  borrowed_reader(const char* data, unsigned_off_t size, bool advise);
+
+  template<typename Consumer>
+  std::size_t read(unsigned_off_t offset,
+                   std::size_t size,
+                   Consumer&& consume);
+
+private:
+  void will_need(unsigned_off_t offset, std::size_t size);
+
+  const char* data;
+  unsigned_off_t data_size;
+  bool advise;
+};
+
+class mmap_source
+{
+public:
+  static constexpr bool seekable = true;
+  typedef borrowed_reader reader;
+
+  explicit mmap_source(int fd);
+  ~mmap_source();
+
+  unsigned_off_t size() const { return data_size; }
+  reader make_reader() const { return reader(data, data_size, true); }
+
+private:
+  const char* data = nullptr;
+  unsigned_off_t data_size;
+};
+
+class memory_source
+{
+public:
+  static constexpr bool seekable = true;
+  typedef borrowed_reader reader;
+
+  // The caller keeps the data alive for as long as the source.
+  memory_source(const char* data, std::size_t size);
+
+  // Reads the whole file into memory.
+  explicit memory_source(int fd);
+
+  unsigned_off_t size() const { return data_size; }
+  reader make_reader() const { return reader(data, data_size, false); }
+
+private:
+  std::vector<char> owned;
+  const char* data;
+  unsigned_off_t data_size;
+};
+
+// Keeps a few reads in flight per worker through io_uring.
+class uring_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  explicit uring_source(int fd);
+
+  class reader
+  {
+  public:
+    explicit reader(int fd);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    static const unsigned int depth = 4;
+    static constexpr std::size_t chunk_size = 256 * 1024;
+
+    struct slot
+    {
+      unsigned_off_t offset;
+      std::size_t length;
+      std::size_t filled;
+      bool busy;
+      bool done;
+      int error;
+    };
+
+    void begin(unsigned_off_t offset, std::size_t size);
+    const char* next(std::size_t& size);
+    void finish();
+
+    void submit(unsigned int index);
+    void reap(bool wait);
+
+    int fd;
+    std::unique_ptr<char[]> buffers;
+    std::unique_ptr<slot[]> slots;
+    std::unique_ptr<iovec[]> iovecs;
+    std::unique_ptr<uring> ring;
+
+    unsigned_off_t next_offset;
+    unsigned_off_t end;
+    unsigned int head;
+    unsigned int in_flight;
+    bool returned;
+  };
+
+  unsigned_off_t size() const { return fd_size(fd); }
+  reader make_reader() const { return reader(fd); }
+
+private:
+  owned_fd fd;
+};
+
+// Reads with O_DIRECT into an aligned buffer, bypassing the page cache.
+class direct_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  explicit direct_source(int fd);
+
+  class reader
+  {
+  public:
+    explicit reader(int fd);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    int fd;
+    std::unique_ptr<char, void (*)(void*)> buffer;
+  };
+
+  unsigned_off_t size() const { return fd_size(fd); }
+  reader make_reader() const { return reader(direct_fd); }
+
+private:
+  owned_fd fd;
+  owned_fd direct_fd;
+};
+
+// A pipe or anything else that can only be read front to back, once.
+class stream_source
+{
+public:
+  static constexpr bool seekable = false;
+
+  explicit stream_source(int fd);
+
+  class reader
+  {
+  public:
+    explicit reader(int fd);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    int fd;
+    unsigned_off_t position = 0;
+    std::unique_ptr<char[]> buffer;
+  };
+
+  reader make_reader() const { return reader(fd); }
+
+private:
+  owned_fd fd;
+};
+
+class simulated_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  explicit simulated_source(std::shared_ptr<simulated_device> device);
+
+  class reader
+  {
+  public:
+    explicit reader(simulated_device& device);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    simulated_device& device;
+    std::unique_ptr<char[]> buffer;
+  };
+
+  unsigned_off_t size() const { return device->size(); }
+  reader make_reader() const { return reader(*device); }
+
+private:
+  std::shared_ptr<simulated_device> device;
+};
+
+// An object on an HTTP server. Every reader keeps a connection of its own
+// alive, and fetches each read with a single Range request straight into
+// its buffer, so the workers download their claims in parallel.
+class http_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  explicit http_source(std::shared_ptr<const http_object> object);
+
+  class reader
+  {
+  public:
+    explicit reader(const http_object& object);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    const http_object& object;
+    std::unique_ptr<http_object::connection> connection;
+    std::unique_ptr<char[]> buffer;
+  };
+
+  unsigned_off_t size() const { return object->size(); }
+  reader make_reader() const { return reader(*object); }
+
+private:
+  std::shared_ptr<const http_object> object;
+};
+
+// Several seekable sources read as their concatenation, e.g. the parts of a
+// split file. Reads that straddle a boundary continue into the next part.
+template<typename Part>
+class concat_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  explicit concat_source(std::vector<std::shared_ptr<Part>> parts);
+
+  class reader
+  {
+  public:
+    explicit reader(const concat_source& source);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    typename Part::reader& part_reader(std::size_t part);
+
+    const concat_source& source;
+
+    // Made on first use, as most workers only ever touch a few parts.
+    std::vector<std::optional<typename Part::reader>> readers;
+  };
+
+  unsigned_off_t size() const { return starts.back(); }
+  reader make_reader() const { return reader(*this); }
+
+private:
+  std::vector<std::shared_ptr<Part>> parts;
+
+  // Where each part starts, followed by the total size.
+  std::vector<unsigned_off_t> starts;
+};
+
+// Byte ranges of a seekable source, read as their concatenation, e.g. the
+// blocks of a cache that aren't filled in yet. Each reader reads all the
+// ranges through a single reader of the source.
+template<typename Source>
+class gather_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  // Offset and size of every range, in the order they are read. They
+  // shouldn't extend past the end of the source.
+  typedef std::vector<std::pair<unsigned_off_t, unsigned_off_t>> range_list;
+
+  gather_source(std::shared_ptr<Source> source, range_list ranges);
+
+  class reader
+  {
+  public:
+    explicit reader(const gather_source& source);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    const gather_source& source;
+    typename Source::reader inner;
+  };
+
+  unsigned_off_t size() const { return starts.back(); }
+  reader make_reader() const { return reader(*this); }
+
+private:
+  std::shared_ptr<Source> source;
+  range_list ranges;
+
+  // Where each range starts, followed by the total size.
+  std::vector<unsigned_off_t> starts;
+};
+
+// Passes through another source, writing everything read from it to a copy
+// at the same offsets. Data is written straight from the buffer (or mapping)
+// the hash is computed from, so the input is read only once; overlapping
+// reads of the same range write the same bytes.
+template<typename Source>
+class tee_source
+{
+public:
+  static constexpr bool seekable = Source::seekable;
+
+  tee_source(std::shared_ptr<Source> source, int fd_copy);
+
+  class reader
+  {
+  public:
+    reader(typename Source::reader inner, int fd_copy);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    typename Source::reader inner;
+    int fd_copy;
+  };
+
+  unsigned_off_t size() const { return source->size(); }
+  reader make_reader() const { return reader(source->make_reader(), fd_copy); }
+
+private:
+  std::shared_ptr<Source> source;
+  owned_fd fd_copy;
+};
+
+// Reads one input from several copies of it that are asserted identical,
+// e.g. on different devices. Readers are bound to the copies in turn, so
+// the workers are spread over all of them, and the ones on faster devices
+// end up taking more claims.
+//
+// If check_granularity is not zero, every piece read is also read from all
+// the other copies and compared, in units of that many bytes (the block
+// size), and the units that differ are recorded.
+template<typename Source>
+class mirror_source
+{
+  static_assert(Source::seekable, "mirrors have to be seekable");
+
+public:
+  static constexpr bool seekable = true;
+
+  mirror_source(std::vector<std::shared_ptr<Source>> copies,
+                std::size_t check_granularity);
+
+  class reader
+  {
+  public:
+    reader(const mirror_source& source, std::size_t copy);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    void check(typename Source::reader& other,
+               unsigned_off_t offset,
+               const char* data,
+               std::size_t size);
+
+    const mirror_source& source;
+    typename Source::reader primary;
+    std::vector<typename Source::reader> others;
+  };
+
+  unsigned_off_t size() const { return copies.front()->size(); }
+  reader make_reader() const;
+
+  // Indexes of the units found to differ, in order.
+  std::vector<std::uint64_t> mismatches() const;
+
+private:
+  void mismatch(std::uint64_t unit) const;
+
+  std::vector<std::shared_ptr<Source>> copies;
+  const std::size_t check_granularity;
+
+  mutable std::atomic<std::size_t> next_copy{ 0 };
+  mutable std::mutex mutex;
+  mutable std::set<std::uint64_t> mismatched;
+};
+
+bool
+is_seekable(int fd);
+
+template<typename Consumer>
+std::size_t
+pread_source::reader::read(unsigned_off_t offset,
+                           std::size_t size,
+                           Consumer&& consume)
+{
+  auto wanted_capacity = std::min(size, buffer_size);
+  if (buffer_capacity < wanted_capacity) {
+    buffer.reset(new char[wanted_capacity]);
+    buffer_capacity = wanted_capacity;
+  }
+
+  std::size_t delivered = 0;
+
+  while (delivered < size) {
+    auto count = std::min(size - delivered, buffer_capacity);
+    auto n_read = pread_full(fd, buffer.get(), count, offset + delivered);
+
+    if (n_read == 0) {
+      break;
+    }
+
+    delivered += n_read;
+
+    if (!consume(static_cast<const char*>(buffer.get()), n_read)) {
+      break;
+    }
+  }
+
+  return delivered;
+}
+
+template<typename Consumer>
+std::size_t
+borrowed_reader::read(unsigned_off_t offset,
+                      std::size_t size,
+                      Consumer&& consume)
+{
+  if (offset >= data_size) {
+    return 0;
+  }
+
+  if (size > data_size - offset) {
+    size = std::size_t(data_size - offset);
+  }
+
+  if (advise) {
+    will_need(offset, size);
+  }
+
+  std::size_t delivered = 0;
+
+  while (delivered < size) {
+    auto count = std::min(size - delivered, buffer_size);
+
+    delivered += count;
+
+    if (!consume(data + offset + delivered - count, count)) {
+      break;
+    }
+  }
+
+  return delivered;
+}
+
+template<typename Consumer>
+std::size_t
+uring_source::reader::read(unsigned_off_t offset,
+                           std::size_t size,
+                           Consumer&& consume)
+{
+  std::size_t delivered = 0;
+
+  begin(offset, size);
+
+  try {
+    std::size_t count;
+    while (auto data = next(count)) {
+      delivered += count;
+
+      if (!consume(data, count)) {
+        break;
+      }
+    }
+  } catch (...) {
+    finish();
+    throw;
+  }
+
+  finish();
+  return delivered;
+}
+
+template<typename Consumer>
+std::size_t
+direct_source::reader::read(unsigned_off_t offset,
+                            std::size_t size,
+                            Consumer&& consume)
+{
+  const unsigned_off_t alignment = 4096;
+
+  auto end = offset + size;
+  auto position = offset & ~(alignment - 1);
+  std::size_t delivered = 0;
+
+  while (position < end) {
+    auto aligned_end = (end + alignment - 1) & ~(alignment - 1);
+    auto count =
+      std::size_t(std::min<unsigned_off_t>(aligned_end - position, buffer_size));
+    auto n_read = pread_full(fd, buffer.get(), count, position);
+
+    auto from = std::max(offset, position);
+    auto to = std::min(end, position + n_read);
+
+    if (to > from) {
+      delivered += to - from;
+
+      if (!consume(static_cast<const char*>(buffer.get()) + (from - position),
+                   to - from)) {
+        break;
+      }
+    }
+
+    if (n_read < count) {
+      break;
+    }
+
+    position += n_read;
+  }
+
+  return delivered;
+}
+
+template<typename Consumer>
+std::size_t
+stream_source::reader::read(unsigned_off_t offset,
+                            std::size_t size,
+                            Consumer&& consume)
+{
+  if (offset != position) {
+    throw std::logic_error("stream inputs can only be read sequentially");
+  }
+
+  std::size_t delivered = 0;
+
+  while (delivered < size) {
+    auto count = std::min(size - delivered, buffer_size);
+    auto n_read = read_full(fd, buffer.get(), count);
+
+    if (n_read == 0) {
+      break;
+    }
+
+    delivered += n_read;
+    position += n_read;
+
+    if (!consume(static_cast<const char*>(buffer.get()), n_read)) {
+      break;
+    }
+  }
+
+  return delivered;
+}
+
+template<typename Consumer>
+std::size_t
+simulated_source::reader::read(unsigned_off_t offset,
+                               std::size_t size,
+                               Consumer&& consume)
+{
+  std::size_t delivered = 0;
+
+  while (delivered < size) {
+    auto count = std::min(size - delivered, buffer_size);
+    auto n_read = device.pread(buffer.get(), count, offset + delivered);
+
+    if (n_read == 0) {
+      break;
+    }
+
+    delivered += n_read;
+
+    if (!consume(static_cast<const char*>(buffer.get()), n_read)) {
+      break;
+    }
+  }
+
+  return delivered;
+}
+
+// The rest of an abandoned body would still arrive on the connection, so
+// it is dropped instead.
+template<typename Consumer>
+std::size_t
+http_source::reader::read(unsigned_off_t offset,
+                          std::size_t size,
+                          Consumer&& consume)
+{
+  if (offset >= object.size()) {
+    return 0;
+  }
+
+  if (size > object.size() - offset) {
+    size = std::size_t(object.size() - offset);
+  }
+
+  connection->request(offset, size);
+
+  std::size_t delivered = 0;
+
+  while (delivered < size) {
+    auto count = std::min(size - delivered, buffer_size);
+
+    connection->receive(buffer.get(), count);
+    delivered += count;
+
+    if (!consume(static_cast<const char*>(buffer.get()), count)) {
+      if (delivered < size) {
+        connection->reset();
+      }
+      break;
+    }
+  }
+
+  return delivered;
+}
+
+template<typename Part>
+concat_source<Part>::concat_source(std::vector<std::shared_ptr<Part>> parts)
+  : parts(std::move(parts))
+{
+  starts.push_back(0);
+
+  for (auto& part : this->parts) {
+    starts.push_back(starts.back() + part->size());
+  }
+}
+
+template<typename Part>
+concat_source<Part>::reader::reader(const concat_source& source)
+  : source(source)
+  , readers(source.parts.size())
+{}
+
+template<typename Part>
+typename Part::reader&
+concat_source<Part>::reader::part_reader(std::size_t part)
+{
+  if (!readers[part]) {
+    readers[part].emplace(source.parts[part]->make_reader());
+  }
+
+  return *readers[part];
+}
+
+template<typename Part>
+template<typename Consumer>
+std::size_t
+concat_source<Part>::reader::read(unsigned_off_t offset,
+                                  std::size_t size,
+                                  Consumer&& consume)
+{
+  auto& starts = source.starts;
+  auto end = std::min(offset + size, starts.back());
+  std::size_t part =
+    std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+  std::size_t delivered = 0;
+
+  for (; part < source.parts.size() && offset + delivered < end; part++) {
+    auto position = offset + delivered;
+    auto count = std::size_t(std::min(end, starts[part + 1]) - position);
+
+    if (count == 0) {
+      continue;
+    }
+
+    bool abandoned = false;
+    auto n_read = part_reader(part).read(
+      position - starts[part], count, [&](const char* data, std::size_t n) {
+        abandoned = !consume(data, n);
+        return !abandoned;
+      });
+
+    delivered += n_read;
+
+    // A part shorter than it was when we started ends the input early.
+    if (abandoned || n_read < count) {
+      break;
+    }
+  }
+
+  return delivered;
+}
+
+template<typename Source>
+gather_source<Source>::gather_source(std::shared_ptr<Source> source,
+                                     range_list ranges)
+  : source(std::move(source))
+  , ranges(std::move(ranges))
+{
+  starts.push_back(0);
+
+  for (auto& range : this->ranges) {
+    starts.push_back(starts.back() + range.second);
+  }
+}
+
+template<typename Source>
+gather_source<Source>::reader::reader(const gather_source& source)
+  : source(source)
+  , inner(source.source->make_reader())
+{}
+
+template<typename Source>
+template<typename Consumer>
+std::size_t
+gather_source<Source>::reader::read(unsigned_off_t offset,
+                                    std::size_t size,
+                                    Consumer&& consume)
+{
+  auto& starts = source.starts;
+  auto end = std::min(offset + size, starts.back());
+  std::size_t range =
+    std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+  std::size_t delivered = 0;
+
+  for (; range < source.ranges.size() && offset + delivered < end; range++) {
+    auto position = offset + delivered;
+    auto count = std::size_t(std::min(end, starts[range + 1]) - position);
+
+    if (count == 0) {
+      continue;
+    }
+
+    bool abandoned = false;
+    auto n_read = inner.read(source.ranges[range].first + position -
+                               starts[range],
+                             count,
+                             [&](const char* data, std::size_t n) {
+                               abandoned = !consume(data, n);
+                               return !abandoned;
+                             });
+
+    delivered += n_read;
+
+    // The source shrank since the ranges were taken.
+    if (abandoned || n_read < count) {
+      break;
+    }
+  }
+
+  return delivered;
+}
+
+template<typename Source>
+tee_source<Source>::tee_source(std::shared_ptr<Source> source, int fd_copy)
+  : source(std::move(source))
+  , fd_copy(dup(fd_copy), "dup")
+{
+  // Sized up front, so that parallel writes don't keep extending the file.
+  if constexpr (Source::seekable) {
+    if (ftruncate(this->fd_copy, this->source->size()) != 0) {
+      throw std::system_error(errno, std::generic_category(), "ftruncate");
+    }
+  }
+}
+
+template<typename Source>
+tee_source<Source>::reader::reader(typename Source::reader inner, int fd_copy)
+  : inner(std::move(inner))
+  , fd_copy(fd_copy)
+{}
+
+template<typename Source>
+template<typename Consumer>
+std::size_t
+tee_source<Source>::reader::read(unsigned_off_t offset,
+                                 std::size_t size,
+                                 Consumer&& consume)
+{
+  auto position = offset;
+
+  return inner.read(offset, size, [&](const char* data, std::size_t count) {
+    pwrite_full(fd_copy, data, count, position);
+    position += count;
+    return consume(data, count);
+  });
+}
+
+template<typename Source>
+mirror_source<Source>::mirror_source(
+  std::vector<std::shared_ptr<Source>> copies,
+  std::size_t check_granularity)
+  : copies(std::move(copies))
+  , check_granularity(check_granularity)
+{
+  if (this->copies.empty()) {
+    throw std::invalid_argument("no copies to read from");
+  }
+
+  for (auto& copy : this->copies) {
+    if (copy->size() != size()) {
+      throw std::invalid_argument("mirrors differ in size");
+    }
+  }
+}
+
+template<typename Source>
+typename mirror_source<Source>::reader
+mirror_source<Source>::make_reader() const
+{
+  return reader(*this,
+                next_copy.fetch_add(1, std::memory_order_relaxed) %
+                  copies.size());
+}
+
+template<typename Source>
+std::vector<std::uint64_t>
+mirror_source<Source>::mismatches() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return std::vector<std::uint64_t>(mismatched.begin(), mismatched.end());
+}
+
+template<typename Source>
+void
+mirror_source<Source>::mismatch(std::uint64_t unit) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  mismatched.insert(unit);
+}
+
+template<typename Source>
+mirror_source<Source>::reader::reader(const mirror_source& source,
+                                      std::size_t copy)
+  : source(source)
+  , primary(source.copies[copy]->make_reader())
+{
+  if (source.check_granularity) {
+    for (std::size_t i = 1; i < source.copies.size(); i++) {
+      others.push_back(
+        source.copies[(copy + i) % source.copies.size()]->make_reader());
+    }
+  }
+}
+
+template<typename Source>
+template<typename Consumer>
+std::size_t
+mirror_source<Source>::reader::read(unsigned_off_t offset,
+                                    std::size_t size,
+                                    Consumer&& consume)
+{
+  if (others.empty()) {
+    return primary.read(offset, size, std::forward<Consumer>(consume));
+  }
+
+  auto position = offset;
+
+  return primary.read(offset, size, [&](const char* data, std::size_t count) {
+    if (!consume(data, count)) {
+      return false;
+    }
+
+    for (auto& other : others) {
+      check(other, position, data, count);
+    }
+    position += count;
+    return true;
+  });
+}
+
+// Compares a piece read from the primary copy with the same range of
+// another one, unit by unit.
+template<typename Source>
+void
+mirror_source<Source>::reader::check(typename Source::reader& other,
+                                     unsigned_off_t offset,
+                                     const char* data,
+                                     std::size_t size)
+{
+  auto granularity = source.check_granularity;
+  auto position = offset;
+
+  auto n_read =
+    other.read(offset, size, [&](const char* copy, std::size_t count) {
+      auto end = position + count;
+
+      while (position < end) {
+        auto unit = position / granularity;
+        auto to = std::min<unsigned_off_t>(end, (unit + 1) * granularity);
+
+        if (std::memcmp(data + (position - offset),
+                        copy,
+                        std::size_t(to - position)) != 0) {
+          source.mismatch(unit);
+        }
+
+        copy += to - position;
+        position = to;
+      }
+
+      return true;
+    });
+
+  // The other copy shrank under us.
+  if (n_read < size) {
+    source.mismatch((offset + n_read) / granularity);
+  }
+}
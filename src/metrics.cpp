@@ -0,0 +1,362 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+// How often the HTTP thread checks whether it should stop.
+const int poll_interval_ms = 200;
+
+void
+metric_header(std::ostream& stream,
+              const char* name,
+              const char* type,
+              const char* help)
+{
+  stream << "# HELP " << name << ' ' << help << '\n'
+         << "# TYPE " << name << ' ' << type << '\n';
+}
+
+int
+listen_on(const std::string& address)
+{
+  auto colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    throw std::invalid_argument("metrics address should be host:port");
+  }
+
+  auto host = address.substr(0, colon);
+  auto port = address.substr(colon + 1);
+
+  if (host.empty()) {
+    host = "127.0.0.1";
+  }
+
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  addrinfo* addresses;
+  auto error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+  if (error) {
+    throw std::runtime_error(address + ": " + gai_strerror(error));
+  }
+
+  int fd = socket(addresses->ai_family,
+                  addresses->ai_socktype | SOCK_CLOEXEC,
+                  addresses->ai_protocol);
+  if (fd == -1) {
+    freeaddrinfo(addresses);
+    throw std::system_error(errno, std::generic_category(), "socket");
+  }
+
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  if (bind(fd, addresses->ai_addr, addresses->ai_addrlen) != 0 ||
+      listen(fd, 16) != 0) {
+    auto bind_errno = errno;
+    freeaddrinfo(addresses);
+    close(fd);
+    throw std::system_error(bind_errno, std::generic_category(), address);
+  }
+
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+void
+send_all(int fd, const std::string& data)
+{
+  std::size_t sent = 0;
+
+  while (sent < data.size()) {
+    auto n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    sent += n;
+  }
+}
+
+}
+
+signing_metrics::signing_metrics(unsigned int workers)
+  : workers(workers)
+  , counters(new worker_counters[workers])
+  , started(std::chrono::system_clock::now())
+{}
+
+worker_counters&
+signing_metrics::worker(unsigned int index)
+{
+  return counters[index % workers];
+}
+
+void
+signing_metrics::add_input(std::uint64_t bytes, std::uint64_t claims)
+{
+  input_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  claims_total.fetch_add(claims, std::memory_order_relaxed);
+}
+
+void
+signing_metrics::add_error()
+{
+  errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string
+signing_metrics::render() const
+{
+  std::ostringstream stream;
+  std::uint64_t claims_picked_up = 0;
+
+  metric_header(stream,
+                "signature_bytes_hashed_total",
+                "counter",
+                "Bytes read and checksummed.");
+  for (unsigned int i = 0; i < workers; i++) {
+    stream << "signature_bytes_hashed_total{worker=\"" << i << "\"} "
+           << counters[i].bytes.load(std::memory_order_relaxed) << '\n';
+  }
+
+  metric_header(stream,
+                "signature_claims_started_total",
+                "counter",
+                "Claims workers started reading, re-issues included.");
+  for (unsigned int i = 0; i < workers; i++) {
+    auto started = counters[i].claims_started.load(std::memory_order_relaxed);
+    auto reissued =
+      counters[i].claims_reissued.load(std::memory_order_relaxed);
+
+    stream << "signature_claims_started_total{worker=\"" << i << "\"} "
+           << started << '\n';
+    claims_picked_up += started - std::min(started, reissued);
+  }
+
+  metric_header(stream,
+                "signature_claims_reissued_total",
+                "counter",
+                "Re-issues of claims that were slow to complete.");
+  for (unsigned int i = 0; i < workers; i++) {
+    stream << "signature_claims_reissued_total{worker=\"" << i << "\"} "
+           << counters[i].claims_reissued.load(std::memory_order_relaxed)
+           << '\n';
+  }
+
+  metric_header(stream,
+                "signature_claims_completed_total",
+                "counter",
+                "Claims whose checksums were written out.");
+  for (unsigned int i = 0; i < workers; i++) {
+    stream << "signature_claims_completed_total{worker=\"" << i << "\"} "
+           << counters[i].claims_completed.load(std::memory_order_relaxed)
+           << '\n';
+  }
+
+  metric_header(stream,
+                "signature_worker_busy_seconds_total",
+                "counter",
+                "Time workers spent reading and hashing claims.");
+  for (unsigned int i = 0; i < workers; i++) {
+    stream << "signature_worker_busy_seconds_total{worker=\"" << i << "\"} "
+           << counters[i].busy_ns.load(std::memory_order_relaxed) / 1e9
+           << '\n';
+  }
+
+  auto total = claims_total.load(std::memory_order_relaxed);
+
+  metric_header(stream,
+                "signature_queue_depth",
+                "gauge",
+                "Claims not yet picked up by a worker.");
+  stream << "signature_queue_depth "
+         << total - std::min(total, claims_picked_up) << '\n';
+
+  metric_header(
+    stream, "signature_input_bytes_total", "counter", "Bytes of input seen.");
+  stream << "signature_input_bytes_total "
+         << input_bytes.load(std::memory_order_relaxed) << '\n';
+
+  metric_header(
+    stream, "signature_errors_total", "counter", "Runs that failed.");
+  stream << "signature_errors_total "
+         << errors.load(std::memory_order_relaxed) << '\n';
+
+  metric_header(stream,
+                "signature_start_time_seconds",
+                "gauge",
+                "When metrics collection started, in seconds since the epoch.");
+  stream << "signature_start_time_seconds "
+         << std::chrono::duration_cast<std::chrono::seconds>(
+              started.time_since_epoch())
+              .count()
+         << '\n';
+
+  return stream.str();
+}
+
+metrics_exporter::metrics_exporter(
+  std::shared_ptr<const signing_metrics> metrics,
+  const std::string& listen,
+  const std::string& path,
+  std::chrono::milliseconds interval)
+  : metrics(std::move(metrics))
+  , path(path)
+  , interval(interval)
+{
+  if (!listen.empty()) {
+    listen_fd = listen_on(listen);
+  }
+
+  if (listen_fd != -1 || !path.empty()) {
+    thread = std::thread([this]() {
+      if (listen_fd != -1) {
+        serve();
+      } else {
+        while (!wait_for_stop(this->interval)) {
+          write_file();
+        }
+      }
+    });
+  }
+}
+
+metrics_exporter::~metrics_exporter()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  stop_requested.notify_all();
+
+  if (thread.joinable()) {
+    thread.join();
+  }
+
+  if (listen_fd != -1) {
+    close(listen_fd);
+  }
+
+  // The final values, for the collector to pick up after we are gone.
+  if (!path.empty()) {
+    try {
+      write_file();
+    } catch (const std::exception&) {
+    }
+  }
+}
+
+bool
+metrics_exporter::wait_for_stop(std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return stop_requested.wait_for(lock, timeout, [this]() { return stopping; });
+}
+
+// Written next to the target and renamed over it, so that the collector never
+// sees a partial file.
+void
+metrics_exporter::write_file()
+{
+  auto temporary = path + ".tmp";
+
+  {
+    std::ofstream stream;
+    stream.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    stream.open(temporary);
+    stream << metrics->render();
+  }
+
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+}
+
+void
+metrics_exporter::serve()
+{
+  auto next_write = std::chrono::steady_clock::now() + interval;
+
+  while (!wait_for_stop(std::chrono::milliseconds(0))) {
+    if (!path.empty() && std::chrono::steady_clock::now() >= next_write) {
+      try {
+        write_file();
+      } catch (const std::exception&) {
+      }
+      next_write += interval;
+    }
+
+    pollfd listening = { listen_fd, POLLIN, 0 };
+    if (poll(&listening, 1, poll_interval_ms) <= 0) {
+      continue;
+    }
+
+    int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == -1) {
+      continue;
+    }
+
+    // One short request per connection: read its first line, ignore the rest.
+    char request[1024];
+    pollfd readable = { client, POLLIN, 0 };
+    std::size_t received = 0;
+
+    while (received < sizeof(request) &&
+           poll(&readable, 1, poll_interval_ms) > 0) {
+      auto n = recv(client, request + received, sizeof(request) - received, 0);
+      if (n <= 0) {
+        break;
+      }
+
+      received += n;
+      if (std::memchr(request, '\n', received)) {
+        break;
+      }
+    }
+
+    std::string line(request, received);
+    line = line.substr(0, line.find('\r'));
+
+    std::string status = "200 OK";
+    std::string body;
+
+    if (line.compare(0, 13, "GET /metrics ") == 0 ||
+        line.compare(0, 6, "GET / ") == 0) {
+      body = metrics->render();
+    } else {
+      status = "404 Not Found";
+      body = "not found\n";
+    }
+
+    std::ostringstream response;
+    response << "HTTP/1.0 " << status << "\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body;
+
+    send_all(client, response.str());
+    close(client);
+  }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Counters of one worker. Only that worker writes them, with relaxed
+// atomics, so it never waits for whoever reads them.
+struct alignas(64) worker_counters
+{
+  std::atomic<std::uint64_t> bytes{ 0 };
+  // Including re-issues of straggling claims, which claims_reissued counts
+  // on their own.
+  std::atomic<std::uint64_t> claims_started{ 0 };
+  std::atomic<std::uint64_t> claims_reissued{ 0 };
+  std::atomic<std::uint64_t> claims_completed{ 0 };
+  std::atomic<std::uint64_t> busy_ns{ 0 };
+};
+
+// What generate_signature() reports while it runs. Counters accumulate over
+// all the runs the object is passed to.
+class signing_metrics
+{
+public:
+  explicit signing_metrics(unsigned int workers);
+
+  worker_counters& worker(unsigned int index);
+
+  void add_input(std::uint64_t bytes, std::uint64_t claims);
+  void add_error();
+
+  // Renders the Prometheus text exposition format.
+  std::string render() const;
+
+private:
+  const unsigned int workers;
+  std::unique_ptr<worker_counters[]> counters;
+  std::atomic<std::uint64_t> input_bytes{ 0 };
+  std::atomic<std::uint64_t> claims_total{ 0 };
+  std::atomic<std::uint64_t> errors{ 0 };
+  const std::chrono::system_clock::time_point started;
+};
+
+// Publishes metrics from a thread of its own until destroyed: serves them
+// over HTTP if listen is set, rewrites a node_exporter textfile collector
+// file every interval if path is set.
+class metrics_exporter
+{
+public:
+  metrics_exporter(std::shared_ptr<const signing_metrics> metrics,
+                   const std::string& listen,
+                   const std::string& path,
+                   std::chrono::milliseconds interval);
+  ~metrics_exporter();
+
+  metrics_exporter(const metrics_exporter&) = delete;
+  metrics_exporter& operator=(const metrics_exporter&) = delete;
+
+private:
+  void serve();
+  void write_file();
+  bool wait_for_stop(std::chrono::milliseconds timeout);
+
+  const std::shared_ptr<const signing_metrics> metrics;
+  const std::string path;
+  const std::chrono::milliseconds interval;
+  int listen_fd = -1;
+
+  std::mutex mutex;
+  std::condition_variable stop_requested;
+  bool stopping = false;
+  std::thread thread;
+};
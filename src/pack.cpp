@@ -0,0 +1,403 @@
+#include "pack.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIGNATURE_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define SIGNATURE_HAVE_X86_SIMD 0
+#endif
+
+namespace {
+
+// Each compressor folds `count` 64-byte blocks into the state.
+typedef void (*compress_function)(std::uint32_t* state,
+                                  const unsigned char* data,
+                                  std::size_t count);
+
+const std::uint32_t round_constants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+std::uint32_t
+rotr(std::uint32_t value, unsigned int bits)
+{
+  return (value >> bits) | (value << (32 - bits));
+}
+
+void
+compress_scalar(std::uint32_t* state,
+                const unsigned char* data,
+                std::size_t count)
+{
+  for (; count; count--, data += 64) {
+    std::uint32_t w[64];
+
+    for (unsigned int i = 0; i < 16; i++) {
+      w[i] = std::uint32_t(data[4 * i]) << 24 |
+             std::uint32_t(data[4 * i + 1]) << 16 |
+             std::uint32_t(data[4 * i + 2]) << 8 | data[4 * i + 3];
+    }
+
+    for (unsigned int i = 16; i < 64; i++) {
+      auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (unsigned int i = 0; i < 64; i++) {
+      auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      auto choice = (e & f) ^ (~e & g);
+      auto t1 = h + s1 + choice + round_constants[i] + w[i];
+      auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      auto majority = (a & b) ^ (a & c) ^ (b & c);
+
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + s0 + majority;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#if SIGNATURE_HAVE_X86_SIMD
+
+// The state is kept as ABEF and CDGH, the layout sha256rnds2 works on, and
+// msg[i % 4] holds the words of group i of the message schedule, computed
+// from the four groups before it just before it is needed.
+__attribute__((target("sha,sse4.1"))) void
+compress_sha_ni(std::uint32_t* state,
+                const unsigned char* data,
+                std::size_t count)
+{
+  const __m128i byte_swap =
+    _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  auto dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+  auto hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+  auto cdab = _mm_shuffle_epi32(dcba, 0xb1);
+  auto efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+  auto abef = _mm_alignr_epi8(cdab, efgh, 8);
+  auto cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+  for (; count; count--, data += 64) {
+    auto abef_saved = abef;
+    auto cdgh_saved = cdgh;
+    __m128i msg[4];
+
+    for (unsigned int i = 0; i < 16; i++) {
+      if (i < 4) {
+        msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)),
+          byte_swap);
+      } else {
+        auto& group = msg[i % 4];
+        auto previous = msg[(i + 3) % 4];
+
+        group = _mm_sha256msg1_epu32(group, msg[(i + 1) % 4]);
+        group = _mm_add_epi32(
+          group, _mm_alignr_epi8(previous, msg[(i + 2) % 4], 4));
+        group = _mm_sha256msg2_epu32(group, previous);
+      }
+
+      auto words = _mm_add_epi32(
+        msg[i % 4],
+        _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(round_constants + 4 * i)));
+
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0e));
+    }
+
+    abef = _mm_add_epi32(abef, abef_saved);
+    cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+  }
+
+  auto feba = _mm_shuffle_epi32(abef, 0x1b);
+  auto dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state),
+                   _mm_blend_epi16(feba, dchg, 0xf0));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4),
+                   _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#endif
+
+compress_function
+select_compress()
+{
+#if SIGNATURE_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+    return compress_sha_ni;
+  }
+#endif
+  return compress_scalar;
+}
+
+const char index_magic[8] = { 'C', 'R', 'C', 'P', 'A', 'C', 'K', 2 };
+
+struct index_header
+{
+  char magic[8];
+  std::uint64_t count;
+
+  // Size of the pack when the index was saved: it may have grown since,
+  // by blocks that were never indexed, but never shrunk.
+  std::uint64_t pack_size;
+  char reserved[40];
+};
+
+static_assert(sizeof(index_header) == 64, "pack index header layout");
+static_assert(sizeof(block_pack::index_entry) == 48, "pack index layout");
+
+bool
+entry_before(const block_pack::index_entry& a,
+             const block_pack::index_entry& b)
+{
+  return a.crc < b.crc || (a.crc == b.crc && a.offset < b.offset);
+}
+
+}
+
+void
+block_hasher::reset()
+{
+  state[0] = 0x6a09e667;
+  state[1] = 0xbb67ae85;
+  state[2] = 0x3c6ef372;
+  state[3] = 0xa54ff53a;
+  state[4] = 0x510e527f;
+  state[5] = 0x9b05688c;
+  state[6] = 0x1f83d9ab;
+  state[7] = 0x5be0cd19;
+  pending_size = 0;
+  total = 0;
+}
+
+void
+block_hasher::update(const char* data, std::size_t size)
+{
+  static const auto compress = select_compress();
+
+  auto bytes = reinterpret_cast<const unsigned char*>(data);
+  total += size;
+
+  if (pending_size) {
+    auto count = std::min(size, sizeof(pending) - pending_size);
+    std::memcpy(pending + pending_size, bytes, count);
+    pending_size += count;
+    bytes += count;
+    size -= count;
+
+    if (pending_size < sizeof(pending)) {
+      return;
+    }
+
+    compress(state, pending, 1);
+    pending_size = 0;
+  }
+
+  compress(state, bytes, size / 64);
+  bytes += size / 64 * 64;
+  size %= 64;
+
+  std::memcpy(pending, bytes, size);
+  pending_size = size;
+}
+
+block_digest
+block_hasher::digest()
+{
+  auto bits = total * 8;
+  unsigned char padding[72] = { 0x80 };
+  auto padding_size = (pending_size < 56 ? 56 : 120) - pending_size;
+
+  for (unsigned int i = 0; i < 8; i++) {
+    padding[padding_size + i] = (unsigned char)(bits >> (56 - 8 * i));
+  }
+
+  update(reinterpret_cast<const char*>(padding), padding_size + 8);
+
+  block_digest result;
+  std::copy(state, state + 8, result.begin());
+  return result;
+}
+
+block_pack::block_pack(const std::string& path)
+  : path(path)
+  , fd(open(path.c_str(), O_RDWR | O_CREAT, 0644), "open")
+  , lock(fd)
+  , initial_end(fd_size(fd))
+  , end(initial_end)
+{
+  auto index_path = path + ".idx";
+  int index_fd = open(index_path.c_str(), O_RDONLY);
+
+  if (index_fd == -1) {
+    if (errno != ENOENT) {
+      throw std::system_error(errno, std::generic_category(), "open");
+    }
+    return;
+  }
+
+  owned_fd index_file(index_fd, "open");
+  mapping_size = fd_size(index_file);
+
+  if (mapping_size < sizeof(index_header)) {
+    throw std::runtime_error(index_path + ": not a pack index");
+  }
+
+  mapping =
+    mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, index_file, 0);
+  if (mapping == MAP_FAILED) {
+    mapping = nullptr;
+    throw std::system_error(errno, std::generic_category(), "mmap");
+  }
+
+  auto header = static_cast<const index_header*>(mapping);
+  saved = reinterpret_cast<const index_entry*>(header + 1);
+  saved_count = header->count;
+
+  // Version 1 indexes hold SHA-1 digests, which can't confirm a match.
+  if (std::memcmp(header->magic, index_magic, sizeof(header->magic) - 1) ==
+        0 &&
+      header->magic[7] != index_magic[7]) {
+    munmap(const_cast<void*>(mapping), mapping_size);
+    mapping = nullptr;
+    throw std::runtime_error(index_path +
+                             ": index of an older version, start a new pack");
+  }
+
+  if (std::memcmp(header->magic, index_magic, sizeof(header->magic)) != 0 ||
+      mapping_size !=
+        sizeof(index_header) + saved_count * sizeof(index_entry)) {
+    munmap(const_cast<void*>(mapping), mapping_size);
+    mapping = nullptr;
+    throw std::runtime_error(index_path + ": not a pack index");
+  }
+
+  if (header->pack_size > initial_end) {
+    munmap(const_cast<void*>(mapping), mapping_size);
+    mapping = nullptr;
+    throw std::runtime_error(path + ": shorter than its index says");
+  }
+}
+
+block_pack::~block_pack()
+{
+  if (mapping) {
+    munmap(const_cast<void*>(mapping), mapping_size);
+  }
+}
+
+const block_pack::index_entry*
+block_pack::find_saved(std::uint32_t crc,
+                       const block_digest& digest,
+                       std::size_t size) const
+{
+  auto range = std::equal_range(
+    saved, saved + saved_count, index_entry{ 0, 0, crc, {} },
+    [](const index_entry& a, const index_entry& b) { return a.crc < b.crc; });
+
+  for (auto entry = range.first; entry != range.second; entry++) {
+    if (entry->digest == digest && entry->length == size) {
+      return entry;
+    }
+  }
+
+  return nullptr;
+}
+
+pack_location
+block_pack::store(std::uint32_t crc,
+                  const block_digest& digest,
+                  const char* data,
+                  std::size_t size)
+{
+  if (auto entry = find_saved(crc, digest, size)) {
+    return { entry->offset, entry->length, crc };
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  auto range = added.equal_range(crc);
+  for (auto i = range.first; i != range.second; i++) {
+    if (i->second.digest == digest && i->second.length == size) {
+      return { i->second.offset, i->second.length, crc };
+    }
+  }
+
+  // The space is taken before writing, so that other threads can hand out
+  // the location while the block is still being written.
+  index_entry entry{ end, std::uint32_t(size), crc, digest };
+  end += size;
+  added.emplace(crc, entry);
+  lock.unlock();
+
+  pwrite_full(fd, data, size, entry.offset);
+  return { entry.offset, entry.length, crc };
+}
+
+void
+block_pack::save_index()
+{
+  if (fdatasync(fd) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fdatasync");
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::vector<index_entry> entries(saved, saved + saved_count);
+  for (auto& i : added) {
+    entries.push_back(i.second);
+  }
+  std::sort(entries.begin(), entries.end(), entry_before);
+
+  index_header header{};
+  std::memcpy(header.magic, index_magic, sizeof(header.magic));
+  header.count = entries.size();
+  header.pack_size = end;
+
+  write_file_atomically(
+    path + ".idx",
+    { { &header, sizeof(header) },
+      { entries.data(), entries.size() * sizeof(index_entry) } });
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "io_source.h"
+
+// A content-addressed store of blocks, filled while signing: a pack file
+// holding every distinct block once, and an index from the CRC-32 of each
+// block to where it is in the pack. The index also keeps the SHA-256 of every
+// block, which confirms a match before a block is taken as already stored.
+typedef std::array<std::uint32_t, 8> block_digest;
+
+// SHA-256, a 64-byte block at a time, with the SHA extensions where the CPU
+// has them.
+class block_hasher
+{
+public:
+  block_hasher() { reset(); }
+
+  void reset();
+  void update(const char* data, std::size_t size);
+
+  // Only valid once per reset().
+  block_digest digest();
+
+private:
+  std::uint32_t state[8];
+  unsigned char pending[64];
+  std::size_t pending_size;
+  std::uint64_t total;
+};
+
+// Where a block of the input is in the pack. The recipe of an input is an
+// array of these, at the same indexes as the checksums of its blocks.
+struct pack_location
+{
+  std::uint64_t offset;
+  std::uint32_t length;
+  std::uint32_t crc;
+};
+
+static_assert(sizeof(pack_location) == 16, "recipe entry layout");
+
+class block_pack
+{
+public:
+  // Opens the pack at `path`, creating it if missing, with its index at
+  // `path` + ".idx". Blocks are appended after whatever the pack holds.
+  // The pack stays locked until destroyed, so that another process opening
+  // it waits, rather than appending to the same place.
+  explicit block_pack(const std::string& path);
+  ~block_pack();
+
+  block_pack(const block_pack&) = delete;
+  block_pack& operator=(const block_pack&) = delete;
+
+  // Returns where a block with this content is, appending it to the pack
+  // if it isn't there yet. Safe to call from several threads.
+  pack_location store(std::uint32_t crc,
+                      const block_digest& digest,
+                      const char* data,
+                      std::size_t size);
+
+  // Syncs the pack and replaces the index with one that also covers the
+  // blocks stored since it was opened.
+  void save_index();
+
+  std::uint64_t blocks_added() const { return added.size(); }
+  std::uint64_t bytes_added() const { return end - initial_end; }
+
+  struct index_entry
+  {
+    std::uint64_t offset;
+    std::uint32_t length;
+    std::uint32_t crc;
+    block_digest digest;
+  };
+
+private:
+  const index_entry* find_saved(std::uint32_t crc,
+                                const block_digest& digest,
+                                std::size_t size) const;
+
+  const std::string path;
+  owned_fd fd;
+  file_lock lock;
+
+  // The index as saved, sorted by CRC, then offset.
+  const void* mapping = nullptr;
+  std::size_t mapping_size = 0;
+  const index_entry* saved = nullptr;
+  std::uint64_t saved_count = 0;
+
+  std::mutex mutex;
+  std::unordered_multimap<std::uint32_t, index_entry> added;
+  std::uint64_t initial_end;
+  std::uint64_t end;
+};
@@ -0,0 +1,576 @@
+#include "parity.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIGNATURE_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define SIGNATURE_HAVE_X86_SIMD 0
+#endif
+
+#include <boost/crc.hpp>
+
+#include "signature.h"
+
+namespace {
+
+const char parity_magic[8] = { 'C', 'R', 'C', 'P', 'A', 'R', 0, 1 };
+
+// Logarithms over GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1.
+struct gf256_tables
+{
+  gf256_tables();
+
+  unsigned char exp[512];
+  unsigned char log[256];
+};
+
+gf256_tables::gf256_tables()
+{
+  unsigned int x = 1;
+
+  for (unsigned int i = 0; i < 255; i++) {
+    exp[i] = exp[i + 255] = x;
+    log[x] = i;
+
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= 0x11d;
+    }
+  }
+
+  exp[510] = exp[511] = 0;
+  log[0] = 0;
+}
+
+const gf256_tables&
+gf256()
+{
+  static const gf256_tables tables;
+  return tables;
+}
+
+unsigned char
+gf256_mul(unsigned char a, unsigned char b)
+{
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+
+  auto& tables = gf256();
+  return tables.exp[tables.log[a] + tables.log[b]];
+}
+
+unsigned char
+gf256_inverse(unsigned char a)
+{
+  auto& tables = gf256();
+  return tables.exp[255 - tables.log[a]];
+}
+
+// Coefficient of data block `col` in parity block `row`: all ones for XOR,
+// otherwise 1 / (x_row + y_col) with x = row and y = count + col, which
+// makes every square submatrix invertible.
+unsigned char
+parity_coefficient(const parity_layout& layout,
+                   unsigned int row,
+                   unsigned int col)
+{
+  if (layout.count == 1) {
+    return 1;
+  }
+
+  return gf256_inverse(row ^ (layout.count + col));
+}
+
+// Products of c with every low and every high nibble: c * x is the XOR of
+// the two lookups for the nibbles of x.
+struct nibble_tables
+{
+  explicit nibble_tables(unsigned char c);
+
+  alignas(16) unsigned char low[16];
+  alignas(16) unsigned char high[16];
+};
+
+nibble_tables::nibble_tables(unsigned char c)
+{
+  for (unsigned int x = 0; x < 16; x++) {
+    low[x] = gf256_mul(c, x);
+    high[x] = gf256_mul(c, x << 4);
+  }
+}
+
+typedef void (*mul_add_function)(unsigned char* dst,
+                                 const unsigned char* src,
+                                 std::size_t size,
+                                 const nibble_tables& tables);
+
+void
+mul_add_scalar(unsigned char* dst,
+               const unsigned char* src,
+               std::size_t size,
+               const nibble_tables& tables)
+{
+  for (std::size_t i = 0; i < size; i++) {
+    dst[i] ^= tables.low[src[i] & 0xf] ^ tables.high[src[i] >> 4];
+  }
+}
+
+#if SIGNATURE_HAVE_X86_SIMD
+
+__attribute__((target("ssse3"))) void
+mul_add_ssse3(unsigned char* dst,
+              const unsigned char* src,
+              std::size_t size,
+              const nibble_tables& tables)
+{
+  auto low = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.low));
+  auto high = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.high));
+  auto mask = _mm_set1_epi8(0xf);
+  std::size_t i = 0;
+
+  for (; i + 16 <= size; i += 16) {
+    auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    auto x_low = _mm_and_si128(x, mask);
+    auto x_high = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+    auto product = _mm_xor_si128(_mm_shuffle_epi8(low, x_low),
+                                 _mm_shuffle_epi8(high, x_high));
+
+    auto d = reinterpret_cast<__m128i*>(dst + i);
+    _mm_storeu_si128(d, _mm_xor_si128(_mm_loadu_si128(d), product));
+  }
+
+  mul_add_scalar(dst + i, src + i, size - i, tables);
+}
+
+__attribute__((target("avx2"))) void
+mul_add_avx2(unsigned char* dst,
+             const unsigned char* src,
+             std::size_t size,
+             const nibble_tables& tables)
+{
+  auto low = _mm256_broadcastsi128_si256(
+    _mm_load_si128(reinterpret_cast<const __m128i*>(tables.low)));
+  auto high = _mm256_broadcastsi128_si256(
+    _mm_load_si128(reinterpret_cast<const __m128i*>(tables.high)));
+  auto mask = _mm256_set1_epi8(0xf);
+  std::size_t i = 0;
+
+  for (; i + 32 <= size; i += 32) {
+    auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    auto x_low = _mm256_and_si256(x, mask);
+    auto x_high = _mm256_and_si256(_mm256_srli_epi16(x, 4), mask);
+    auto product = _mm256_xor_si256(_mm256_shuffle_epi8(low, x_low),
+                                    _mm256_shuffle_epi8(high, x_high));
+
+    auto d = reinterpret_cast<__m256i*>(dst + i);
+    _mm256_storeu_si256(d, _mm256_xor_si256(_mm256_loadu_si256(d), product));
+  }
+
+  mul_add_scalar(dst + i, src + i, size - i, tables);
+}
+
+#endif
+
+mul_add_function
+select_mul_add()
+{
+#if SIGNATURE_HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    return mul_add_avx2;
+  }
+
+  if (__builtin_cpu_supports("ssse3")) {
+    return mul_add_ssse3;
+  }
+#endif
+
+  return mul_add_scalar;
+}
+
+void
+put_le(char* out, std::uint64_t value, unsigned int bytes)
+{
+  for (unsigned int i = 0; i < bytes; i++) {
+    out[i] = char(value >> (8 * i));
+  }
+}
+
+std::uint64_t
+get_le(const char* in, unsigned int bytes)
+{
+  std::uint64_t value = 0;
+
+  for (unsigned int i = 0; i < bytes; i++) {
+    value |= std::uint64_t(static_cast<unsigned char>(in[i])) << (8 * i);
+  }
+
+  return value;
+}
+
+std::uint64_t
+parity_offset(const parity_layout& layout,
+              std::uint64_t group_index,
+              unsigned int row)
+{
+  return parity_header_size +
+         (group_index * layout.count + row) * layout.block_size;
+}
+
+}
+
+void
+check_parity_layout(const parity_layout& layout)
+{
+  if (layout.block_size <= 0) {
+    throw std::invalid_argument("block_size should be positive");
+  }
+
+  if (layout.group < 1 || layout.count < 1) {
+    throw std::invalid_argument(
+      "parity needs 1 or more blocks per group and parity blocks");
+  }
+
+  // Reed-Solomon over GF(2^8) runs out of distinct coefficients; XOR has
+  // none to run out of.
+  if (layout.count > 1 && layout.group + layout.count > 256) {
+    throw std::invalid_argument(
+      "Reed-Solomon parity covers at most 256 blocks and parity blocks in "
+      "all");
+  }
+}
+
+void
+write_parity_header(int fd,
+                    const parity_layout& layout,
+                    std::uint64_t input_size)
+{
+  char header[parity_header_size] = {};
+
+  std::memcpy(header, parity_magic, sizeof(parity_magic));
+  put_le(header + 8, layout.block_size, 8);
+  put_le(header + 16, layout.group, 4);
+  put_le(header + 20, layout.count, 4);
+  put_le(header + 24, input_size, 8);
+
+  pwrite_full(fd, header, sizeof(header), 0);
+}
+
+parity_layout
+read_parity_header(int fd, std::uint64_t& input_size)
+{
+  char header[parity_header_size];
+
+  if (pread_full(fd, header, sizeof(header), 0) != sizeof(header) ||
+      std::memcmp(header, parity_magic, sizeof(parity_magic)) != 0) {
+    throw std::runtime_error("not a parity file");
+  }
+
+  parity_layout layout;
+  layout.block_size = get_le(header + 8, 8);
+  layout.group = get_le(header + 16, 4);
+  layout.count = get_le(header + 20, 4);
+  input_size = get_le(header + 24, 8);
+
+  check_parity_layout(layout);
+  return layout;
+}
+
+void
+gf256_mul_add(unsigned char* dst,
+              const unsigned char* src,
+              std::size_t size,
+              unsigned char c)
+{
+  static const auto mul_add = select_mul_add();
+
+  if (c == 0) {
+    return;
+  }
+
+  if (c == 1) {
+    for (std::size_t i = 0; i < size; i++) {
+      dst[i] ^= src[i];
+    }
+    return;
+  }
+
+  mul_add(dst, src, size, nibble_tables(c));
+}
+
+parity_encoder::parity_encoder(int fd, const parity_layout& layout)
+  : fd(fd)
+  , layout(layout)
+  , group_bytes(layout.group * layout.block_size)
+  , parity(new unsigned char[layout.count * layout.block_size]())
+{}
+
+void
+parity_encoder::feed(std::uint64_t offset, const char* data, std::size_t size)
+{
+  if (offset != next_offset) {
+    if (offset % group_bytes != 0) {
+      throw std::logic_error("parity needs reads aligned to groups");
+    }
+
+    discard();
+    group_index = offset / group_bytes;
+    next_offset = offset;
+  }
+
+  next_offset += size;
+
+  auto bytes = reinterpret_cast<const unsigned char*>(data);
+
+  while (size) {
+    auto col = position / layout.block_size;
+    auto in_block = position % layout.block_size;
+    auto chunk =
+      std::size_t(std::min<std::uint64_t>(size, layout.block_size - in_block));
+
+    for (unsigned int row = 0; row < layout.count; row++) {
+      gf256_mul_add(parity.get() + row * layout.block_size + in_block,
+                    bytes,
+                    chunk,
+                    parity_coefficient(layout, row, col));
+    }
+
+    bytes += chunk;
+    size -= chunk;
+    position += chunk;
+
+    if (position == group_bytes) {
+      write_group();
+    }
+  }
+}
+
+void
+parity_encoder::discard()
+{
+  if (position) {
+    std::memset(parity.get(), 0, layout.count * layout.block_size);
+    position = 0;
+  }
+
+  next_offset = std::uint64_t(-1);
+}
+
+void
+parity_encoder::finish(std::uint64_t input_size)
+{
+  if (position && next_offset == input_size) {
+    write_group();
+  }
+
+  discard();
+
+  auto groups = (input_size + group_bytes - 1) / group_bytes;
+
+  if (ftruncate(fd, parity_offset(layout, groups, 0)) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+
+  write_parity_header(fd, layout, input_size);
+}
+
+void
+parity_encoder::write_group()
+{
+  pwrite_full(fd,
+              reinterpret_cast<const char*>(parity.get()),
+              layout.count * layout.block_size,
+              parity_offset(layout, group_index, 0));
+
+  std::memset(parity.get(), 0, layout.count * layout.block_size);
+  group_index++;
+  position = 0;
+}
+
+namespace {
+
+// Inverts a square matrix over GF(2^8) in place, by Gauss-Jordan
+// elimination. Matrices made of Cauchy rows are always invertible.
+void
+gf256_invert(std::vector<std::vector<unsigned char>>& matrix)
+{
+  auto n = matrix.size();
+  std::vector<std::vector<unsigned char>> inverse(
+    n, std::vector<unsigned char>(n));
+
+  for (std::size_t i = 0; i < n; i++) {
+    inverse[i][i] = 1;
+  }
+
+  for (std::size_t col = 0; col < n; col++) {
+    auto pivot = col;
+    while (pivot < n && matrix[pivot][col] == 0) {
+      pivot++;
+    }
+
+    if (pivot == n) {
+      throw std::logic_error("singular parity matrix");
+    }
+
+    std::swap(matrix[pivot], matrix[col]);
+    std::swap(inverse[pivot], inverse[col]);
+
+    auto scale = gf256_inverse(matrix[col][col]);
+    for (std::size_t k = 0; k < n; k++) {
+      matrix[col][k] = gf256_mul(matrix[col][k], scale);
+      inverse[col][k] = gf256_mul(inverse[col][k], scale);
+    }
+
+    for (std::size_t row = 0; row < n; row++) {
+      auto factor = matrix[row][col];
+      if (row == col || factor == 0) {
+        continue;
+      }
+
+      for (std::size_t k = 0; k < n; k++) {
+        matrix[row][k] ^= gf256_mul(factor, matrix[col][k]);
+        inverse[row][k] ^= gf256_mul(factor, inverse[col][k]);
+      }
+    }
+  }
+
+  matrix = std::move(inverse);
+}
+
+std::uint32_t
+block_checksum(const unsigned char* data, std::size_t size)
+{
+  boost::crc_32_type csum;
+  csum.process_bytes(data, size);
+  return csum.checksum();
+}
+
+}
+
+rebuild_result
+rebuild_from_parity(int fd_input,
+                    int fd_signature,
+                    int fd_parity,
+                    unsigned int concurrency)
+{
+  std::uint64_t input_size;
+  auto layout = read_parity_header(fd_parity, input_size);
+
+  if (fd_size(fd_input) != input_size) {
+    throw std::runtime_error("the parity was computed for an input of " +
+                             std::to_string(input_size) + " bytes");
+  }
+
+  signature_options options;
+  options.block_size = layout.block_size;
+  options.concurrency = concurrency;
+
+  auto verified = verify_signature(fd_input, fd_signature, options, {});
+
+  // Corrupted blocks of each group.
+  std::map<std::uint64_t, std::vector<std::uint64_t>> groups;
+  for (auto block : verified.bad_blocks) {
+    groups[block / layout.group].push_back(block);
+  }
+
+  rebuild_result result;
+  auto block_size = std::size_t(layout.block_size);
+  std::vector<unsigned char> data(block_size);
+  std::vector<std::vector<unsigned char>> syndromes;
+
+  for (auto& [group_index, erased] : groups) {
+    if (erased.size() > layout.count) {
+      result.unrecoverable.insert(
+        result.unrecoverable.end(), erased.begin(), erased.end());
+      continue;
+    }
+
+    auto first = group_index * layout.group;
+    auto last = std::min<std::uint64_t>(
+      first + layout.group, (input_size + block_size - 1) / block_size);
+    auto n = erased.size();
+
+    // The first n parity blocks, with the intact data blocks taken out,
+    // leave n equations in the erased blocks.
+    syndromes.assign(n, std::vector<unsigned char>(block_size));
+
+    for (unsigned int row = 0; row < n; row++) {
+      pread_full(fd_parity,
+                 reinterpret_cast<char*>(syndromes[row].data()),
+                 block_size,
+                 parity_offset(layout, group_index, row));
+    }
+
+    for (auto block = first; block < last; block++) {
+      if (std::find(erased.begin(), erased.end(), block) != erased.end()) {
+        continue;
+      }
+
+      std::fill(data.begin(), data.end(), 0);
+      pread_full(fd_input,
+                 reinterpret_cast<char*>(data.data()),
+                 block_size,
+                 block * block_size);
+
+      for (unsigned int row = 0; row < n; row++) {
+        gf256_mul_add(syndromes[row].data(),
+                      data.data(),
+                      block_size,
+                      parity_coefficient(layout, row, block - first));
+      }
+    }
+
+    std::vector<std::vector<unsigned char>> matrix(
+      n, std::vector<unsigned char>(n));
+
+    for (unsigned int row = 0; row < n; row++) {
+      for (unsigned int t = 0; t < n; t++) {
+        matrix[row][t] = parity_coefficient(layout, row, erased[t] - first);
+      }
+    }
+
+    gf256_invert(matrix);
+
+    for (unsigned int t = 0; t < n; t++) {
+      auto block = erased[t];
+      auto length = std::size_t(
+        std::min<std::uint64_t>(block_size, input_size - block * block_size));
+
+      std::fill(data.begin(), data.end(), 0);
+      for (unsigned int row = 0; row < n; row++) {
+        gf256_mul_add(
+          data.data(), syndromes[row].data(), block_size, matrix[t][row]);
+      }
+
+      std::uint32_t expected;
+      if (pread_full(fd_signature,
+                     reinterpret_cast<char*>(&expected),
+                     sizeof(expected),
+                     block * sizeof(expected)) != sizeof(expected) ||
+          block_checksum(data.data(), length) != expected) {
+        // The parity is damaged as well.
+        result.unrecoverable.push_back(block);
+        continue;
+      }
+
+      pwrite_full(fd_input,
+                  reinterpret_cast<const char*>(data.data()),
+                  length,
+                  block * block_size);
+      result.rebuilt.push_back(block);
+    }
+  }
+
+  std::sort(result.unrecoverable.begin(), result.unrecoverable.end());
+  return result;
+}
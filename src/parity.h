@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "io_source.h"
+
+// Erasure-coding parity over groups of blocks: `count` parity blocks for
+// every `group` blocks of input, so that up to `count` corrupted blocks of a
+// group can be rebuilt. One parity block is the XOR of the group; more are
+// Reed-Solomon over GF(2^8), with a Cauchy matrix.
+struct parity_layout
+{
+  std::uint64_t block_size;
+  unsigned int group;
+  unsigned int count;
+};
+
+// Throws std::invalid_argument unless 1 <= group, 1 <= count and
+// group + count <= 256.
+void
+check_parity_layout(const parity_layout& layout);
+
+// The parity file starts with a header holding the layout and the input
+// size, followed by the parity blocks of each group in turn. The parity of
+// the last, short group is computed as if it was padded with zeros.
+const std::size_t parity_header_size = 64;
+
+void
+write_parity_header(int fd,
+                    const parity_layout& layout,
+                    std::uint64_t input_size);
+
+parity_layout
+read_parity_header(int fd, std::uint64_t& input_size);
+
+// dst ^= c * src, byte by byte in GF(2^8).
+void
+gf256_mul_add(unsigned char* dst,
+              const unsigned char* src,
+              std::size_t size,
+              unsigned char c);
+
+// Accumulates the parity of consecutive input, group by group, and writes
+// out every group as soon as it is complete.
+class parity_encoder
+{
+public:
+  parity_encoder(int fd, const parity_layout& layout);
+
+  // Data has to start at a group boundary unless it continues the previous
+  // call.
+  void feed(std::uint64_t offset, const char* data, std::size_t size);
+
+  // Forgets an incomplete group.
+  void discard();
+
+  // The input ends here: writes the last group and the header.
+  void finish(std::uint64_t input_size);
+
+private:
+  void write_group();
+
+  const int fd;
+  const parity_layout layout;
+  const std::uint64_t group_bytes;
+
+  std::unique_ptr<unsigned char[]> parity;
+  std::uint64_t group_index = 0;
+  std::uint64_t position = 0;
+  std::uint64_t next_offset = 0;
+};
+
+// Passes through another source, computing parity from everything read.
+// Reads have to be aligned to groups, except where they continue the
+// previous read of the same reader.
+template<typename Source>
+class parity_source
+{
+public:
+  static constexpr bool seekable = Source::seekable;
+
+  parity_source(std::shared_ptr<Source> source,
+                int fd_parity,
+                const parity_layout& layout);
+
+  class reader
+  {
+  public:
+    reader(const parity_source& source, typename Source::reader inner);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    const parity_source& source;
+    typename Source::reader inner;
+    parity_encoder encoder;
+  };
+
+  unsigned_off_t size() const { return input_size; }
+  reader make_reader() const { return reader(*this, source->make_reader()); }
+
+private:
+  std::shared_ptr<Source> source;
+  owned_fd fd_parity;
+  const parity_layout layout;
+  unsigned_off_t input_size = 0;
+};
+
+struct rebuild_result
+{
+  std::vector<std::uint64_t> rebuilt;
+  std::vector<std::uint64_t> unrecoverable;
+};
+
+// Finds the blocks of the input that don't match the signature and rewrites
+// them from the parity, where the group has enough parity left. Rebuilt
+// blocks are checked against the signature before being written.
+rebuild_result
+rebuild_from_parity(int fd_input,
+                    int fd_signature,
+                    int fd_parity,
+                    unsigned int concurrency);
+
+template<typename Source>
+parity_source<Source>::parity_source(std::shared_ptr<Source> source,
+                                     int fd_parity,
+                                     const parity_layout& layout)
+  : source(std::move(source))
+  , fd_parity(dup(fd_parity), "dup")
+  , layout(layout)
+{
+  check_parity_layout(layout);
+
+  // Laid out up front, so that workers only ever fill it in.
+  if constexpr (Source::seekable) {
+    input_size = this->source->size();
+    parity_encoder(this->fd_parity, layout).finish(input_size);
+  }
+}
+
+template<typename Source>
+parity_source<Source>::reader::reader(const parity_source& source,
+                                      typename Source::reader inner)
+  : source(source)
+  , inner(std::move(inner))
+  , encoder(source.fd_parity, source.layout)
+{}
+
+template<typename Source>
+template<typename Consumer>
+std::size_t
+parity_source<Source>::reader::read(unsigned_off_t offset,
+                                    std::size_t size,
+                                    Consumer&& consume)
+{
+  auto position = offset;
+  bool abandoned = false;
+
+  auto delivered =
+    inner.read(offset, size, [&](const char* data, std::size_t count) {
+      if (!consume(data, count)) {
+        abandoned = true;
+        return false;
+      }
+
+      encoder.feed(position, data, count);
+      position += count;
+      return true;
+    });
+
+  if (abandoned) {
+    encoder.discard();
+  } else if (delivered < size ||
+             (seekable && offset + delivered == source.input_size)) {
+    encoder.finish(offset + delivered);
+  }
+
+  return delivered;
+}
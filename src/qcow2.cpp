@@ -0,0 +1,246 @@
+#include "qcow2.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+const std::uint32_t qcow2_magic = 0x514649fb; // "QFI\xfb"
+
+// Incompatible features that don't change how the tables are read: dirty
+// (only the refcounts may be stale) and the compression type (compressed
+// clusters are refused anyway).
+const std::uint64_t qcow2_incompat_dirty = 1 << 0;
+const std::uint64_t qcow2_incompat_corrupt = 1 << 1;
+const std::uint64_t qcow2_incompat_compression = 1 << 3;
+
+const std::uint64_t qcow2_offset_mask = 0x00fffffffffffe00;
+const std::uint64_t qcow2_compressed = std::uint64_t(1) << 62;
+const std::uint64_t qcow2_zero = 1;
+
+std::uint64_t
+get_be(const unsigned char* data, unsigned int bytes)
+{
+  std::uint64_t value = 0;
+
+  for (unsigned int i = 0; i < bytes; i++) {
+    value = value << 8 | data[i];
+  }
+
+  return value;
+}
+
+std::vector<std::uint64_t>
+read_table(int fd, std::uint64_t offset, std::size_t entries)
+{
+  std::vector<unsigned char> raw(entries * 8);
+
+  auto data = reinterpret_cast<char*>(raw.data());
+
+  if (pread_full(fd, data, raw.size(), offset) != raw.size()) {
+    throw std::runtime_error("qcow2 table past the end of the image");
+  }
+
+  std::vector<std::uint64_t> table(entries);
+
+  for (std::size_t i = 0; i < entries; i++) {
+    table[i] = get_be(raw.data() + i * 8, 8);
+  }
+
+  return table;
+}
+
+}
+
+qcow2_source::qcow2_source(int fd)
+  : fd(dup(fd), "dup")
+{
+  unsigned char header[104];
+
+  if (pread_full(this->fd, reinterpret_cast<char*>(header), 72, 0) != 72 ||
+      get_be(header, 4) != qcow2_magic) {
+    throw std::runtime_error("the input isn't a qcow2 image");
+  }
+
+  version = get_be(header + 4, 4);
+  cluster_bits = get_be(header + 20, 4);
+  virtual_size = get_be(header + 24, 8);
+
+  auto l1_size = get_be(header + 36, 4);
+  auto l1_offset = get_be(header + 40, 8);
+
+  if (version < 2 || version > 3) {
+    throw std::runtime_error("unsupported qcow2 version " +
+                             std::to_string(version));
+  }
+
+  if (version == 3) {
+    if (pread_full(this->fd, reinterpret_cast<char*>(header), 104, 0) != 104) {
+      throw std::runtime_error("truncated qcow2 header");
+    }
+
+    auto incompat = get_be(header + 72, 8);
+
+    if (incompat & qcow2_incompat_corrupt) {
+      throw std::runtime_error("the qcow2 image is marked corrupt");
+    }
+
+    if (incompat & ~(qcow2_incompat_dirty | qcow2_incompat_compression)) {
+      throw std::runtime_error("unsupported qcow2 features");
+    }
+  }
+
+  if (get_be(header + 8, 8) != 0) {
+    throw std::runtime_error("qcow2 images with a backing file aren't "
+                             "supported");
+  }
+
+  if (get_be(header + 32, 4) != 0) {
+    throw std::runtime_error("encrypted qcow2 images aren't supported");
+  }
+
+  if (cluster_bits < 9 || cluster_bits > 21) {
+    throw std::runtime_error("corrupted qcow2 header");
+  }
+
+  auto cluster_size = std::uint64_t(1) << cluster_bits;
+  auto l2_entries = cluster_size / 8;
+  auto clusters = (virtual_size + cluster_size - 1) >> cluster_bits;
+
+  if (l1_size < (clusters + l2_entries - 1) / l2_entries ||
+      l1_offset % cluster_size != 0) {
+    throw std::runtime_error("corrupted qcow2 header");
+  }
+
+  l1 = read_table(this->fd, l1_offset, l1_size);
+
+  allocation_map::extent_list extents;
+
+  for (std::uint64_t i = 0; i * l2_entries < clusters; i++) {
+    if ((l1[i] & qcow2_offset_mask) == 0) {
+      continue;
+    }
+
+    auto l2 = read_l2(i);
+
+    for (std::uint64_t j = 0; j < l2_entries; j++) {
+      if (cluster_offset(l2[j]) == 0) {
+        continue;
+      }
+
+      auto begin = (i * l2_entries + j) << cluster_bits;
+
+      if (!extents.empty() && extents.back().second == begin) {
+        extents.back().second += cluster_size;
+      } else {
+        extents.emplace_back(begin, begin + cluster_size);
+      }
+    }
+  }
+
+  data = std::make_shared<allocation_map>(
+    "qcow2", virtual_size, std::move(extents));
+}
+
+std::vector<std::uint64_t>
+qcow2_source::read_l2(std::uint64_t index) const
+{
+  auto offset = l1[index] & qcow2_offset_mask;
+
+  if (offset % (std::uint64_t(1) << cluster_bits) != 0) {
+    throw std::runtime_error("corrupted qcow2 L1 table");
+  }
+
+  return read_table(fd, offset, (std::size_t(1) << cluster_bits) / 8);
+}
+
+// Where the data of the cluster with this L2 entry is in the image, or zero
+// if it reads as zeros.
+std::uint64_t
+qcow2_source::cluster_offset(std::uint64_t entry) const
+{
+  if (entry & qcow2_compressed) {
+    throw std::runtime_error("compressed qcow2 clusters aren't supported");
+  }
+
+  if (version >= 3 && (entry & qcow2_zero)) {
+    return 0;
+  }
+
+  auto offset = entry & qcow2_offset_mask;
+
+  if (offset % (std::uint64_t(1) << cluster_bits) != 0) {
+    throw std::runtime_error("corrupted qcow2 L2 table");
+  }
+
+  return offset;
+}
+
+qcow2_source::reader::reader(const qcow2_source& source)
+  : source(source)
+  , buffer(new char[buffer_size])
+{}
+
+std::uint64_t
+qcow2_source::reader::host_cluster(std::uint64_t cluster)
+{
+  auto l2_bits = source.cluster_bits - 3;
+  auto index = cluster >> l2_bits;
+
+  if ((source.l1[index] & qcow2_offset_mask) == 0) {
+    return 0;
+  }
+
+  if (index != l2_index) {
+    l2 = source.read_l2(index);
+    l2_index = index;
+  }
+
+  return source.cluster_offset(l2[cluster & ((1 << l2_bits) - 1)]);
+}
+
+void
+qcow2_source::reader::fill(unsigned_off_t offset, std::size_t size)
+{
+  auto cluster_size = std::size_t(1) << source.cluster_bits;
+  std::size_t position = 0;
+
+  segments.clear();
+
+  while (position < size) {
+    auto in_cluster = (offset + position) & (cluster_size - 1);
+    auto length = std::min(cluster_size - in_cluster, size - position);
+    auto host = host_cluster((offset + position) >> source.cluster_bits);
+
+    if (host == 0) {
+      std::memset(buffer.get() + position, 0, length);
+    } else if (!segments.empty() &&
+               segments.back().host_offset + segments.back().length ==
+                 host + in_cluster &&
+               segments.back().position + segments.back().length ==
+                 position) {
+      segments.back().length += length;
+    } else {
+      segments.push_back({ host + in_cluster, position, length });
+    }
+
+    position += length;
+  }
+
+  std::sort(segments.begin(),
+            segments.end(),
+            [](const segment& a, const segment& b) {
+              return a.host_offset < b.host_offset;
+            });
+
+  for (auto& piece : segments) {
+    if (pread_full(source.fd,
+                   buffer.get() + piece.position,
+                   piece.length,
+                   piece.host_offset) != piece.length) {
+      throw std::runtime_error("qcow2 cluster past the end of the image");
+    }
+  }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "allocation.h"
+#include "io_source.h"
+
+// The virtual disk in a qcow2 image, read as the guest sees it. Clusters are
+// looked up in the L1 and L2 tables; unallocated and zero clusters read as
+// zeros, and allocation() tells which parts hold data, so that blocks
+// without any aren't read at all. Images with a backing file, encryption,
+// an external data file, extended L2 entries or compressed clusters are
+// refused.
+class qcow2_source
+{
+public:
+  static constexpr bool seekable = true;
+
+  // Also reads all the L2 tables, to map the data.
+  explicit qcow2_source(int fd);
+
+  class reader
+  {
+  public:
+    explicit reader(const qcow2_source& source);
+
+    template<typename Consumer>
+    std::size_t read(unsigned_off_t offset,
+                     std::size_t size,
+                     Consumer&& consume);
+
+  private:
+    // A run of clusters both consecutive in the image and in the buffer.
+    struct segment
+    {
+      std::uint64_t host_offset;
+      std::size_t position;
+      std::size_t length;
+    };
+
+    void fill(unsigned_off_t offset, std::size_t size);
+    std::uint64_t host_cluster(std::uint64_t cluster);
+
+    const qcow2_source& source;
+    std::unique_ptr<char[]> buffer;
+    std::vector<segment> segments;
+
+    // The L2 table last looked up, decoded.
+    std::uint64_t l2_index = ~std::uint64_t(0);
+    std::vector<std::uint64_t> l2;
+  };
+
+  unsigned_off_t size() const { return virtual_size; }
+  reader make_reader() const { return reader(*this); }
+
+  std::shared_ptr<const allocation_map> allocation() const { return data; }
+
+private:
+  std::vector<std::uint64_t> read_l2(std::uint64_t index) const;
+  std::uint64_t cluster_offset(std::uint64_t entry) const;
+
+  owned_fd fd;
+  unsigned int version;
+  unsigned int cluster_bits;
+  unsigned_off_t virtual_size;
+  std::vector<std::uint64_t> l1;
+  std::shared_ptr<const allocation_map> data;
+};
+
+// Reads in host order within each piece handed out, coalescing clusters
+// that are contiguous in the image, and hands the pieces out in guest order.
+template<typename Consumer>
+std::size_t
+qcow2_source::reader::read(unsigned_off_t offset,
+                           std::size_t size,
+                           Consumer&& consume)
+{
+  if (offset >= source.virtual_size) {
+    return 0;
+  }
+
+  if (size > source.virtual_size - offset) {
+    size = std::size_t(source.virtual_size - offset);
+  }
+
+  std::size_t delivered = 0;
+
+  while (delivered < size) {
+    auto count = std::min(size - delivered, buffer_size);
+
+    fill(offset + delivered, count);
+    delivered += count;
+
+    if (!consume(static_cast<const char*>(buffer.get()), count)) {
+      break;
+    }
+  }
+
+  return delivered;
+}
@@ -0,0 +1,236 @@
+#include "repair.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+
+#include "io_source.h"
+
+namespace {
+
+int
+anonymous_file(const char* name)
+{
+  return memfd_create(name, MFD_CLOEXEC);
+}
+
+std::uint32_t
+block_checksum(const char* data, std::size_t size)
+{
+  boost::crc_32_type csum;
+  csum.process_bytes(data, size);
+  return csum.checksum();
+}
+
+std::vector<block_range>
+coalesce(const std::vector<std::uint64_t>& blocks)
+{
+  std::vector<block_range> ranges;
+
+  for (auto block : blocks) {
+    if (!ranges.empty() &&
+        ranges.back().first + ranges.back().count == block) {
+      ranges.back().count++;
+    } else {
+      ranges.push_back({ block, 1 });
+    }
+  }
+
+  return ranges;
+}
+
+// Walks the blocks of a range a buffer at a time, handing each read to
+// process(first_block, data, size).
+template<typename Process>
+void
+for_each_chunk(int fd,
+               const block_range& range,
+               std::size_t block_size,
+               std::uint64_t input_size,
+               std::vector<char>& buffer,
+               Process&& process)
+{
+  auto chunk_blocks = buffer.size() / block_size;
+
+  for (auto block = range.first; block < range.first + range.count;
+       block += chunk_blocks) {
+    auto blocks =
+      std::min<std::uint64_t>(chunk_blocks, range.first + range.count - block);
+    auto offset = block * block_size;
+    auto size = std::size_t(
+      std::min<std::uint64_t>(blocks * block_size, input_size - offset));
+
+    pread_full(fd, buffer.data(), size, offset);
+    process(block, buffer.data(), size);
+  }
+}
+
+}
+
+repair_result
+repair_from_replica(int fd_target,
+                    int fd_good,
+                    int fd_signature,
+                    const signature_options& options)
+{
+  auto block_size = options.block_size;
+
+  if (block_size <= 0) {
+    throw std::invalid_argument("block_size should be positive");
+  }
+
+  auto good_size = fd_size(fd_good);
+
+  if (fd_size(fd_target) != good_size &&
+      ftruncate(fd_target, good_size) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+
+  std::unique_ptr<owned_fd> good_signature;
+  std::vector<block_range> bad;
+
+  if (fd_signature != -1) {
+    auto verified = verify_signature(fd_target, fd_signature, options, {});
+    bad = coalesce(verified.bad_blocks);
+  } else {
+    owned_fd target_signature(anonymous_file("target"), "memfd_create");
+    good_signature =
+      std::make_unique<owned_fd>(anonymous_file("good"), "memfd_create");
+
+    std::exception_ptr good_error;
+    std::thread good_thread([&]() {
+      try {
+        generate_signature(fd_good, *good_signature, options);
+      } catch (...) {
+        good_error = std::current_exception();
+      }
+    });
+
+    try {
+      generate_signature(fd_target, target_signature, options);
+    } catch (...) {
+      good_thread.join();
+      throw;
+    }
+
+    good_thread.join();
+    if (good_error) {
+      std::rethrow_exception(good_error);
+    }
+
+    auto diff = diff_signatures(
+      target_signature, *good_signature, options.concurrency);
+
+    bad = diff.changed;
+    fd_signature = *good_signature;
+  }
+
+  auto expected_checksum = [&](std::uint64_t block) {
+    std::uint32_t checksum;
+    pread_full(fd_signature,
+               reinterpret_cast<char*>(&checksum),
+               sizeof(checksum),
+               block * sizeof(checksum));
+    return checksum;
+  };
+
+  // Adjacent bad blocks are copied with as few, as large writes as the
+  // buffer allows.
+  std::vector<char> buffer(
+    std::max(block_size, buffer_size / block_size * block_size));
+  repair_result result;
+
+  for (auto& range : bad) {
+    for_each_chunk(
+      fd_good,
+      range,
+      block_size,
+      good_size,
+      buffer,
+      [&](std::uint64_t first, const char* data, std::size_t size) {
+        std::size_t run_start = 0;
+        std::size_t position = 0;
+
+        auto write_run = [&](std::size_t end) {
+          if (end > run_start) {
+            pwrite_full(fd_target,
+                        data + run_start,
+                        end - run_start,
+                        first * block_size + run_start);
+            result.bytes_written += end - run_start;
+
+            auto block = first + run_start / block_size;
+            auto count = (end - run_start + block_size - 1) / block_size;
+            auto& repaired = result.repaired;
+
+            if (!repaired.empty() &&
+                repaired.back().first + repaired.back().count == block) {
+              repaired.back().count += count;
+            } else {
+              repaired.push_back({ block, count });
+            }
+          }
+        };
+
+        for (auto block = first; position < size; block++) {
+          auto length = std::min(block_size, size - position);
+
+          if (block_checksum(data + position, length) !=
+              expected_checksum(block)) {
+            write_run(position);
+            result.unrecoverable.push_back(block);
+            run_start = position + length;
+          }
+
+          position += length;
+        }
+
+        write_run(size);
+      });
+  }
+
+  if (result.repaired.empty()) {
+    return result;
+  }
+
+  // Read back what is on the device, not what is in the page cache.
+  if (fdatasync(fd_target) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fdatasync");
+  }
+
+  posix_fadvise(fd_target, 0, 0, POSIX_FADV_DONTNEED);
+
+  for (auto& range : result.repaired) {
+    for_each_chunk(
+      fd_target,
+      range,
+      block_size,
+      good_size,
+      buffer,
+      [&](std::uint64_t first, const char* data, std::size_t size) {
+        std::size_t position = 0;
+
+        for (auto block = first; position < size; block++) {
+          auto length = std::min(block_size, size - position);
+
+          if (block_checksum(data + position, length) !=
+              expected_checksum(block)) {
+            result.failed.push_back(block);
+          }
+
+          position += length;
+        }
+      });
+  }
+
+  return result;
+}
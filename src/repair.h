@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "diff.h"
+#include "signature.h"
+
+struct repair_result
+{
+  // Ranges of blocks rewritten from the good source.
+  std::vector<block_range> repaired;
+
+  // Blocks the good source doesn't have right either, left alone.
+  std::vector<std::uint64_t> unrecoverable;
+
+  // Repaired blocks that still didn't match when read back.
+  std::vector<std::uint64_t> failed;
+
+  std::uint64_t bytes_written = 0;
+};
+
+// Rewrites the blocks of the target that differ from a good copy, resizing
+// the target to match it. If fd_signature is -1, bad blocks are found by
+// signing both copies in parallel and comparing the signatures; otherwise
+// the target is checked against the signature, and the blocks copied from
+// the good source are too. Repaired blocks are read back from the device
+// and checked again afterwards. Uses block_size, concurrency and io of the
+// options.
+repair_result
+repair_from_replica(int fd_target,
+                    int fd_good,
+                    int fd_signature,
+                    const signature_options& options);
@@ -0,0 +1,280 @@
+#include "sigcache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_source.h"
+
+namespace {
+
+const char cache_magic[8] = { 'C', 'R', 'C', 'C', 'A', 'C', 'H', 1 };
+
+// What the cached checksums were computed from: any change starts the
+// cache over.
+struct cache_header
+{
+  char magic[8];
+  std::uint64_t block_size;
+  std::uint64_t input_size;
+  std::int64_t mtime_sec;
+  std::int64_t mtime_nsec;
+  std::uint64_t inode;
+  std::uint64_t device;
+  std::uint64_t reserved;
+};
+
+static_assert(sizeof(cache_header) == 64, "cache header layout");
+
+cache_header
+describe_input(int fd, std::size_t block_size)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fstat");
+  }
+
+  cache_header header{};
+  std::memcpy(header.magic, cache_magic, sizeof(header.magic));
+  header.block_size = block_size;
+  header.input_size = st.st_size;
+  header.mtime_sec = st.st_mtim.tv_sec;
+  header.mtime_nsec = st.st_mtim.tv_nsec;
+  header.inode = st.st_ino;
+  header.device = st.st_dev;
+
+  return header;
+}
+
+void
+sync_mapping(void* mapping, std::size_t size)
+{
+  if (msync(mapping, size, MS_SYNC) != 0) {
+    throw std::system_error(errno, std::generic_category(), "msync");
+  }
+}
+
+}
+
+signature_cache::signature_cache(int fd_in,
+                                 const std::string& path,
+                                 const signature_options& options)
+  : fd_in(fd_in)
+  , block_size(options.block_size)
+  , options(options)
+{
+  if (block_size <= 0) {
+    throw std::invalid_argument("block_size should be positive");
+  }
+
+  if (options.concurrency <= 0) {
+    throw std::invalid_argument("concurrency should be positive");
+  }
+
+  if (!is_seekable(fd_in)) {
+    throw std::invalid_argument("cached inputs should be seekable");
+  }
+
+  auto header = describe_input(fd_in, block_size);
+  static_assert(sizeof(header) == sizeof(identity), "cache identity size");
+  std::memcpy(identity, &header, sizeof(identity));
+
+  input_size = header.input_size;
+  num_blocks = (input_size + block_size - 1) / block_size;
+
+  auto words = (num_blocks + 63) / 64;
+  mapping_size = sizeof(cache_header) + words * sizeof(std::uint64_t) +
+                 num_blocks * sizeof(std::uint32_t);
+
+  fd_cache = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_cache == -1) {
+    throw std::system_error(errno, std::generic_category(), "open");
+  }
+
+  try {
+    file_lock lock(fd_cache);
+
+    claim_layout();
+
+    mapping = mmap(
+      nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_cache, 0);
+    if (mapping == MAP_FAILED) {
+      mapping = nullptr;
+      throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+  } catch (...) {
+    close(fd_cache);
+    throw;
+  }
+
+  bitmap = reinterpret_cast<std::uint64_t*>(static_cast<char*>(mapping) +
+                                            sizeof(cache_header));
+  checksums = reinterpret_cast<std::uint32_t*>(bitmap + words);
+}
+
+signature_cache::~signature_cache()
+{
+  if (mapping) {
+    munmap(mapping, mapping_size);
+  }
+
+  close(fd_cache);
+}
+
+// Whether the file is still laid out for this input and block size. Only
+// valid with the lock held: another process may lay it out for its own at
+// any time otherwise.
+bool
+signature_cache::laid_out() const
+{
+  cache_header saved{};
+
+  return fd_size(fd_cache) == mapping_size &&
+         pread_full(fd_cache,
+                    reinterpret_cast<char*>(&saved),
+                    sizeof(saved),
+                    0) == sizeof(saved) &&
+         std::memcmp(&saved, identity, sizeof(identity)) == 0;
+}
+
+// Lays the file out for this input and block size, all invalid, unless it
+// already is. Needs the lock.
+void
+signature_cache::claim_layout()
+{
+  if (laid_out()) {
+    return;
+  }
+
+  // Stale, new, or taken over: drop everything, then lay it out again.
+  if (ftruncate(fd_cache, 0) != 0 || ftruncate(fd_cache, mapping_size) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+
+  pwrite_full(fd_cache, identity, sizeof(identity), 0);
+}
+
+bool
+signature_cache::is_valid(std::uint64_t block) const
+{
+  return bitmap[block / 64] & (std::uint64_t(1) << (block % 64));
+}
+
+std::uint64_t
+signature_cache::valid_blocks() const
+{
+  file_lock lock(fd_cache);
+
+  if (!laid_out()) {
+    return 0;
+  }
+
+  std::uint64_t count = 0;
+
+  for (std::uint64_t i = 0; i < (num_blocks + 63) / 64; i++) {
+    count += __builtin_popcountll(bitmap[i]);
+  }
+
+  return count;
+}
+
+std::vector<std::uint32_t>
+signature_cache::lookup(const std::vector<std::uint64_t>& blocks)
+{
+  for (auto block : blocks) {
+    if (block >= num_blocks) {
+      throw std::out_of_range("block " + std::to_string(block) +
+                              " is past the end of the input");
+    }
+  }
+
+  file_lock lock(fd_cache);
+
+  claim_layout();
+
+  std::vector<std::uint64_t> missing;
+
+  for (auto block : blocks) {
+    if (!is_valid(block)) {
+      missing.push_back(block);
+    }
+  }
+
+  std::sort(missing.begin(), missing.end());
+  missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+  computed = 0;
+  compute(missing);
+
+  std::vector<std::uint32_t> result;
+  result.reserve(blocks.size());
+
+  for (auto block : blocks) {
+    result.push_back(checksums[block]);
+  }
+
+  return result;
+}
+
+// Signs the missing blocks as generate_signature() signs a whole input, in
+// runs of consecutive blocks. The checksums are synced to the file before
+// the bitmap marks them valid, so that a crash can only lose work.
+void
+signature_cache::compute(const std::vector<std::uint64_t>& missing)
+{
+  if (missing.empty()) {
+    return;
+  }
+
+  std::vector<block_range> runs;
+
+  for (auto block : missing) {
+    if (!runs.empty() && runs.back().first + runs.back().count == block) {
+      runs.back().count++;
+    } else {
+      runs.push_back({ block, 1 });
+    }
+  }
+
+  owned_fd signed_runs(memfd_create("signature-cache", MFD_CLOEXEC),
+                       "memfd_create");
+  generate_signature(fd_in, runs, signed_runs, options);
+
+  std::vector<std::uint32_t> fresh(missing.size());
+  auto fresh_size = fresh.size() * sizeof(std::uint32_t);
+
+  if (pread_full(signed_runs,
+                 reinterpret_cast<char*>(fresh.data()),
+                 fresh_size,
+                 0) != fresh_size) {
+    throw std::runtime_error("input shrank while reading it");
+  }
+
+  for (std::size_t i = 0; i < missing.size(); i++) {
+    checksums[missing[i]] = fresh[i];
+  }
+
+  // Whatever changed the input while we read it also made the cache stale.
+  auto header = static_cast<const cache_header*>(mapping);
+  auto now = describe_input(fd_in, block_size);
+
+  if (std::memcmp(header, &now, sizeof(now)) != 0) {
+    throw std::runtime_error("input changed while reading it");
+  }
+
+  sync_mapping(mapping, mapping_size);
+
+  for (auto block : missing) {
+    bitmap[block / 64] |= std::uint64_t(1) << (block % 64);
+  }
+
+  sync_mapping(mapping, mapping_size);
+  computed = missing.size();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "signature.h"
+
+// A signature filled in lazily: a sidecar file holding a checksum slot for
+// every block of the input, and a bitmap of the slots that are valid. Blocks
+// are only read when first asked for, and the cache starts over whenever
+// the input's size, modification time or inode changes, or the block size
+// does.
+class signature_cache
+{
+public:
+  // Opens or creates the cache at `path` for the input in fd_in, which has
+  // to be seekable. Missing blocks are signed with these options, as the
+  // whole input would be; only raw inputs are supported.
+  signature_cache(int fd_in,
+                  const std::string& path,
+                  const signature_options& options);
+  ~signature_cache();
+
+  signature_cache(const signature_cache&) = delete;
+  signature_cache& operator=(const signature_cache&) = delete;
+
+  std::uint64_t blocks() const { return num_blocks; }
+  std::uint64_t valid_blocks() const;
+
+  // Checksums of the given blocks, in the same order. Blocks not cached yet
+  // are read in parallel, in runs of consecutive blocks, and saved before
+  // returning. Throws std::out_of_range for blocks past the end. The cache
+  // stays locked throughout, as another process may lay it out again for
+  // another block size at any time it isn't.
+  std::vector<std::uint32_t> lookup(const std::vector<std::uint64_t>& blocks);
+
+  // How many blocks the last lookup() had to read.
+  std::uint64_t last_computed() const { return computed; }
+
+private:
+  bool laid_out() const;
+  void claim_layout();
+  bool is_valid(std::uint64_t block) const;
+  void compute(const std::vector<std::uint64_t>& missing);
+
+  const int fd_in;
+  const std::size_t block_size;
+  const signature_options options;
+
+  // The header the cache has when laid out for this input; see
+  // sigcache.cpp.
+  char identity[64];
+
+  int fd_cache;
+  void* mapping = nullptr;
+  std::size_t mapping_size = 0;
+  std::uint64_t num_blocks = 0;
+  std::uint64_t input_size = 0;
+
+  std::uint64_t* bitmap = nullptr;
+  std::uint32_t* checksums = nullptr;
+  std::uint64_t computed = 0;
+};
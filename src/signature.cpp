@@ -1,9 +1,17 @@
 #include "signature.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
-#include <future>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <system_error>
 #include <thread>
@@ -14,19 +22,90 @@
 #include <unistd.h>
 
 #include <boost/crc.hpp>
+#include <boost/math/distributions/normal.hpp>
+
+#include "allocation.h"
+#include "crc_combine.h"
+#include "heatmap.h"
+#include "io_source.h"
+#include "metrics.h"
+#include "pack.h"
+#include "parity.h"
+#include "qcow2.h"
+#include "simulated_device.h"
+#include "topology.h"
+#include "uring.h"
 
 namespace {
 
-const std::size_t buffer_size = 1 << 20;
+// Inputs that fit into a single read are signed on the calling thread: for
+// them, spawning workers costs more than the hashing itself.
+const std::size_t inline_threshold = buffer_size;
 
 typedef boost::crc_32_type checksum_algo;
 typedef checksum_algo::value_type checksum_type;
 const std::size_t checksum_size = sizeof(checksum_type);
 
+typedef std::chrono::steady_clock clock_type;
+
+std::int64_t
+now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           clock_type::now().time_since_epoch())
+    .count();
+}
+
+// Entropy is estimated from every this many bytes of a block.
+const std::size_t entropy_stride = 4;
+
+typedef float entropy_type;
+const std::size_t entropy_size = sizeof(entropy_type);
+
+const std::size_t recipe_entry_size = sizeof(pack_location);
+
+// CRC-32 of `length` zero bytes, built up from that of a page by combining.
+checksum_type
+zeros_checksum(std::uint64_t length)
+{
+  static const char zeros[4096] = {};
+
+  checksum_algo csum;
+  csum.process_bytes(zeros, length % sizeof(zeros));
+
+  checksum_algo page;
+  page.process_bytes(zeros, sizeof(zeros));
+
+  auto crc = csum.checksum();
+  auto power = page.checksum();
+  std::uint64_t power_length = sizeof(zeros);
+
+  for (auto pages = length / sizeof(zeros); pages; pages >>= 1) {
+    if (pages & 1) {
+      crc = crc32_combine(crc, power, power_length);
+    }
+
+    power = crc32_combine(power, power, power_length);
+    power_length *= 2;
+  }
+
+  return crc;
+}
+
+enum claim_status : unsigned char
+{
+  claim_pending,
+  claim_speculated,
+  claim_committed
+};
+
 class signature
 {
 public:
-  signature(std::size_t block_size);
+  signature(std::size_t block_size,
+            bool entropy = false,
+            block_pack* pack = nullptr,
+            const allocation_map* allocation = nullptr);
 
   void push(const char* data, std::size_t size);
   void complete_block();
@@ -34,22 +113,85 @@ public:
   void reset_block();
   void reset();
 
-  void from_file(int fd, off_t offset, std::size_t count);
+  // Forgets the checksums of completed blocks, but not the current block;
+  // returns how many there were.
+  std::size_t take_output();
+
+  const std::vector<checksum_type>& checksums() const { return output; }
+
+  // The state of the current block, for saving and restoring it.
+  checksum_type block_register() const;
+  std::size_t block_left() const { return block_remaining; }
+  void restore_block(checksum_type crc_register, std::size_t remaining);
+
+  template<typename Reader>
+  bool from_source(Reader& reader,
+                   unsigned_off_t offset,
+                   std::size_t size,
+                   const std::atomic<unsigned char>* status = nullptr,
+                   std::int64_t* hash_ns = nullptr);
   void dump_to_file(int fd, off_t offset);
 
+  // Entropies of the blocks, at the same indexes as their checksums.
+  void dump_entropy(int fd, off_t offset);
+
+  // Where the blocks are in the pack, at the same indexes too.
+  void dump_recipe(int fd, off_t offset);
+
   const std::size_t block_size;
 
 private:
+  template<typename Reader>
+  bool read_blocks(Reader& reader,
+                   unsigned_off_t offset,
+                   std::size_t size,
+                   const std::atomic<unsigned char>* status,
+                   std::int64_t* hash_ns);
+  void push_free_block(std::size_t size);
+
+  void sample(const unsigned char* data, std::size_t size);
+  entropy_type block_entropy() const;
+  void pack_block_data(const char* data, std::size_t size);
+  pack_location store_block(checksum_type crc);
+
   checksum_algo csum;
   std::vector<checksum_type> output;
-  std::unique_ptr<char[]> buffer;
   std::size_t block_remaining;
+
+  const bool entropy;
+  std::vector<entropy_type> entropies;
+
+  // Four tables counted in turn, so that runs of equal bytes don't
+  // serialize on a single counter.
+  std::uint32_t histogram[4][256] = {};
+
+  block_pack* const pack;
+  std::vector<pack_location> locations;
+  block_hasher strong_hash;
+
+  // The data of the current block: borrowed from the reader if it came in
+  // one piece, copied together otherwise.
+  const char* block_data = nullptr;
+  std::vector<char> block_copy;
+
+  const allocation_map* const allocation;
+  checksum_type free_block_checksum = 0;
 };
 
-signature::signature(std::size_t block_size)
+signature::signature(std::size_t block_size,
+                     bool entropy,
+                     block_pack* pack,
+                     const allocation_map* allocation)
   : block_size(block_size)
   , block_remaining(block_size)
-{}
+  , entropy(entropy)
+  , pack(pack)
+  , allocation(allocation)
+{
+  if (allocation) {
+    free_block_checksum = zeros_checksum(block_size);
+  }
+}
 
 void
 signature::push(const char* data, std::size_t size)
@@ -62,6 +204,20 @@ signature::push(const char* data, std::size_t size)
     auto chunk = std::min(block_remaining, size);
     csum.process_bytes(data, chunk);
 
+    if (entropy) {
+      auto position = block_size - block_remaining;
+      auto skip = (entropy_stride - position % entropy_stride) % entropy_stride;
+
+      if (skip < chunk) {
+        sample(reinterpret_cast<const unsigned char*>(data) + skip,
+               chunk - skip);
+      }
+    }
+
+    if (pack) {
+      pack_block_data(data, chunk);
+    }
+
     size -= chunk;
     block_remaining -= chunk;
     data += chunk;
@@ -80,6 +236,15 @@ signature::complete_block()
   }
 
   output.push_back(csum.checksum());
+
+  if (entropy) {
+    entropies.push_back(block_entropy());
+  }
+
+  if (pack) {
+    locations.push_back(store_block(output.back()));
+  }
+
   reset_block();
 }
 
@@ -88,6 +253,16 @@ signature::reset_block()
 {
   csum.reset();
   block_remaining = block_size;
+
+  if (entropy) {
+    std::memset(histogram, 0, sizeof(histogram));
+  }
+
+  if (pack) {
+    strong_hash.reset();
+    block_data = nullptr;
+    block_copy.clear();
+  }
 }
 
 void
@@ -95,143 +270,1803 @@ signature::reset()
 {
   reset_block();
   output.clear();
+  entropies.clear();
+  locations.clear();
+}
+
+std::size_t
+signature::take_output()
+{
+  auto count = output.size();
+  output.clear();
+  entropies.clear();
+  locations.clear();
+  return count;
+}
+
+checksum_type
+signature::block_register() const
+{
+  return csum.get_interim_remainder();
+}
+
+void
+signature::restore_block(checksum_type crc_register, std::size_t remaining)
+{
+  reset_block();
+  csum.reset(crc_register);
+  block_remaining = remaining;
 }
 
+// Counts every entropy_stride-th byte, starting with the first.
 void
-signature::from_file(int fd, off_t offset, std::size_t block_count)
+signature::sample(const unsigned char* data, std::size_t size)
 {
-  auto read_remaining = block_size * block_count;
+  const std::size_t unroll = 4 * entropy_stride;
+  std::size_t i = 0;
 
-  output.reserve(output.size() + block_count);
+  for (; i + unroll <= size; i += unroll) {
+    histogram[0][data[i]]++;
+    histogram[1][data[i + entropy_stride]]++;
+    histogram[2][data[i + 2 * entropy_stride]]++;
+    histogram[3][data[i + 3 * entropy_stride]]++;
+  }
 
-  if (!buffer) {
-    buffer.reset(new char[buffer_size]);
+  for (; i < size; i += entropy_stride) {
+    histogram[0][data[i]]++;
   }
+}
+
+// Shannon entropy of the sampled bytes, in bits per byte: 8 for random data,
+// and the lower, the better the block should compress.
+entropy_type
+signature::block_entropy() const
+{
+  std::uint64_t total = 0;
+  double sum = 0;
 
-  while (read_remaining) {
-    auto n_read =
-      pread(fd, buffer.get(), std::min(read_remaining, buffer_size), offset);
+  for (unsigned int value = 0; value < 256; value++) {
+    std::uint64_t count = histogram[0][value] + histogram[1][value] +
+                          histogram[2][value] + histogram[3][value];
 
-    if (n_read < 0) {
-      if (errno == EINTR) {
-        continue;
+    if (count) {
+      total += count;
+      sum += count * std::log2(double(count));
+    }
+  }
+
+  if (total == 0) {
+    return 0;
+  }
+
+  return entropy_type(std::log2(double(total)) - sum / total);
+}
+
+// A piece of the current block, which push() has already hashed.
+void
+signature::pack_block_data(const char* data, std::size_t size)
+{
+  strong_hash.update(data, size);
+
+  // The block completes before push() returns, so the reader's buffer is
+  // still there to be written out from.
+  if (size == block_size) {
+    block_data = data;
+  } else {
+    block_copy.insert(block_copy.end(), data, data + size);
+  }
+}
+
+pack_location
+signature::store_block(checksum_type crc)
+{
+  auto digest = strong_hash.digest();
+
+  if (block_data) {
+    return pack->store(crc, digest, block_data, block_size);
+  }
+
+  return pack->store(crc, digest, block_copy.data(), block_copy.size());
+}
+
+// A block the filesystem has nothing in, at the start of the current one.
+void
+signature::push_free_block(std::size_t size)
+{
+  output.push_back(size == block_size ? free_block_checksum
+                                      : zeros_checksum(size));
+
+  if (entropy) {
+    entropies.push_back(0);
+  }
+}
+
+// Returns false if the read was abandoned because *status became
+// claim_committed, i.e. another worker already signed the same claim. If
+// hash_ns is given, the time spent hashing is added to it. With an
+// allocation map, only the runs of blocks with something allocated in them
+// are read; `offset` has to be at a block boundary then.
+template<typename Reader>
+bool
+signature::from_source(Reader& reader,
+                       unsigned_off_t offset,
+                       std::size_t size,
+                       const std::atomic<unsigned char>* status,
+                       std::int64_t* hash_ns)
+{
+  if (!allocation) {
+    return read_blocks(reader, offset, size, status, hash_ns);
+  }
+
+  auto end = offset + size;
+
+  while (offset < end) {
+    auto length = std::min<unsigned_off_t>(block_size, end - offset);
+
+    if (allocation->is_free(offset, length)) {
+      push_free_block(length);
+      offset += length;
+      continue;
+    }
+
+    auto run_end = offset + length;
+
+    while (run_end < end) {
+      length = std::min<unsigned_off_t>(block_size, end - run_end);
+
+      if (allocation->is_free(run_end, length)) {
+        break;
       }
+      run_end += length;
+    }
 
-      throw std::system_error(errno, std::generic_category(), "pread");
+    if (!read_blocks(reader, offset, run_end - offset, status, hash_ns)) {
+      return false;
     }
+    offset = run_end;
+  }
 
-    if (n_read == 0) {
-      break;
+  return true;
+}
+
+template<typename Reader>
+bool
+signature::read_blocks(Reader& reader,
+                       unsigned_off_t offset,
+                       std::size_t size,
+                       const std::atomic<unsigned char>* status,
+                       std::int64_t* hash_ns)
+{
+  output.reserve(output.size() + (size + block_size - 1) / block_size);
+
+  bool abandoned = false;
+
+  reader.read(offset, size, [&](const char* data, std::size_t count) {
+    if (status &&
+        status->load(std::memory_order_relaxed) == claim_committed) {
+      abandoned = true;
+      return false;
     }
 
-    push(buffer.get(), n_read);
-    read_remaining -= n_read;
-    offset += n_read;
+    if (hash_ns) {
+      auto started = now_ns();
+      push(data, count);
+      *hash_ns += now_ns() - started;
+    } else {
+      push(data, count);
+    }
+    return true;
+  });
+
+  if (abandoned) {
+    return false;
   }
 
   complete_block();
+  return true;
 }
 
 void
 signature::dump_to_file(int fd, off_t offset)
 {
-  auto write_ptr = reinterpret_cast<char*>(output.data());
-  auto write_end = reinterpret_cast<char*>(output.data() + output.size());
+  pwrite_full(fd,
+              reinterpret_cast<const char*>(output.data()),
+              output.size() * checksum_size,
+              offset);
+}
 
-  while (write_ptr != write_end) {
-    auto n_written = pwrite(fd, write_ptr, write_end - write_ptr, offset);
+void
+signature::dump_entropy(int fd, off_t offset)
+{
+  pwrite_full(fd,
+              reinterpret_cast<const char*>(entropies.data()),
+              entropies.size() * entropy_size,
+              offset);
+}
 
-    if (n_written < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
+void
+signature::dump_recipe(int fd, off_t offset)
+{
+  pwrite_full(fd,
+              reinterpret_cast<const char*>(locations.data()),
+              locations.size() * recipe_entry_size,
+              offset);
+}
 
-      throw std::system_error(errno, std::generic_category(), "pwrite");
-    }
+// Adds the checksums of the blocks `signed_part` holds, covering `size`
+// bytes, to a whole-input digest.
+void
+fold_digest(crc32_accumulator& digest,
+            const signature& signed_part,
+            unsigned_off_t size)
+{
+  for (auto checksum : signed_part.checksums()) {
+    auto length = std::min<unsigned_off_t>(size, signed_part.block_size);
 
-    offset += n_written;
-    write_ptr += n_written;
+    digest.add(checksum, length);
+    size -= length;
   }
 }
 
+// Accounts for a piece of input signed on the calling thread, as a single
+// claim of worker 0.
+void
+record_inline(signing_metrics* metrics,
+              unsigned_off_t size,
+              std::int64_t busy_ns)
+{
+  if (!metrics) {
+    return;
+  }
+
+  auto& counters = metrics->worker(0);
+
+  metrics->add_input(size, 1);
+  counters.claims_started.fetch_add(1, std::memory_order_relaxed);
+  counters.claims_completed.fetch_add(1, std::memory_order_relaxed);
+  counters.bytes.fetch_add(size, std::memory_order_relaxed);
+  counters.busy_ns.fetch_add(busy_ns, std::memory_order_relaxed);
 }
 
+// Claims younger than this are never re-issued, however fast the others were.
+const std::int64_t straggler_min_age = 50 * 1000 * 1000;
+
+// Percentiles computed from fewer completed claims are too noisy to act on.
+const std::uint64_t straggler_min_samples = 16;
+
+const unsigned_off_t no_claim = std::numeric_limits<unsigned_off_t>::max();
+
+// Log2-bucketed claim durations, shared by all workers.
+class latency_histogram
+{
+public:
+  void record(std::int64_t ns);
+  std::int64_t percentile(double percent) const;
+
+private:
+  std::atomic<std::uint64_t> buckets[64] = {};
+  std::atomic<std::uint64_t> total{ 0 };
+};
+
 void
-generate_signature(int fd_in,
-                   int fd_out,
-                   std::size_t block_size,
-                   unsigned int concurrency)
+latency_histogram::record(std::int64_t ns)
 {
-  if (block_size <= 0) {
-    throw std::invalid_argument("block_size should be positive");
+  unsigned int bucket = 0;
+  while (bucket < 63 && (std::int64_t(1) << bucket) < ns) {
+    bucket++;
   }
 
-  if (concurrency <= 0) {
-    throw std::invalid_argument("concurrency should be positive");
-  }
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+}
 
-  struct stat input_stat;
-  if (fstat(fd_in, &input_stat) != 0) {
-    throw std::system_error(errno, std::generic_category(), "fstat");
+// Returns the upper bound of the bucket holding the given percentile, or zero
+// if there are not enough samples yet.
+std::int64_t
+latency_histogram::percentile(double percent) const
+{
+  auto samples = total.load(std::memory_order_relaxed);
+  if (samples < straggler_min_samples) {
+    return 0;
   }
 
-  typedef std::make_unsigned<off_t>::type unsigned_off_t;
+  auto rank = std::uint64_t(samples * percent / 100);
+  std::uint64_t seen = 0;
 
-  unsigned_off_t input_size = input_stat.st_size;
-  auto num_blocks = input_size / block_size;
-  if (input_size % block_size != 0) {
-    num_blocks += 1;
+  for (unsigned int bucket = 0; bucket < 64; bucket++) {
+    seen += buckets[bucket].load(std::memory_order_relaxed);
+    if (seen > rank) {
+      return std::int64_t(1) << bucket;
+    }
   }
 
-  if (ftruncate(fd_out, num_blocks * checksum_size) != 0) {
-    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  return std::numeric_limits<std::int64_t>::max();
+}
+
+struct alignas(64) worker_slot
+{
+  std::atomic<unsigned_off_t> claim{ no_claim };
+  std::atomic<std::int64_t> started{ 0 };
+};
+
+// Claims [next, end), handed out in order to the workers under one cache.
+struct alignas(64) claim_region
+{
+  std::atomic<unsigned_off_t> next{ 0 };
+  unsigned_off_t end = 0;
+};
+
+// State shared by the workers of one generate_signature() call. It is owned
+// jointly by the workers, so a worker stuck in a read of a claim that was
+// already signed by somebody else can be detached instead of waited for.
+template<typename Source>
+class signing_run
+{
+public:
+  signing_run(std::shared_ptr<Source> source,
+              int fd_out,
+              unsigned_off_t input_size,
+              std::size_t step,
+              std::vector<worker_place> places,
+              const signature_options& options);
+
+  void work(unsigned int worker);
+  void wait();
+  bool in_flight(unsigned int worker) const;
+
+  // Only valid after wait(), and if requested in the options.
+  checksum_type file_digest() const;
+  std::vector<heatmap_bin> heatmap(unsigned int bins) const;
+
+private:
+  typedef typename Source::reader reader_type;
+
+  void sign_claim(signature& partial,
+                  reader_type& reader,
+                  unsigned int worker,
+                  unsigned_off_t claim);
+  unsigned_off_t next_claim(unsigned int worker);
+  bool speculate(signature& partial, reader_type& reader, unsigned int worker);
+  void complete_claim();
+  void record_busy(unsigned int worker, std::int64_t started);
+  void fail(std::exception_ptr ex);
+
+  const std::shared_ptr<Source> source;
+  const int fd_out;
+  const int fd_entropy;
+  const int fd_recipe;
+  const std::shared_ptr<block_pack> pack;
+  const std::shared_ptr<const allocation_map> allocation;
+  const unsigned_off_t input_size;
+  const std::size_t block_size;
+  const std::size_t step;
+  const unsigned_off_t num_claims;
+  const unsigned int concurrency;
+  const double straggler_percentile;
+
+  // Empty unless the workers are pinned; see thread_placement.
+  const std::vector<worker_place> places;
+
+  std::unique_ptr<claim_region[]> regions;
+  unsigned int num_regions = 1;
+  std::atomic<bool> stopped{ false };
+  std::unique_ptr<std::atomic<unsigned char>[]> claims;
+  std::unique_ptr<worker_slot[]> slots;
+  std::unique_ptr<checksum_type[]> claim_digests;
+  std::vector<std::vector<read_sample>> samples;
+  latency_histogram latencies;
+  const std::shared_ptr<signing_metrics> metrics;
+
+  std::mutex mutex;
+  std::condition_variable done;
+  unsigned_off_t completed = 0;
+  std::exception_ptr error;
+};
+
+template<typename Source>
+signing_run<Source>::signing_run(std::shared_ptr<Source> source,
+                                 int fd_out,
+                                 unsigned_off_t input_size,
+                                 std::size_t step,
+                                 std::vector<worker_place> places,
+                                 const signature_options& options)
+  : source(std::move(source))
+  , fd_out(fd_out)
+  , fd_entropy(options.fd_entropy)
+  , fd_recipe(options.fd_recipe)
+  , pack(options.pack)
+  , allocation(options.allocation)
+  , input_size(input_size)
+  , block_size(options.block_size)
+  , step(step)
+  , num_claims((input_size + step * block_size - 1) / (step * block_size))
+  , concurrency(options.concurrency)
+  , straggler_percentile(options.straggler_percentile)
+  , places(std::move(places))
+  , claims(new std::atomic<unsigned char>[num_claims]())
+  , slots(new worker_slot[concurrency])
+  , claim_digests(options.file_digest ? new checksum_type[num_claims]
+                                      : nullptr)
+  , metrics(options.metrics)
+{
+  if (metrics) {
+    metrics->add_input(input_size, num_claims);
   }
 
-  if (num_blocks == 0) {
-    return;
+  // Every cache group gets a region of the input in proportion to the
+  // number of its workers.
+  std::vector<unsigned int> group_workers{ concurrency };
+
+  if (!this->places.empty()) {
+    group_workers.clear();
+
+    for (auto& place : this->places) {
+      if (place.cache_group >= group_workers.size()) {
+        group_workers.resize(place.cache_group + 1);
+      }
+      group_workers[place.cache_group]++;
+    }
   }
 
-  if (concurrency > num_blocks) {
-    concurrency = num_blocks;
+  num_regions = group_workers.size();
+  regions.reset(new claim_region[num_regions]);
+
+  unsigned int workers_before = 0;
+
+  for (unsigned int group = 0; group < num_regions; group++) {
+    regions[group].next.store(num_claims * workers_before / concurrency);
+    workers_before += group_workers[group];
+    regions[group].end = num_claims * workers_before / concurrency;
   }
 
-  auto step = std::max(std::size_t(1), buffer_size / block_size);
+  // One buffer per worker, sized up front, so that recording a sample
+  // neither synchronizes nor allocates.
+  if (options.heatmap_bins) {
+    samples.resize(concurrency);
 
-  if (step > num_blocks / concurrency) {
-    step = num_blocks / concurrency;
+    for (auto& worker_samples : samples) {
+      worker_samples.reserve(num_claims / concurrency + 16);
+    }
   }
+}
 
-  std::atomic<unsigned_off_t> block_counter(0);
-  std::vector<std::thread> threads;
-  std::vector<std::future<void>> futures;
+template<typename Source>
+void
+signing_run<Source>::work(unsigned int worker)
+{
+  // Pinned first, so that the buffers are allocated near the CPU. Where the
+  // kernel refuses, the worker just runs unpinned.
+  if (!places.empty()) {
+    pin_current_thread(places[worker].cpu);
+  }
 
-  for (unsigned int i = 0; i < concurrency; i++) {
-    std::packaged_task<void()> task([&]() {
-      signature partial_signature(block_size);
+  signature partial_signature(
+    block_size, fd_entropy != -1, pack.get(), allocation.get());
 
-      for (;;) {
-        auto block_index =
-          block_counter.fetch_add(step, std::memory_order_relaxed);
+  try {
+    auto reader = source->make_reader();
 
-        if (block_index >= num_blocks) {
-          break;
-        }
+    for (;;) {
+      auto claim = next_claim(worker);
 
-        partial_signature.from_file(fd_in, block_index * block_size, step);
-        partial_signature.dump_to_file(fd_out, block_index * checksum_size);
-        partial_signature.reset();
+      if (claim == no_claim || stopped.load(std::memory_order_relaxed)) {
+        break;
       }
-    });
 
-    futures.push_back(task.get_future());
-    threads.push_back(std::thread(std::move(task)));
+      if (metrics) {
+        metrics->worker(worker).claims_started.fetch_add(
+          1, std::memory_order_relaxed);
+      }
+
+      sign_claim(partial_signature, reader, worker, claim);
+    }
+
+    while (speculate(partial_signature, reader, worker)) {
+    }
+  } catch (...) {
+    fail(std::current_exception());
+  }
+}
+
+template<typename Source>
+void
+signing_run<Source>::sign_claim(signature& partial,
+                                reader_type& reader,
+                                unsigned int worker,
+                                unsigned_off_t claim)
+{
+  auto& slot = slots[worker];
+  auto& status = claims[claim];
+  auto started = now_ns();
+
+  slot.started.store(started, std::memory_order_relaxed);
+  slot.claim.store(claim, std::memory_order_release);
+
+  auto offset = claim * step * block_size;
+  auto size = std::min<unsigned_off_t>(step * block_size, input_size - offset);
+  std::int64_t hash_ns = 0;
+  bool complete;
+
+  try {
+    complete = partial.from_source(
+      reader, offset, size, &status, samples.empty() ? nullptr : &hash_ns);
+  } catch (...) {
+    slot.claim.store(no_claim, std::memory_order_release);
+    partial.reset();
+    record_busy(worker, started);
+
+    if (status.load() == claim_committed) {
+      return;
+    }
+    throw;
+  }
+
+  if (complete && status.exchange(claim_committed) != claim_committed) {
+    auto elapsed = now_ns() - started;
+    latencies.record(elapsed);
+
+    if (metrics) {
+      auto& counters = metrics->worker(worker);
+      counters.bytes.fetch_add(size, std::memory_order_relaxed);
+      counters.claims_completed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (!samples.empty()) {
+      samples[worker].push_back({ offset, size, elapsed - hash_ns });
+    }
+
+    partial.dump_to_file(fd_out, claim * step * checksum_size);
+
+    if (fd_entropy != -1) {
+      partial.dump_entropy(fd_entropy, claim * step * entropy_size);
+    }
+
+    if (fd_recipe != -1) {
+      partial.dump_recipe(fd_recipe, claim * step * recipe_entry_size);
+    }
+
+    if (claim_digests) {
+      crc32_accumulator digest(block_size);
+      fold_digest(digest, partial, size);
+      claim_digests[claim] = digest.value();
+    }
+
+    complete_claim();
+  }
+
+  slot.claim.store(no_claim, std::memory_order_release);
+  partial.reset();
+  record_busy(worker, started);
+}
+
+// Busy time includes reads that were abandoned or failed: the worker was
+// occupied all the same.
+template<typename Source>
+void
+signing_run<Source>::record_busy(unsigned int worker, std::int64_t started)
+{
+  if (metrics) {
+    metrics->worker(worker).busy_ns.fetch_add(now_ns() - started,
+                                              std::memory_order_relaxed);
   }
+}
 
-  for (auto& thread : threads) {
-    thread.join();
+// Hands out the next claim of the worker's own region, or once that one is
+// exhausted, of the others, so that no worker idles while claims are left.
+template<typename Source>
+unsigned_off_t
+signing_run<Source>::next_claim(unsigned int worker)
+{
+  unsigned int home = places.empty() ? 0 : places[worker].cache_group;
+
+  for (unsigned int i = 0; i < num_regions; i++) {
+    auto& region = regions[(home + i) % num_regions];
+
+    if (region.next.load(std::memory_order_relaxed) >= region.end) {
+      continue;
+    }
+
+    auto claim = region.next.fetch_add(1, std::memory_order_relaxed);
+    if (claim < region.end) {
+      return claim;
+    }
   }
 
-  for (auto& future : futures) {
-    future.get();
+  return no_claim;
+}
+
+// Waits for the remaining claims to complete, re-issuing the ones that take
+// much longer than the others. The first copy of a claim to finish is the
+// one written out; the other is discarded.
+template<typename Source>
+bool
+signing_run<Source>::speculate(signature& partial,
+                               reader_type& reader,
+                               unsigned int worker)
+{
+  if (straggler_percentile <= 0) {
+    return false;
   }
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for (;;) {
+    if (completed == num_claims || error) {
+      return false;
+    }
+
+    auto percentile = latencies.percentile(straggler_percentile);
+    auto threshold = std::max(straggler_min_age, 2 * percentile);
+    auto now = now_ns();
+
+    // Until enough claims have completed to say what is slow, nothing is.
+    for (unsigned int other = 0; percentile != 0 && other < concurrency;
+         other++) {
+      if (other == worker) {
+        continue;
+      }
+
+      auto claim = slots[other].claim.load(std::memory_order_acquire);
+      if (claim == no_claim) {
+        continue;
+      }
+
+      auto age = now - slots[other].started.load(std::memory_order_relaxed);
+      if (age < threshold) {
+        continue;
+      }
+
+      unsigned char expected = claim_pending;
+      if (claims[claim].compare_exchange_strong(expected, claim_speculated)) {
+        lock.unlock();
+
+        if (metrics) {
+          auto& counters = metrics->worker(worker);
+          counters.claims_started.fetch_add(1, std::memory_order_relaxed);
+          counters.claims_reissued.fetch_add(1, std::memory_order_relaxed);
+        }
+        sign_claim(partial, reader, worker, claim);
+        return true;
+      }
+    }
+
+    done.wait_for(lock, std::chrono::nanoseconds(threshold / 4));
+  }
+}
+
+template<typename Source>
+void
+signing_run<Source>::complete_claim()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (++completed == num_claims) {
+    done.notify_all();
+  }
+}
+
+template<typename Source>
+void
+signing_run<Source>::fail(std::exception_ptr ex)
+{
+  stopped.store(true, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!error) {
+    error = ex;
+  }
+  done.notify_all();
+}
+
+template<typename Source>
+void
+signing_run<Source>::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  done.wait(lock, [this]() { return completed == num_claims || error; });
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+template<typename Source>
+bool
+signing_run<Source>::in_flight(unsigned int worker) const
+{
+  return slots[worker].claim.load(std::memory_order_acquire) != no_claim;
+}
+
+template<typename Source>
+std::vector<heatmap_bin>
+signing_run<Source>::heatmap(unsigned int bins) const
+{
+  return bin_samples(samples, input_size, bins);
+}
+
+template<typename Source>
+checksum_type
+signing_run<Source>::file_digest() const
+{
+  auto claim_size = step * block_size;
+  auto last_claim_size = input_size - (num_claims - 1) * claim_size;
+
+  return crc32_combine_all(claim_digests.get(),
+                           num_claims,
+                           claim_size,
+                           last_claim_size,
+                           concurrency);
+}
+
+// Sizes the outputs for num_blocks blocks.
+void
+truncate_output(int fd_out,
+                const signature_options& options,
+                unsigned_off_t num_blocks)
+{
+  if (ftruncate(fd_out, num_blocks * checksum_size) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+
+  if (options.fd_entropy != -1 &&
+      ftruncate(options.fd_entropy, num_blocks * entropy_size) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+
+  if (options.fd_recipe != -1 &&
+      ftruncate(options.fd_recipe, num_blocks * recipe_entry_size) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+}
+
+// Inputs that can't be read in parallel are signed as they arrive, with the
+// output growing along.
+template<typename Source>
+signature_summary
+sign_stream(Source& source, int fd_out, const signature_options& options)
+{
+  signature stream_signature(
+    options.block_size, options.fd_entropy != -1, options.pack.get());
+  crc32_accumulator digest(options.block_size);
+  std::vector<std::vector<read_sample>> samples(1);
+  auto reader = source.make_reader();
+  unsigned_off_t offset = 0;
+  unsigned_off_t emitted = 0;
+
+  for (;;) {
+    auto started = now_ns();
+    std::int64_t hash_ns = 0;
+
+    auto n_read = reader.read(
+      offset, buffer_size, [&](const char* data, std::size_t count) {
+        auto hash_started = now_ns();
+        stream_signature.push(data, count);
+        hash_ns += now_ns() - hash_started;
+        return true;
+      });
+
+    if (n_read == 0) {
+      break;
+    }
+
+    if (options.heatmap_bins) {
+      samples[0].push_back({ offset, n_read, now_ns() - started - hash_ns });
+    }
+
+    record_inline(options.metrics.get(), n_read, now_ns() - started);
+
+    offset += n_read;
+    stream_signature.dump_to_file(fd_out, emitted * checksum_size);
+
+    if (options.fd_entropy != -1) {
+      stream_signature.dump_entropy(options.fd_entropy, emitted * entropy_size);
+    }
+
+    if (options.fd_recipe != -1) {
+      stream_signature.dump_recipe(options.fd_recipe,
+                                   emitted * recipe_entry_size);
+    }
+
+    if (options.file_digest) {
+      fold_digest(
+        digest, stream_signature, offset - emitted * options.block_size);
+    }
+    emitted += stream_signature.take_output();
+  }
+
+  stream_signature.complete_block();
+  stream_signature.dump_to_file(fd_out, emitted * checksum_size);
+
+  if (options.fd_entropy != -1) {
+    stream_signature.dump_entropy(options.fd_entropy, emitted * entropy_size);
+  }
+
+  if (options.fd_recipe != -1) {
+    stream_signature.dump_recipe(options.fd_recipe,
+                                 emitted * recipe_entry_size);
+  }
+
+  if (options.file_digest) {
+    fold_digest(
+      digest, stream_signature, offset - emitted * options.block_size);
+  }
+  emitted += stream_signature.take_output();
+
+  truncate_output(fd_out, options, emitted);
+
+  signature_summary summary;
+  summary.file_digest = digest.value();
+  summary.heatmap = bin_samples(samples, offset, options.heatmap_bins);
+  return summary;
+}
+
+template<typename Source>
+signature_summary
+sign_seekable(std::shared_ptr<Source> source,
+              int fd_out,
+              const signature_options& options)
+{
+  auto block_size = options.block_size;
+  auto concurrency = options.concurrency;
+
+  unsigned_off_t input_size = source->size();
+  auto num_blocks = input_size / block_size;
+  if (input_size % block_size != 0) {
+    num_blocks += 1;
+  }
+
+  truncate_output(fd_out, options, num_blocks);
+
+  signature_summary summary;
+
+  if (num_blocks == 0) {
+    return summary;
+  }
+
+  if (input_size <= inline_threshold) {
+    signature whole_signature(block_size,
+                              options.fd_entropy != -1,
+                              options.pack.get(),
+                              options.allocation.get());
+    auto reader = source->make_reader();
+    auto started = now_ns();
+    std::int64_t hash_ns = 0;
+
+    whole_signature.from_source(reader, 0, input_size, nullptr, &hash_ns);
+    whole_signature.dump_to_file(fd_out, 0);
+
+    if (options.fd_entropy != -1) {
+      whole_signature.dump_entropy(options.fd_entropy, 0);
+    }
+
+    if (options.fd_recipe != -1) {
+      whole_signature.dump_recipe(options.fd_recipe, 0);
+    }
+    record_inline(options.metrics.get(), input_size, now_ns() - started);
+
+    if (options.heatmap_bins) {
+      std::vector<std::vector<read_sample>> samples{
+        { { 0, input_size, now_ns() - started - hash_ns } }
+      };
+      summary.heatmap = bin_samples(samples, input_size, options.heatmap_bins);
+    }
+
+    if (options.file_digest) {
+      crc32_accumulator digest(block_size);
+      fold_digest(digest, whole_signature, input_size);
+      summary.file_digest = digest.value();
+    }
+    return summary;
+  }
+
+  if (concurrency > num_blocks) {
+    concurrency = num_blocks;
+  }
+
+  auto step = std::max(std::size_t(1), buffer_size / block_size);
+
+  if (step > num_blocks / concurrency) {
+    step = num_blocks / concurrency;
+  }
+
+  // Parity is computed by whoever reads a group, so claims can't split one.
+  if (options.fd_parity != -1) {
+    auto group = options.parity_group;
+    step = (step + group - 1) / group * group;
+  }
+
+  signature_options run_options = options;
+  run_options.concurrency = concurrency;
+
+  std::vector<worker_place> places;
+
+  if (options.placement == thread_placement::cores) {
+    places = cpu_topology().place(concurrency);
+  }
+
+  auto run = std::make_shared<signing_run<Source>>(std::move(source),
+                                                   fd_out,
+                                                   input_size,
+                                                   step,
+                                                   std::move(places),
+                                                   run_options);
+  std::vector<std::thread> threads;
+
+  for (unsigned int i = 0; i < concurrency; i++) {
+    threads.push_back(std::thread([run, i]() { run->work(i); }));
+  }
+
+  try {
+    run->wait();
+  } catch (...) {
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    throw;
+  }
+
+  // Whatever is still reading at this point is a duplicate of a claim that
+  // is already written out: don't let a stuck read hold up the result.
+  for (unsigned int i = 0; i < concurrency; i++) {
+    if (run->in_flight(i)) {
+      threads[i].detach();
+    } else {
+      threads[i].join();
+    }
+  }
+
+  if (options.file_digest) {
+    summary.file_digest = run->file_digest();
+  }
+
+  if (options.heatmap_bins) {
+    summary.heatmap = run->heatmap(options.heatmap_bins);
+  }
+
+  return summary;
+}
+
+template<typename Source>
+signature_summary
+sign_any(std::shared_ptr<Source> source,
+         int fd_out,
+         const signature_options& options)
+{
+  if constexpr (Source::seekable) {
+    return sign_seekable(std::move(source), fd_out, options);
+  } else {
+    if (options.allocation) {
+      throw std::invalid_argument(
+        "free blocks can only be skipped in seekable inputs");
+    }
+
+    return sign_stream(*source, fd_out, options);
+  }
+}
+
+template<typename Source>
+signature_summary
+sign_with_parity(std::shared_ptr<Source> source,
+                 int fd_out,
+                 const signature_options& options)
+{
+  if (options.fd_parity != -1) {
+    parity_layout layout{ options.block_size,
+                          options.parity_group,
+                          options.parity_count };
+
+    return sign_any(std::make_shared<parity_source<Source>>(
+                      std::move(source), options.fd_parity, layout),
+                    fd_out,
+                    options);
+  }
+
+  return sign_any(std::move(source), fd_out, options);
+}
+
+template<typename Source>
+signature_summary
+sign_source(std::shared_ptr<Source> source,
+            int fd_out,
+            const signature_options& options)
+{
+  auto block_size = options.block_size;
+  auto concurrency = options.concurrency;
+
+  if (block_size <= 0) {
+    throw std::invalid_argument("block_size should be positive");
+  }
+
+  if (concurrency <= 0) {
+    throw std::invalid_argument("concurrency should be positive");
+  }
+
+  if (options.fd_recipe != -1 && !options.pack) {
+    throw std::invalid_argument("a recipe needs a pack");
+  }
+
+  if (options.pack && block_size > std::numeric_limits<std::uint32_t>::max()) {
+    throw std::invalid_argument("blocks are too large for a pack");
+  }
+
+  if (options.allocation && (options.fd_parity != -1 || options.pack)) {
+    throw std::invalid_argument(
+      "free blocks can't be skipped with parity or a pack");
+  }
+
+  try {
+    if (options.fd_copy != -1) {
+      return sign_with_parity(
+        std::make_shared<tee_source<Source>>(std::move(source), options.fd_copy),
+        fd_out,
+        options);
+    }
+
+    return sign_with_parity(std::move(source), fd_out, options);
+  } catch (...) {
+    if (options.metrics) {
+      options.metrics->add_error();
+    }
+    throw;
+  }
+}
+
+// Verification samples runs of blocks: the run size is the length of one
+// signing claim, so that sampled reads are as efficient as full ones. The
+// sample is split into this many passes, each a uniform sample by itself,
+// checked in offset order. A pass cut short by the time budget only covers
+// its lowest offsets, so the bound is computed over whole passes only.
+const unsigned int verify_passes = 8;
+
+std::uint64_t
+mix64(std::uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// Upper end of the one-sided Wilson score interval for a proportion.
+double
+wilson_upper_bound(std::uint64_t positive,
+                   std::uint64_t total,
+                   double confidence)
+{
+  if (total == 0) {
+    return 1;
+  }
+
+  boost::math::normal normal;
+  auto z = boost::math::quantile(normal, confidence);
+  auto n = double(total);
+  auto p = positive / n;
+  auto z2 = z * z;
+
+  auto center = p + z2 / (2 * n);
+  auto margin = z * std::sqrt(p * (1 - p) / n + z2 / (4 * n * n));
+
+  return std::min(1.0, (center + margin) / (1 + z2 / n));
+}
+
+template<typename Source>
+verify_result
+verify_source(std::shared_ptr<Source> source,
+              int fd_signature,
+              const signature_options& options,
+              const verify_options& verify)
+{
+  if constexpr (!Source::seekable) {
+    throw std::invalid_argument("only seekable inputs can be verified");
+  } else {
+    auto block_size = options.block_size;
+    auto concurrency = options.concurrency;
+
+    if (block_size <= 0) {
+      throw std::invalid_argument("block_size should be positive");
+    }
+
+    if (concurrency <= 0) {
+      throw std::invalid_argument("concurrency should be positive");
+    }
+
+    if (!(verify.coverage > 0 && verify.coverage <= 1)) {
+      throw std::invalid_argument("coverage should be in (0, 1]");
+    }
+
+    if (!(verify.confidence > 0 && verify.confidence < 1)) {
+      throw std::invalid_argument("confidence should be in (0, 1)");
+    }
+
+    auto started = clock_type::now();
+    unsigned_off_t input_size = source->size();
+    auto num_blocks = (input_size + block_size - 1) / block_size;
+
+    if (fd_size(fd_signature) != num_blocks * checksum_size) {
+      throw std::runtime_error(
+        "the signature doesn't match the input size and block size");
+    }
+
+    std::vector<checksum_type> expected(num_blocks);
+    pread_full(fd_signature,
+               reinterpret_cast<char*>(expected.data()),
+               num_blocks * checksum_size,
+               0);
+
+    unsigned_off_t run_blocks =
+      std::max(std::size_t(1), buffer_size / block_size);
+
+    if (run_blocks > num_blocks / concurrency) {
+      run_blocks = std::max<unsigned_off_t>(1, num_blocks / concurrency);
+    }
+
+    auto num_runs = (num_blocks + run_blocks - 1) / run_blocks;
+
+    // Exactly the coverage's share of the runs, rounded up (but not for
+    // rounding errors), drawn without replacement by the first steps of a
+    // Fisher-Yates shuffle, so that any prefix of the draw is a uniform
+    // sample too.
+    auto sample_size = std::min<unsigned_off_t>(
+      num_runs,
+      std::max<unsigned_off_t>(
+        1, std::ceil(verify.coverage * num_runs * (1 - 1e-12))));
+
+    std::vector<unsigned_off_t> order(num_runs);
+    for (unsigned_off_t run = 0; run < num_runs; run++) {
+      order[run] = run;
+    }
+
+    for (unsigned_off_t i = 0; i < sample_size; i++) {
+      auto random = mix64(verify.seed ^ mix64(i));
+      auto j = i + unsigned_off_t((unsigned __int128)random *
+                                  (num_runs - i) >> 64);
+      std::swap(order[i], order[j]);
+    }
+
+    order.resize(sample_size);
+
+    // Where each pass starts in the draw, followed by its end.
+    std::vector<std::size_t> pass_starts;
+
+    for (unsigned int pass = 0; pass <= verify_passes; pass++) {
+      pass_starts.push_back(sample_size * pass / verify_passes);
+    }
+
+    for (unsigned int pass = 0; pass < verify_passes; pass++) {
+      std::sort(order.begin() + pass_starts[pass],
+                order.begin() + pass_starts[pass + 1]);
+    }
+
+    auto deadline = clock_type::time_point::max();
+    if (verify.time_budget.count() > 0) {
+      deadline = started + verify.time_budget;
+    }
+
+    std::atomic<std::size_t> next{ 0 };
+    std::atomic<bool> stopped{ false };
+    std::mutex mutex;
+    std::exception_ptr error;
+    verify_result result;
+
+    // Runs are handed out in order, and the clock only moves forward, so
+    // the runs checked before the deadline are those before the first one
+    // given up on.
+    std::size_t given_up = order.size();
+    std::unique_ptr<bool[]> run_was_bad(new bool[order.size()]());
+
+    auto work = [&]() {
+      std::vector<unsigned_off_t> bad_blocks;
+      std::uint64_t blocks = 0;
+
+      try {
+        auto reader = source->make_reader();
+        signature sampled(block_size);
+
+        for (;;) {
+          auto index = next.fetch_add(1, std::memory_order_relaxed);
+
+          if (index >= order.size() ||
+              stopped.load(std::memory_order_relaxed)) {
+            break;
+          }
+
+          if (clock_type::now() >= deadline) {
+            std::lock_guard<std::mutex> lock(mutex);
+            given_up = std::min(given_up, index);
+            break;
+          }
+
+          auto first_block = order[index] * run_blocks;
+          auto offset = first_block * block_size;
+          auto size = std::min<unsigned_off_t>(run_blocks * block_size,
+                                               input_size - offset);
+
+          sampled.from_source(reader, offset, size);
+
+          auto& checksums = sampled.checksums();
+          auto run_length = std::min<unsigned_off_t>(run_blocks,
+                                                     num_blocks - first_block);
+          bool run_bad = checksums.size() != run_length;
+
+          for (unsigned_off_t i = 0; i < run_length; i++) {
+            if (i >= checksums.size() ||
+                checksums[i] != expected[first_block + i]) {
+              bad_blocks.push_back(first_block + i);
+              run_bad = true;
+            }
+          }
+
+          run_was_bad[index] = run_bad;
+          blocks += run_length;
+          sampled.reset();
+        }
+      } catch (...) {
+        stopped.store(true, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      result.blocks_checked += blocks;
+      result.bad_blocks.insert(
+        result.bad_blocks.end(), bad_blocks.begin(), bad_blocks.end());
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < concurrency; i++) {
+      threads.push_back(std::thread(work));
+    }
+
+    work();
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+
+    std::sort(result.bad_blocks.begin(), result.bad_blocks.end());
+
+    result.blocks_total = num_blocks;
+    result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      clock_type::now() - started);
+
+    result.run_blocks = run_blocks;
+    result.runs_total = num_runs;
+
+    // Runs are what was sampled, so the bound is on the fraction of runs
+    // with a corrupted block: the blocks of a run aren't independent draws.
+    // Checking everything needs no bound.
+    if (given_up == num_runs) {
+      auto bad_runs =
+        std::count(run_was_bad.get(), run_was_bad.get() + num_runs, true);
+
+      result.corrupted_bound = num_runs ? double(bad_runs) / num_runs : 0;
+    } else {
+      unsigned int whole_passes = 0;
+      while (whole_passes < verify_passes &&
+             pass_starts[whole_passes + 1] <= given_up) {
+        whole_passes++;
+      }
+
+      auto runs_counted = pass_starts[whole_passes];
+      auto bad_runs =
+        std::count(run_was_bad.get(), run_was_bad.get() + runs_counted, true);
+
+      result.corrupted_bound =
+        wilson_upper_bound(bad_runs, runs_counted, verify.confidence);
+    }
+
+    return result;
+  }
+}
+
+// Calls f with a source reading fd_in by the given method.
+template<typename F>
+auto
+with_source(int fd_in, io_method io, F&& f)
+{
+  if (!is_seekable(fd_in)) {
+    io = io_method::stream;
+  } else if (io == io_method::uring && !uring::supported()) {
+    io = io_method::pread;
+  }
+
+  switch (io) {
+    case io_method::pread:
+      return f(std::make_shared<pread_source>(fd_in));
+
+    case io_method::mmap:
+      return f(std::make_shared<mmap_source>(fd_in));
+
+    case io_method::uring:
+      return f(std::make_shared<uring_source>(fd_in));
+
+    case io_method::direct:
+      return f(std::make_shared<direct_source>(fd_in));
+
+    case io_method::memory:
+      return f(std::make_shared<memory_source>(fd_in));
+
+    case io_method::stream:
+      return f(std::make_shared<stream_source>(fd_in));
+  }
+
+  throw std::logic_error("unhandled I/O method");
+}
+
+}
+
+void
+generate_signature(int fd_in,
+                   int fd_out,
+                   std::size_t block_size,
+                   unsigned int concurrency)
+{
+  signature_options options;
+  options.block_size = block_size;
+  options.concurrency = concurrency;
+
+  generate_signature(fd_in, fd_out, options);
+}
+
+namespace {
+
+// Calls f with a source_type for the I/O method, for inputs made of several
+// files, which all have to be seekable.
+template<typename T>
+struct source_type
+{
+  typedef T type;
+};
+
+template<typename F>
+auto
+with_seekable_type(const std::vector<int>& fds_in, io_method io, F&& f)
+{
+  for (auto fd : fds_in) {
+    if (!is_seekable(fd)) {
+      throw std::invalid_argument("inputs read together should be seekable");
+    }
+  }
+
+  if (io == io_method::uring && !uring::supported()) {
+    io = io_method::pread;
+  }
+
+  // The files are all seekable, so there is no need to read them as a
+  // stream.
+  switch (io) {
+    case io_method::pread:
+    case io_method::stream:
+      return f(source_type<pread_source>());
+
+    case io_method::mmap:
+      return f(source_type<mmap_source>());
+
+    case io_method::uring:
+      return f(source_type<uring_source>());
+
+    case io_method::direct:
+      return f(source_type<direct_source>());
+
+    case io_method::memory:
+      return f(source_type<memory_source>());
+  }
+
+  throw std::logic_error("unhandled I/O method");
+}
+
+signature_summary
+sign_mirrored(int fd_in, int fd_out, const signature_options& options)
+{
+  std::vector<int> fds{ fd_in };
+  fds.insert(fds.end(), options.fd_mirrors.begin(), options.fd_mirrors.end());
+
+  return with_seekable_type(fds, options.io, [&](auto type) {
+    typedef typename decltype(type)::type Copy;
+
+    std::vector<std::shared_ptr<Copy>> copies;
+
+    for (auto fd : fds) {
+      copies.push_back(std::make_shared<Copy>(fd));
+    }
+
+    auto source = std::make_shared<mirror_source<Copy>>(
+      std::move(copies), options.mirror_cross_check ? options.block_size : 0);
+
+    auto summary = sign_source(source, fd_out, options);
+    summary.mirror_mismatches = source->mismatches();
+    return summary;
+  });
+}
+
+signature_summary
+sign_qcow2(int fd_in, int fd_out, const signature_options& options)
+{
+  if (!options.fd_mirrors.empty()) {
+    throw std::invalid_argument("mirrors aren't supported for qcow2 images");
+  }
+
+  if (options.allocation) {
+    throw std::invalid_argument("qcow2 images bring their own allocation");
+  }
+
+  if (!is_seekable(fd_in)) {
+    throw std::invalid_argument("qcow2 images should be seekable");
+  }
+
+  auto source = std::make_shared<qcow2_source>(fd_in);
+  auto qcow2_options = options;
+
+  // Parity and packs need the zeros themselves.
+  if (options.fd_parity == -1 && !options.pack) {
+    qcow2_options.allocation = source->allocation();
+  }
+
+  return sign_source(std::move(source), fd_out, qcow2_options);
+}
+
+}
+
+signature_summary
+generate_signature(int fd_in, int fd_out, const signature_options& options)
+{
+  if (options.format == input_format::qcow2) {
+    return sign_qcow2(fd_in, fd_out, options);
+  }
+
+  if (!options.fd_mirrors.empty()) {
+    return sign_mirrored(fd_in, fd_out, options);
+  }
+
+  return with_source(fd_in, options.io, [&](auto source) {
+    return sign_source(std::move(source), fd_out, options);
+  });
+}
+
+verify_result
+verify_signature(int fd_in,
+                 int fd_signature,
+                 const signature_options& options,
+                 const verify_options& verify)
+{
+  if (options.format == input_format::qcow2) {
+    return verify_source(
+      std::make_shared<qcow2_source>(fd_in), fd_signature, options, verify);
+  }
+
+  return with_source(fd_in, options.io, [&](auto source) {
+    return verify_source(std::move(source), fd_signature, options, verify);
+  });
+}
+
+signature_summary
+generate_signature(const char* data,
+                   std::size_t size,
+                   int fd_out,
+                   const signature_options& options)
+{
+  return sign_source(
+    std::make_shared<memory_source>(data, size), fd_out, options);
+}
+
+signature_summary
+generate_signature(const std::vector<int>& fds_in,
+                   int fd_out,
+                   const signature_options& options)
+{
+  if (fds_in.size() == 1) {
+    return generate_signature(fds_in[0], fd_out, options);
+  }
+
+  if (!options.fd_mirrors.empty()) {
+    throw std::invalid_argument(
+      "mirrors aren't supported for multi-part inputs");
+  }
+
+  if (options.format != input_format::raw) {
+    throw std::invalid_argument("only raw inputs can have several parts");
+  }
+
+  return with_seekable_type(fds_in, options.io, [&](auto type) {
+    typedef typename decltype(type)::type Part;
+
+    std::vector<std::shared_ptr<Part>> parts;
+
+    for (auto fd : fds_in) {
+      parts.push_back(std::make_shared<Part>(fd));
+    }
+
+    return sign_source(
+      std::make_shared<concat_source<Part>>(std::move(parts)), fd_out, options);
+  });
+}
+
+signature_summary
+generate_signature(std::shared_ptr<simulated_device> device,
+                   int fd_out,
+                   const signature_options& options)
+{
+  return sign_source(
+    std::make_shared<simulated_source>(std::move(device)), fd_out, options);
+}
+
+signature_summary
+generate_signature(std::shared_ptr<const http_object> object,
+                   int fd_out,
+                   const signature_options& options)
+{
+  if (options.format != input_format::raw || !options.fd_mirrors.empty()) {
+    throw std::invalid_argument(
+      "inputs read over HTTP can't have mirrors or another format");
+  }
+
+  return sign_source(
+    std::make_shared<http_source>(std::move(object)), fd_out, options);
+}
+
+signature_summary
+generate_signature(int fd_in,
+                   const std::vector<block_range>& runs,
+                   int fd_out,
+                   const signature_options& options)
+{
+  if (options.format != input_format::raw || !options.fd_mirrors.empty() ||
+      options.allocation) {
+    throw std::invalid_argument(
+      "only raw inputs can be signed in runs of blocks");
+  }
+
+  // Only the last block of the input may be short, so that the others
+  // keep their boundaries.
+  unsigned_off_t input_size = fd_size(fd_in);
+  unsigned_off_t block_size = options.block_size;
+  gather_source<pread_source>::range_list ranges;
+
+  for (auto& run : runs) {
+    auto offset = run.first * block_size;
+
+    if (offset >= input_size) {
+      throw std::out_of_range("blocks past the end of the input");
+    }
+
+    if (!ranges.empty() &&
+        (ranges.back().first + ranges.back().second > offset ||
+         ranges.back().first + ranges.back().second == input_size)) {
+      throw std::invalid_argument("runs of blocks should be in order");
+    }
+
+    ranges.emplace_back(
+      offset, std::min(run.count * block_size, input_size - offset));
+  }
+
+  return with_seekable_type({ fd_in }, options.io, [&](auto type) {
+    typedef typename decltype(type)::type Part;
+
+    return sign_source(std::make_shared<gather_source<Part>>(
+                         std::make_shared<Part>(fd_in), ranges),
+                       fd_out,
+                       options);
+  });
+}
+
+io_method
+parse_io_method(const std::string& name)
+{
+  if (name == "pread") {
+    return io_method::pread;
+  } else if (name == "mmap") {
+    return io_method::mmap;
+  } else if (name == "io_uring") {
+    return io_method::uring;
+  } else if (name == "direct") {
+    return io_method::direct;
+  } else if (name == "memory") {
+    return io_method::memory;
+  } else if (name == "stream") {
+    return io_method::stream;
+  }
+
+  throw std::invalid_argument("unknown I/O method '" + name + "'");
+}
+
+input_format
+parse_input_format(const std::string& name)
+{
+  if (name == "raw") {
+    return input_format::raw;
+  } else if (name == "qcow2") {
+    return input_format::qcow2;
+  }
+
+  throw std::invalid_argument("unknown input format '" + name + "'");
+}
+
+thread_placement
+parse_thread_placement(const std::string& name)
+{
+  if (name == "none") {
+    return thread_placement::none;
+  } else if (name == "cores") {
+    return thread_placement::cores;
+  }
+
+  throw std::invalid_argument("unknown thread placement '" + name + "'");
+}
+
+namespace {
+
+// Saved state: magic, version, block size, bytes left in the current block,
+// blocks written out, bytes ingested, CRC register of the current block, and
+// the CRC-32 of all that, each little-endian.
+const std::uint32_t state_magic = 0x53435243; // "CRCS"
+const std::uint32_t state_version = 1;
+const std::size_t state_size = 4 + 4 + 8 + 8 + 8 + 8 + 4 + 4;
+
+void
+put_le(std::string& out, std::uint64_t value, unsigned int bytes)
+{
+  for (unsigned int i = 0; i < bytes; i++) {
+    out.push_back(char(value >> (8 * i)));
+  }
+}
+
+std::uint64_t
+get_le(const std::string& in, std::size_t& position, unsigned int bytes)
+{
+  std::uint64_t value = 0;
+
+  for (unsigned int i = 0; i < bytes; i++) {
+    value |= std::uint64_t(static_cast<unsigned char>(in[position++]))
+             << (8 * i);
+  }
+
+  return value;
+}
+
+checksum_type
+state_checksum(const char* data, std::size_t size)
+{
+  checksum_algo csum;
+  csum.process_bytes(data, size);
+  return csum.checksum();
+}
+
+}
+
+class streaming_signer::impl
+{
+public:
+  impl(int fd_out, std::size_t block_size)
+    : fd_out(fd_out)
+    , signer(block_size)
+  {}
+
+  void flush();
+
+  const int fd_out;
+  signature signer;
+  std::uint64_t emitted = 0;
+  std::uint64_t ingested = 0;
+  bool finished = false;
+};
+
+void
+streaming_signer::impl::flush()
+{
+  signer.dump_to_file(fd_out, emitted * checksum_size);
+  emitted += signer.take_output();
+}
+
+streaming_signer::streaming_signer(int fd_out, std::size_t block_size)
+{
+  if (block_size <= 0) {
+    throw std::invalid_argument("block_size should be positive");
+  }
+
+  pimpl = std::make_unique<impl>(fd_out, block_size);
+}
+
+streaming_signer::streaming_signer(int fd_out, const std::string& state)
+{
+  if (state.size() != state_size) {
+    throw std::invalid_argument("corrupted signer state");
+  }
+
+  std::size_t position = state_size - 4;
+
+  if (get_le(state, position, 4) !=
+      state_checksum(state.data(), state_size - 4)) {
+    throw std::invalid_argument("corrupted signer state");
+  }
+
+  position = 0;
+
+  if (get_le(state, position, 4) != state_magic ||
+      get_le(state, position, 4) != state_version) {
+    throw std::invalid_argument("unsupported signer state");
+  }
+
+  auto block_size = get_le(state, position, 8);
+  auto remaining = get_le(state, position, 8);
+
+  if (block_size == 0 ||
+      block_size > std::numeric_limits<std::size_t>::max() || remaining == 0 ||
+      remaining > block_size) {
+    throw std::invalid_argument("corrupted signer state");
+  }
+
+  pimpl = std::make_unique<impl>(fd_out, block_size);
+  pimpl->emitted = get_le(state, position, 8);
+  pimpl->ingested = get_le(state, position, 8);
+  pimpl->signer.restore_block(get_le(state, position, 4), remaining);
+}
+
+streaming_signer::~streaming_signer() = default;
+
+void
+streaming_signer::push(const char* data, std::size_t size)
+{
+  if (pimpl->finished) {
+    throw std::logic_error("push() after finish()");
+  }
+
+  pimpl->signer.push(data, size);
+  pimpl->ingested += size;
+  pimpl->flush();
+}
+
+void
+streaming_signer::finish()
+{
+  if (pimpl->finished) {
+    return;
+  }
+
+  pimpl->signer.complete_block();
+  pimpl->flush();
+  pimpl->finished = true;
+
+  // Drops whatever a previous incarnation wrote after its state was saved.
+  if (ftruncate(pimpl->fd_out, pimpl->emitted * checksum_size) != 0) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+}
+
+std::string
+streaming_signer::save() const
+{
+  std::string state;
+  state.reserve(state_size);
+
+  put_le(state, state_magic, 4);
+  put_le(state, state_version, 4);
+  put_le(state, pimpl->signer.block_size, 8);
+  put_le(state, pimpl->signer.block_left(), 8);
+  put_le(state, pimpl->emitted, 8);
+  put_le(state, pimpl->ingested, 8);
+  put_le(state, pimpl->signer.block_register(), 4);
+  put_le(state, state_checksum(state.data(), state.size()), 4);
+
+  return state;
+}
+
+std::uint64_t
+streaming_signer::ingested() const
+{
+  return pimpl->ingested;
+}
+
+std::uint64_t
+streaming_signer::blocks_emitted() const
+{
+  return pimpl->emitted;
 }
@@ -1,5 +1,237 @@
 #pragma once
 
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
+#include "diff.h"
+#include "heatmap.h"
+
+class allocation_map;
+class block_pack;
+class http_object;
+class signing_metrics;
+class simulated_device;
+
+// How the input is read; see io_source.h.
+enum class io_method
+{
+  pread,
+  mmap,
+  uring,
+  direct,
+  memory,
+  stream
+};
+
+io_method
+parse_io_method(const std::string& name);
+
+// What the input holds.
+enum class input_format
+{
+  raw,
+  qcow2
+};
+
+input_format
+parse_input_format(const std::string& name);
+
+// Where the workers run.
+enum class thread_placement
+{
+  // Wherever the scheduler puts them.
+  none,
+
+  // Each pinned to a CPU: one per physical core before any goes to an SMT
+  // sibling, so that two workers only share a core when there are more of
+  // them than cores, and spread over the L3 caches. The workers under an L3
+  // start on neighbouring claims, in a region of the input of their own.
+  cores
+};
+
+thread_placement
+parse_thread_placement(const std::string& name);
+
+struct signature_options
+{
+  std::size_t block_size = 1024 * 1024;
+  unsigned int concurrency = 1;
+
+  // Inputs that can't be seeked are always read as a stream, and io_uring
+  // falls back to pread where the kernel doesn't allow it.
+  io_method io = io_method::pread;
+
+  // qcow2 inputs are signed as the virtual disk they hold, as if converted
+  // to raw, and are always read with pread. Their zero and unallocated
+  // clusters aren't read unless parity or a pack needs them. See qcow2.h.
+  input_format format = input_format::raw;
+
+  // Once all claims are handed out, idle workers re-issue the reads of claims
+  // running twice as long as this percentile of the completed ones (and at
+  // least 50 ms). Zero disables re-issuing.
+  double straggler_percentile = 99;
+
+  // Only applies to inputs that are seekable and don't fit in a single read.
+  thread_placement placement = thread_placement::none;
+
+  // Also compute the CRC-32 of the whole input, by combining the block
+  // checksums rather than reading the data again.
+  bool file_digest = false;
+
+  // Record how long every read took, and summarize it over this many
+  // regions of the input. Zero disables recording.
+  unsigned int heatmap_bins = 0;
+
+  // If set, also write an estimate of how well each block compresses: the
+  // entropy of a sample of its bytes in bits per byte, as a native float, at
+  // the same index as the block's checksum.
+  int fd_entropy = -1;
+
+  // If set, also copy the input there, at the same offsets, as it is read.
+  // It has to be seekable, and is resized to the input size if the input
+  // is seekable too.
+  int fd_copy = -1;
+
+  // If set, also write erasure-coding parity there: parity_count blocks for
+  // every parity_group blocks of input, from which as many corrupted blocks
+  // of the group can be rebuilt. See parity.h.
+  int fd_parity = -1;
+  unsigned int parity_group = 8;
+  unsigned int parity_count = 1;
+
+  // If set, blocks that aren't in the pack yet are appended to it as they
+  // are read, and fd_recipe, if set, receives where every block of the
+  // input is in the pack, at the same index as its checksum. See pack.h.
+  std::shared_ptr<block_pack> pack;
+  int fd_recipe = -1;
+
+  // Other copies of the input, asserted identical to it, e.g. on other
+  // devices: the workers are spread over all of them. Only for a single,
+  // seekable input.
+  std::vector<int> fd_mirrors;
+
+  // Also read every block from a second copy and compare them.
+  bool mirror_cross_check = false;
+
+  // If set, blocks in which the input has nothing allocated aren't read:
+  // their checksums are those of zeroed blocks, as if the free space of its
+  // filesystem had been cleared, and their entropy is zero. A copy gets
+  // holes there. Can't be combined with parity or a pack. See allocation.h.
+  std::shared_ptr<const allocation_map> allocation;
+
+  // Counters to update while signing, for an exporter to publish; see
+  // metrics.h. Should have at least as many workers as the concurrency.
+  std::shared_ptr<signing_metrics> metrics;
+};
+
+struct signature_summary
+{
+  std::uint32_t file_digest = 0;
+  std::vector<heatmap_bin> heatmap;
+
+  // Blocks that differ between copies, if cross-checked, in order. Their
+  // checksums are of whichever copy was read first.
+  std::vector<std::uint64_t> mirror_mismatches;
+};
+
+signature_summary generate_signature(int fd_in, int fd_out, const signature_options& options);
 void generate_signature(int fd_in, int fd_out, std::size_t block_size, unsigned int concurrency);
+
+// The data has to stay alive until the call returns.
+signature_summary generate_signature(const char* data, std::size_t size, int fd_out, const signature_options& options);
+
+// Signs the concatenation of the inputs, which have to be seekable.
+signature_summary generate_signature(const std::vector<int>& fds_in, int fd_out, const signature_options& options);
+
+signature_summary generate_signature(std::shared_ptr<simulated_device> device, int fd_out, const signature_options& options);
+
+// Reads the input over HTTP; see http.h. Only raw inputs are supported.
+signature_summary generate_signature(std::shared_ptr<const http_object> object, int fd_out, const signature_options& options);
+
+// Signs only these runs of blocks of the input, which has to be seekable, as
+// if they were all of it: the checksum of the n-th block of the runs is
+// written at index n. The runs should be in order, and not overlap. Only
+// raw inputs without mirrors or an allocation map are supported.
+signature_summary generate_signature(int fd_in, const std::vector<block_range>& runs, int fd_out, const signature_options& options);
+
+struct verify_options
+{
+  // Fraction of the input to check, picked at random.
+  double coverage = 1;
+
+  // Stop checking after this long, zero for no limit. The sample is checked
+  // in passes, and the bound only counts the passes that were completed.
+  std::chrono::milliseconds time_budget{ 0 };
+
+  // Picks the same sample for the same seed.
+  std::uint64_t seed = 0;
+
+  // Of the bound on the fraction of corrupted runs of blocks.
+  double confidence = 0.95;
+};
+
+struct verify_result
+{
+  std::uint64_t blocks_total = 0;
+  std::uint64_t blocks_checked = 0;
+
+  // Indexes of the checked blocks that don't match the signature.
+  std::vector<std::uint64_t> bad_blocks;
+
+  // Blocks are sampled in runs of this many consecutive ones, the last run
+  // possibly shorter, for reads as large as when signing.
+  std::uint64_t run_blocks = 1;
+  std::uint64_t runs_total = 0;
+
+  // With the requested confidence, at most this fraction of all the runs
+  // has a corrupted block in it. It is a bound on corrupted blocks only
+  // when runs are single blocks.
+  double corrupted_bound = 1;
+
+  std::chrono::milliseconds elapsed{ 0 };
+};
+
+// Checks a random sample of the input's blocks against an existing signature,
+// made with the same block size. Only block_size, concurrency and io of the
+// options are used.
+verify_result verify_signature(int fd_in, int fd_signature, const signature_options& options, const verify_options& verify);
+
+// Signs data handed to it piece by piece, as it arrives, writing out the
+// checksum of every block as soon as it completes. Its state can be saved
+// and restored, so that signing resumes after a restart without the data
+// ingested so far being read again.
+class streaming_signer
+{
+public:
+  streaming_signer(int fd_out, std::size_t block_size);
+
+  // Continues from a state returned by save(). fd_out should be the output
+  // the saved signer wrote to, and the next push() should continue from
+  // ingested() bytes into the input.
+  streaming_signer(int fd_out, const std::string& state);
+
+  ~streaming_signer();
+
+  streaming_signer(const streaming_signer&) = delete;
+  streaming_signer& operator=(const streaming_signer&) = delete;
+
+  void push(const char* data, std::size_t size);
+
+  // Writes out the checksum of the last, partial block. Nothing can be
+  // pushed afterwards.
+  void finish();
+
+  // A compact, portable blob describing the signer's progress.
+  std::string save() const;
+
+  std::uint64_t ingested() const;
+  std::uint64_t blocks_emitted() const;
+
+private:
+  class impl;
+  std::unique_ptr<impl> pimpl;
+};
@@ -0,0 +1,315 @@
+#include "simulated_device.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const double pi = 3.14159265358979323846;
+
+std::uint64_t
+splitmix64(std::uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// Uniform in (0, 1].
+double
+unit_interval(std::uint64_t x)
+{
+  return double((x >> 11) + 1) / double(std::uint64_t(1) << 53);
+}
+
+std::invalid_argument
+bad_spec(const std::string& what)
+{
+  return std::invalid_argument("simulated device: " + what);
+}
+
+std::uint64_t
+parse_size(const std::string& value)
+{
+  std::istringstream stream(value);
+  std::uint64_t number;
+  std::string suffix;
+
+  if (!(stream >> number)) {
+    throw bad_spec("bad size '" + value + "'");
+  }
+  stream >> suffix;
+
+  if (suffix.empty()) {
+    return number;
+  } else if (suffix == "k" || suffix == "K") {
+    return number << 10;
+  } else if (suffix == "m" || suffix == "M") {
+    return number << 20;
+  } else if (suffix == "g" || suffix == "G") {
+    return number << 30;
+  } else if (suffix == "t" || suffix == "T") {
+    return number << 40;
+  }
+
+  throw bad_spec("bad size '" + value + "'");
+}
+
+std::chrono::nanoseconds
+parse_duration(const std::string& value)
+{
+  std::istringstream stream(value);
+  double number;
+  std::string unit;
+
+  if (!(stream >> number) || number < 0) {
+    throw bad_spec("bad duration '" + value + "'");
+  }
+  stream >> unit;
+
+  double scale;
+  if (unit == "ns") {
+    scale = 1;
+  } else if (unit == "us") {
+    scale = 1e3;
+  } else if (unit == "ms") {
+    scale = 1e6;
+  } else if (unit == "s" || unit.empty()) {
+    scale = 1e9;
+  } else {
+    throw bad_spec("bad duration '" + value + "'");
+  }
+
+  return std::chrono::nanoseconds(std::int64_t(number * scale));
+}
+
+double
+parse_number(const std::string& value)
+{
+  std::istringstream stream(value);
+  double number;
+
+  if (!(stream >> number) || !stream.eof()) {
+    throw bad_spec("bad number '" + value + "'");
+  }
+
+  return number;
+}
+
+std::vector<std::string>
+split(const std::string& value, char separator)
+{
+  std::vector<std::string> parts;
+  std::istringstream stream(value);
+  std::string part;
+
+  while (std::getline(stream, part, separator)) {
+    parts.push_back(part);
+  }
+
+  return parts;
+}
+
+void
+parse_latency(const std::string& value, simulated_device_params& params)
+{
+  auto parts = split(value, ':');
+
+  if (parts.size() == 2 && parts[0] == "fixed") {
+    params.latency_distribution = simulated_device_params::fixed_latency;
+    params.latency = parse_duration(parts[1]);
+  } else if (parts.size() == 3 && parts[0] == "uniform") {
+    params.latency_distribution = simulated_device_params::uniform_latency;
+    params.latency = parse_duration(parts[1]);
+    params.latency_max = parse_duration(parts[2]);
+  } else if (parts.size() == 2 && parts[0] == "exp") {
+    params.latency_distribution = simulated_device_params::exponential_latency;
+    params.latency = parse_duration(parts[1]);
+  } else if (parts.size() == 3 && parts[0] == "lognormal") {
+    params.latency_distribution = simulated_device_params::lognormal_latency;
+    params.latency = parse_duration(parts[1]);
+    params.latency_sigma = parse_number(parts[2]);
+  } else {
+    throw bad_spec("bad latency '" + value + "'");
+  }
+}
+
+}
+
+simulated_device_params
+parse_simulated_device(const std::string& spec)
+{
+  simulated_device_params params;
+
+  for (const auto& item : split(spec, ',')) {
+    auto eq = item.find('=');
+    if (eq == std::string::npos) {
+      throw bad_spec("expected key=value, got '" + item + "'");
+    }
+
+    auto key = item.substr(0, eq);
+    auto value = item.substr(eq + 1);
+
+    if (key == "size") {
+      params.size = parse_size(value);
+    } else if (key == "seed") {
+      params.seed = parse_size(value);
+    } else if (key == "latency") {
+      parse_latency(value, params);
+    } else if (key == "stall") {
+      auto parts = split(value, ':');
+      if (parts.size() != 2) {
+        throw bad_spec("bad stall '" + value + "'");
+      }
+      params.stall_probability = parse_number(parts[0]);
+      params.stall = parse_duration(parts[1]);
+    } else if (key == "bandwidth") {
+      params.bandwidth = parse_size(value);
+    } else if (key == "queue-depth") {
+      params.queue_depth = parse_size(value);
+    } else if (key == "seek") {
+      params.seek = parse_duration(value);
+    } else {
+      throw bad_spec("unknown key '" + key + "'");
+    }
+  }
+
+  return params;
+}
+
+simulated_device::simulated_device(const simulated_device_params& params)
+  : params(params)
+  , head_free(clock_type::now())
+  , bus_free(head_free)
+{}
+
+void
+simulated_device::fill(std::uint64_t seed,
+                       char* buffer,
+                       std::size_t count,
+                       std::uint64_t offset)
+{
+  while (count) {
+    auto word = splitmix64(seed ^ splitmix64(offset / 8));
+    unsigned char bytes[8];
+
+    for (unsigned int i = 0; i < 8; i++) {
+      bytes[i] = word >> (8 * i);
+    }
+
+    auto skip = offset % 8;
+    auto chunk = std::min<std::size_t>(8 - skip, count);
+    std::memcpy(buffer, bytes + skip, chunk);
+
+    buffer += chunk;
+    offset += chunk;
+    count -= chunk;
+  }
+}
+
+// Depends only on the request, so that the same reads see the same
+// latencies whatever order the workers issue them in.
+std::chrono::nanoseconds
+simulated_device::sample_latency(std::uint64_t offset,
+                                 std::size_t count,
+                                 bool& stalled) const
+{
+  auto state = splitmix64(params.seed ^ splitmix64(offset) ^ count);
+  auto u1 = unit_interval(state = splitmix64(state));
+  auto u2 = unit_interval(state = splitmix64(state));
+  auto u3 = unit_interval(splitmix64(state));
+
+  double ns = 0;
+  double base = params.latency.count();
+
+  switch (params.latency_distribution) {
+    case simulated_device_params::no_latency:
+      break;
+
+    case simulated_device_params::fixed_latency:
+      ns = base;
+      break;
+
+    case simulated_device_params::uniform_latency:
+      ns = base + (params.latency_max.count() - base) * u1;
+      break;
+
+    case simulated_device_params::exponential_latency:
+      ns = -base * std::log(u1);
+      break;
+
+    case simulated_device_params::lognormal_latency: {
+      auto normal = std::sqrt(-2 * std::log(u1)) * std::cos(2 * pi * u2);
+      ns = base * std::exp(params.latency_sigma * normal);
+      break;
+    }
+  }
+
+  stalled = u3 <= params.stall_probability;
+
+  return std::chrono::nanoseconds(std::int64_t(ns));
+}
+
+std::size_t
+simulated_device::pread(char* buffer, std::size_t count, off_t offset)
+{
+  std::uint64_t position = offset;
+
+  if (position >= params.size) {
+    return 0;
+  }
+  count = std::min<std::uint64_t>(count, params.size - position);
+
+  bool stalled;
+  auto latency = sample_latency(position, count, stalled);
+  clock_type::time_point done;
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Stalls are transient: reading the same place again goes through.
+    if (stalled && stalled_reads.insert(position).second) {
+      latency += params.stall;
+    }
+
+    queue_slot.wait(lock, [this]() {
+      return params.queue_depth == 0 || in_flight < params.queue_depth;
+    });
+    in_flight++;
+
+    // Positioning is serialized on the head, and bandwidth is reserved on
+    // the bus in issue order; latency overlaps between queued requests.
+    auto now = clock_type::now();
+    auto positioned = std::max(now, head_free);
+    if (position != head) {
+      positioned += params.seek;
+    }
+    head_free = positioned;
+    head = position + count;
+
+    bus_free = std::max(now, bus_free);
+    if (params.bandwidth) {
+      bus_free += std::chrono::nanoseconds(count * 1000000000 /
+                                           params.bandwidth);
+    }
+
+    done = std::max(positioned + latency, bus_free);
+  }
+
+  fill(params.seed, buffer, count, position);
+  std::this_thread::sleep_until(done);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight--;
+  }
+  queue_slot.notify_one();
+
+  return count;
+}
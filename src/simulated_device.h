@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <sys/types.h>
+
+// A model of a storage device for benchmarking the scheduler: it serves
+// deterministic pseudo-random data, and delays every read according to the
+// configured latency distribution, bandwidth, queue depth and seek penalty.
+struct simulated_device_params
+{
+  enum distribution
+  {
+    no_latency,
+    fixed_latency,
+    uniform_latency,
+    exponential_latency,
+    lognormal_latency
+  };
+
+  std::uint64_t size = 0;
+  std::uint64_t seed = 0;
+
+  // fixed: latency; uniform: [latency, latency_max]; exponential: mean
+  // latency; lognormal: median latency, latency_sigma.
+  distribution latency_distribution = no_latency;
+  std::chrono::nanoseconds latency{ 0 };
+  std::chrono::nanoseconds latency_max{ 0 };
+  double latency_sigma = 0;
+
+  // Occasional stalls on top of the latency distribution. Only the first
+  // read of a given offset can stall.
+  double stall_probability = 0;
+  std::chrono::nanoseconds stall{ 0 };
+
+  // Bytes per second, zero for unlimited.
+  std::uint64_t bandwidth = 0;
+
+  // Requests served at the same time, zero for unlimited.
+  unsigned int queue_depth = 0;
+
+  // Charged whenever a read does not start where the previous one ended.
+  std::chrono::nanoseconds seek{ 0 };
+};
+
+// Parses a comma-separated list of key=value pairs, e.g.
+// "size=4G,latency=exp:2ms,stall=0.001:2s,bandwidth=150M,queue-depth=1,seek=8ms".
+simulated_device_params
+parse_simulated_device(const std::string& spec);
+
+class simulated_device
+{
+public:
+  explicit simulated_device(const simulated_device_params& params);
+
+  std::uint64_t size() const { return params.size; }
+  std::size_t pread(char* buffer, std::size_t count, off_t offset);
+
+  // The data the device serves, independent of how it is read.
+  static void fill(std::uint64_t seed,
+                   char* buffer,
+                   std::size_t count,
+                   std::uint64_t offset);
+
+private:
+  typedef std::chrono::steady_clock clock_type;
+
+  std::chrono::nanoseconds sample_latency(std::uint64_t offset,
+                                          std::size_t count,
+                                          bool& stalled) const;
+
+  const simulated_device_params params;
+
+  std::mutex mutex;
+  std::condition_variable queue_slot;
+  unsigned int in_flight = 0;
+  std::uint64_t head = 0;
+  std::set<std::uint64_t> stalled_reads;
+  clock_type::time_point head_free;
+  clock_type::time_point bus_free;
+};
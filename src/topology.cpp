@@ -0,0 +1,153 @@
+#include "topology.h"
+
+#include <cerrno>
+#include <fstream>
+#include <map>
+#include <system_error>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+
+// The first line of a sysfs attribute, or an empty string if there is no
+// such attribute.
+std::string
+read_attribute(const std::string& path)
+{
+  std::ifstream stream(path);
+  std::string line;
+
+  std::getline(stream, line);
+  return line;
+}
+
+// The CPUs sharing the L3 cache of this one, as a list like "0-7,16-23", or
+// its package if it has no L3.
+std::string
+cache_key(const std::string& cpu_path)
+{
+  for (unsigned int index = 0;; index++) {
+    auto cache_path = cpu_path + "/cache/index" + std::to_string(index);
+    auto level = read_attribute(cache_path + "/level");
+
+    if (level.empty()) {
+      break;
+    }
+
+    if (level == "3") {
+      return read_attribute(cache_path + "/shared_cpu_list");
+    }
+  }
+
+  return "package " +
+         read_attribute(cpu_path + "/topology/physical_package_id");
+}
+
+}
+
+cpu_topology::cpu_topology(const std::string& sysfs)
+{
+  cpu_set_t allowed;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    throw std::system_error(
+      errno, std::generic_category(), "sched_getaffinity");
+  }
+
+  std::map<std::string, std::size_t> cache_index;
+  std::vector<std::map<std::string, std::size_t>> core_index;
+
+  for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+
+    auto cpu_path = sysfs + "/cpu" + std::to_string(cpu);
+    auto core = read_attribute(cpu_path + "/topology/thread_siblings_list");
+
+    // Without a topology, every CPU counts as a core of its own.
+    if (core.empty()) {
+      core = std::to_string(cpu);
+    }
+
+    auto cache = cache_index.emplace(cache_key(cpu_path), caches.size());
+    if (cache.second) {
+      caches.emplace_back();
+      core_index.emplace_back();
+    }
+
+    auto& cores = caches[cache.first->second];
+    auto found = core_index[cache.first->second].emplace(core, cores.size());
+    if (found.second) {
+      cores.emplace_back();
+    }
+
+    cores[found.first->second].push_back(cpu);
+  }
+}
+
+std::vector<worker_place>
+cpu_topology::place(unsigned int count) const
+{
+  std::vector<worker_place> order;
+
+  for (std::size_t thread = 0;; thread++) {
+    auto placed = order.size();
+
+    for (std::size_t core = 0;; core++) {
+      bool more_cores = false;
+
+      for (std::size_t cache = 0; cache < caches.size(); cache++) {
+        if (core >= caches[cache].size()) {
+          continue;
+        }
+
+        more_cores = true;
+
+        if (thread < caches[cache][core].size()) {
+          order.push_back({ caches[cache][core][thread],
+                            static_cast<unsigned int>(cache) });
+        }
+      }
+
+      if (!more_cores) {
+        break;
+      }
+    }
+
+    if (order.size() == placed) {
+      break;
+    }
+  }
+
+  std::vector<worker_place> places;
+
+  if (order.empty()) {
+    return places;
+  }
+
+  // Number the caches that end up used consecutively.
+  std::map<unsigned int, unsigned int> groups;
+
+  for (unsigned int i = 0; i < count; i++) {
+    auto place = order[i % order.size()];
+    auto group = groups.emplace(place.cache_group, groups.size());
+
+    place.cache_group = group.first->second;
+    places.push_back(place);
+  }
+
+  return places;
+}
+
+bool
+pin_current_thread(unsigned int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Where a worker runs: a CPU, and which of the last-level caches in use it
+// is under, numbered from zero.
+struct worker_place
+{
+  unsigned int cpu;
+  unsigned int cache_group;
+};
+
+// The CPUs this process may run on, as sysfs describes them: which ones are
+// SMT siblings of the same physical core, and which cores share an L3 cache
+// (or, without one, a package).
+class cpu_topology
+{
+public:
+  explicit cpu_topology(const std::string& sysfs = "/sys/devices/system/cpu");
+
+  // Places `count` workers: on the first thread of every physical core, in
+  // turn between the caches, before any SMT sibling, and around again if
+  // there are more workers than CPUs.
+  std::vector<worker_place> place(unsigned int count) const;
+
+private:
+  // CPU numbers, by core, by cache, in the order their lowest CPUs come.
+  std::vector<std::vector<std::vector<unsigned int>>> caches;
+};
+
+// Restricts the calling thread to one CPU. Returns false if the kernel
+// refused, e.g. because the CPU went offline in the meantime.
+bool
+pin_current_thread(unsigned int cpu);
@@ -0,0 +1,252 @@
+#include "uring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if SIGNATURE_HAVE_IO_URING
+
+namespace {
+
+template<typename T>
+T*
+ring_field(void* ring, unsigned int offset)
+{
+  return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+void*
+map_ring(int fd, std::size_t size, off_t offset)
+{
+  auto ring = mmap(nullptr,
+                   size,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,
+                   fd,
+                   offset);
+
+  if (ring == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), "mmap io_uring");
+  }
+
+  return ring;
+}
+
+}
+
+uring::uring(unsigned int entries)
+{
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+  }
+
+  try {
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = map_ring(ring_fd, sq_ring_size, IORING_OFF_SQ_RING);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring = sq_ring;
+    } else {
+      cq_ring = map_ring(ring_fd, cq_ring_size, IORING_OFF_CQ_RING);
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(
+      map_ring(ring_fd, sqes_size, IORING_OFF_SQES));
+  } catch (...) {
+    unmap();
+    close(ring_fd);
+    throw;
+  }
+
+  sq_head = ring_field<unsigned int>(sq_ring, params.sq_off.head);
+  sq_tail = ring_field<unsigned int>(sq_ring, params.sq_off.tail);
+  sq_mask = *ring_field<unsigned int>(sq_ring, params.sq_off.ring_mask);
+  sq_entries = params.sq_entries;
+  sq_array = ring_field<unsigned int>(sq_ring, params.sq_off.array);
+
+  cq_head = ring_field<unsigned int>(cq_ring, params.cq_off.head);
+  cq_tail = ring_field<unsigned int>(cq_ring, params.cq_off.tail);
+  cq_mask = *ring_field<unsigned int>(cq_ring, params.cq_off.ring_mask);
+  cqes = ring_field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+}
+
+uring::~uring()
+{
+  unmap();
+  close(ring_fd);
+}
+
+void
+uring::unmap()
+{
+  if (sqes) {
+    munmap(sqes, sqes_size);
+  }
+
+  if (cq_ring && cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+
+  if (sq_ring) {
+    munmap(sq_ring, sq_ring_size);
+  }
+}
+
+bool
+uring::supported()
+{
+  static const bool result = []() {
+    try {
+      uring probe(1);
+      return true;
+    } catch (const std::system_error&) {
+      return false;
+    }
+  }();
+
+  return result;
+}
+
+io_uring_sqe*
+uring::get_sqe()
+{
+  auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  auto tail = *sq_tail + pending;
+
+  if (tail - head >= sq_entries) {
+    return nullptr;
+  }
+
+  auto index = tail & sq_mask;
+  auto sqe = &sqes[index];
+
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  pending++;
+
+  return sqe;
+}
+
+void
+uring::enter(unsigned int wait_nr)
+{
+  __atomic_store_n(sq_tail, *sq_tail + pending, __ATOMIC_RELEASE);
+
+  auto to_submit = pending;
+  pending = 0;
+
+  for (;;) {
+    auto flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    auto result = syscall(
+      __NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, nullptr, 0);
+
+    if (result >= 0) {
+      to_submit -= result;
+
+      if (to_submit == 0) {
+        return;
+      }
+      continue;
+    }
+
+    if (errno != EINTR) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+    }
+  }
+}
+
+void
+uring::register_files(unsigned int count)
+{
+  std::vector<int> fds(count, -1);
+
+  if (syscall(__NR_io_uring_register,
+              ring_fd,
+              IORING_REGISTER_FILES,
+              fds.data(),
+              count) != 0) {
+    throw std::system_error(
+      errno, std::generic_category(), "io_uring_register");
+  }
+}
+
+io_uring_cqe*
+uring::peek()
+{
+  auto head = *cq_head;
+
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+
+  return &cqes[head & cq_mask];
+}
+
+void
+uring::seen()
+{
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#else
+
+uring::uring(unsigned int)
+{
+  throw std::system_error(ENOSYS, std::generic_category(), "io_uring");
+}
+
+uring::~uring() {}
+
+void
+uring::unmap()
+{}
+
+bool
+uring::supported()
+{
+  return false;
+}
+
+io_uring_sqe*
+uring::get_sqe()
+{
+  return nullptr;
+}
+
+void
+uring::enter(unsigned int)
+{}
+
+void
+uring::register_files(unsigned int)
+{}
+
+io_uring_cqe*
+uring::peek()
+{
+  return nullptr;
+}
+
+void
+uring::seen()
+{}
+
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+
+#if __has_include(<linux/io_uring.h>)
+#define SIGNATURE_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#else
+#define SIGNATURE_HAVE_IO_URING 0
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+// A minimal io_uring wrapper over the raw system calls, so that there is no
+// dependency on liburing.
+class uring
+{
+public:
+  explicit uring(unsigned int entries);
+  ~uring();
+
+  uring(const uring&) = delete;
+  uring& operator=(const uring&) = delete;
+
+  // Whether io_uring can be used at all: it may be compiled out, missing
+  // from the kernel or forbidden by a seccomp filter.
+  static bool supported();
+
+  // Returns a zeroed submission queue entry, or nullptr if the queue is
+  // full. Entries are handed to the kernel by the next enter().
+  io_uring_sqe* get_sqe();
+
+  // Submits the pending entries and waits for at least wait_nr completions.
+  void enter(unsigned int wait_nr);
+
+  // Returns the next completion, or nullptr if there is none yet. It has to
+  // be released with seen() before the next call.
+  io_uring_cqe* peek();
+  void seen();
+
+  // Registers a table of `count` empty fixed-file slots, for requests that
+  // install files into it.
+  void register_files(unsigned int count);
+
+  int fd() const { return ring_fd; }
+
+private:
+  void unmap();
+
+  int ring_fd;
+  unsigned int pending = 0;
+
+  void* sq_ring = nullptr;
+  std::size_t sq_ring_size = 0;
+  void* cq_ring = nullptr;
+  std::size_t cq_ring_size = 0;
+  io_uring_sqe* sqes = nullptr;
+  std::size_t sqes_size = 0;
+
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int* sq_array;
+
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int cq_mask;
+  io_uring_cqe* cqes;
+};
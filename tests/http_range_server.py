@@ -0,0 +1,131 @@
+"""A small HTTP/1.1 server for testing --url: serves the files of a directory
+with single-range GET requests and keep-alive, and counts connections and
+requests.
+
+Paths starting with /no-range/ ignore the Range header and return the whole
+file with 200, and paths starting with /close/ close the connection after
+every response. Run directly to serve a directory by hand:
+
+    python3 http_range_server.py DIRECTORY [PORT]
+"""
+
+import http.server
+import os
+import re
+import socketserver
+import sys
+import threading
+
+NO_RANGE = "/no-range/"
+CLOSE = "/close/"
+
+
+class RangeServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+    def __init__(self, root, port=0):
+        super().__init__(("127.0.0.1", port), RangeHandler)
+        self.root = root
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.requests = 0
+
+    def url(self, path):
+        return "http://127.0.0.1:%d/%s" % (self.server_address[1],
+                                           path.lstrip("/"))
+
+    def reset_counts(self):
+        with self.lock:
+            self.connections = 0
+            self.requests = 0
+
+    def counts(self):
+        with self.lock:
+            return self.connections, self.requests
+
+    def handle_error(self, request, client_address):
+        # Clients hang up on bodies they don't want, e.g. a whole file sent
+        # in answer to a range request.
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            super().handle_error(request, client_address)
+
+    def start(self):
+        thread = threading.Thread(target=self.serve_forever, daemon=True)
+        thread.start()
+        return self
+
+
+class RangeHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def setup(self):
+        super().setup()
+        with self.server.lock:
+            self.server.connections += 1
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_GET(self):
+        with self.server.lock:
+            self.server.requests += 1
+
+        path = self.path
+        ignore_range = path.startswith(NO_RANGE)
+        close = path.startswith(CLOSE)
+
+        for prefix in (NO_RANGE, CLOSE):
+            if path.startswith(prefix):
+                path = "/" + path[len(prefix):]
+
+        file_path = os.path.join(self.server.root, path.lstrip("/"))
+        if not os.path.isfile(file_path):
+            self.send_error(404)
+            return
+
+        size = os.path.getsize(file_path)
+        match = re.fullmatch(r"bytes=(\d+)-(\d+)",
+                             self.headers.get("Range", ""))
+
+        if ignore_range or not match:
+            self.send_response(200)
+            self.send_header("Content-Length", str(size))
+            self.end_headers()
+            self.send_file(file_path, 0, size)
+            return
+
+        first, last = int(match.group(1)), int(match.group(2))
+
+        if first >= size:
+            self.send_response(416)
+            self.send_header("Content-Range", "bytes */%d" % size)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+
+        last = min(last, size - 1)
+
+        self.send_response(206)
+        self.send_header("Content-Range",
+                         "bytes %d-%d/%d" % (first, last, size))
+        self.send_header("Content-Length", str(last - first + 1))
+        if close:
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        self.end_headers()
+        self.send_file(file_path, first, last - first + 1)
+
+    def send_file(self, path, offset, length):
+        with open(path, "rb") as f:
+            f.seek(offset)
+            while length:
+                data = f.read(min(length, 1 << 20))
+                self.wfile.write(data)
+                length -= len(data)
+
+
+if __name__ == "__main__":
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8080
+    server = RangeServer(sys.argv[1], port)
+    print("serving %s at %s" % (sys.argv[1], server.url("")))
+    server.serve_forever()
@@ -0,0 +1,200 @@
+// Checks that streaming_signer writes the same signature as
+// generate_signature, however the input is split into pushes, and when it
+// is saved and restored at any point, with work lost after the save.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "signature.h"
+
+namespace {
+
+void
+check(bool condition, const std::string& what)
+{
+  if (!condition) {
+    throw std::runtime_error(what);
+  }
+}
+
+int
+memory_file()
+{
+  int fd = memfd_create("signature", 0);
+
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(), "memfd_create");
+  }
+
+  return fd;
+}
+
+std::string
+contents(int fd)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fstat");
+  }
+
+  std::string data(st.st_size, '\0');
+
+  if (pread(fd, &data[0], data.size(), 0) != ssize_t(data.size())) {
+    throw std::system_error(errno, std::generic_category(), "pread");
+  }
+
+  return data;
+}
+
+std::string
+reference(const std::vector<char>& data, std::size_t block_size)
+{
+  signature_options options;
+  options.block_size = block_size;
+
+  int fd = memory_file();
+  generate_signature(data.data(), data.size(), fd, options);
+
+  auto result = contents(fd);
+  close(fd);
+  return result;
+}
+
+// Pushes data[begin, end) in pieces of random sizes, some larger than a
+// block, some zero.
+void
+push_pieces(streaming_signer& signer,
+            const std::vector<char>& data,
+            std::size_t begin,
+            std::size_t end,
+            std::mt19937& random)
+{
+  while (begin < end) {
+    auto size = std::min<std::size_t>(random() % 10000, end - begin);
+
+    signer.push(data.data() + begin, size);
+    begin += size;
+  }
+}
+
+void
+test_pushes(const std::vector<char>& data, std::size_t block_size)
+{
+  std::mt19937 random(block_size);
+  int fd = memory_file();
+
+  streaming_signer signer(fd, block_size);
+  push_pieces(signer, data, 0, data.size(), random);
+  signer.finish();
+
+  check(signer.ingested() == data.size(), "ingested() is off");
+  check(contents(fd) == reference(data, block_size),
+        "pushes in pieces sign differently");
+  close(fd);
+}
+
+// Saves at `save_at`, pushes on to `lost_up_to` as if the process then
+// died, and resumes from the state.
+void
+test_resume(const std::vector<char>& data,
+            std::size_t block_size,
+            std::size_t save_at,
+            std::size_t lost_up_to)
+{
+  std::mt19937 random(save_at);
+  int fd = memory_file();
+  std::string state;
+
+  {
+    streaming_signer signer(fd, block_size);
+    push_pieces(signer, data, 0, save_at, random);
+    state = signer.save();
+    push_pieces(signer, data, save_at, lost_up_to, random);
+  }
+
+  streaming_signer resumed(fd, state);
+  check(resumed.ingested() == save_at, "resumed at the wrong offset");
+  check(resumed.blocks_emitted() == save_at / block_size,
+        "resumed with the wrong number of blocks");
+
+  push_pieces(resumed, data, resumed.ingested(), data.size(), random);
+  resumed.finish();
+
+  check(contents(fd) == reference(data, block_size),
+        "resuming at " + std::to_string(save_at) + " signs differently");
+  close(fd);
+}
+
+void
+test_corrupted_state()
+{
+  int fd = memory_file();
+  streaming_signer signer(fd, 4096);
+  signer.push("abc", 3);
+
+  auto state = signer.save();
+
+  for (std::size_t i = 0; i < state.size(); i++) {
+    auto damaged = state;
+    damaged[i] ^= 1;
+
+    try {
+      streaming_signer resumed(fd, damaged);
+      check(false, "a damaged state was accepted");
+    } catch (const std::invalid_argument&) {
+    }
+  }
+
+  try {
+    streaming_signer resumed(fd, state.substr(1));
+    check(false, "a truncated state was accepted");
+  } catch (const std::invalid_argument&) {
+  }
+
+  close(fd);
+}
+
+}
+
+int
+main()
+{
+  try {
+    std::vector<char> data(300000);
+    std::mt19937 random(1);
+
+    for (auto& byte : data) {
+      byte = char(random());
+    }
+
+    for (std::size_t block_size : { 1, 4096, 4095, 65536, 1048576 }) {
+      test_pushes(data, block_size);
+    }
+
+    test_pushes({}, 4096);
+
+    for (std::size_t save_at : { 0, 1, 4095, 4096, 4097, 150000, 300000 }) {
+      test_resume(data, 4096, save_at, std::min(save_at + 50000, data.size()));
+    }
+
+    test_resume(data, 1048576, 200000, 300000);
+    test_corrupted_state();
+  } catch (const std::exception& ex) {
+    std::cerr << ex.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+"""Checks the CRC-32 the batch subcommand prints for every file against
+zlib, reading with io_uring and with pread, over many small files and a few
+larger than a single read.
+
+    python3 test_batch.py PATH_TO_SIGNATURE
+"""
+
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import unittest
+import zlib
+
+SIGNATURE = None
+
+# Bytes read by the first request for a file; see batch.cpp.
+CHAIN_READ_SIZE = 64 * 1024
+
+
+def run(*args, **kwargs):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True,
+                          **kwargs)
+
+
+class BatchTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.directory = tempfile.TemporaryDirectory()
+        cls.root = cls.directory.name
+        cls.expected = {}
+
+        rng = random.Random(1)
+        sizes = [0, 1, CHAIN_READ_SIZE - 1, CHAIN_READ_SIZE,
+                 CHAIN_READ_SIZE + 1, 3 * CHAIN_READ_SIZE + 17,
+                 5 * 1024 * 1024 + 3]
+        sizes += [rng.randrange(20000) for _ in range(500)]
+
+        for i, size in enumerate(sizes):
+            subdirectory = os.path.join(cls.root, "tree", "d%d" % (i % 7))
+            os.makedirs(subdirectory, exist_ok=True)
+
+            path = os.path.join(subdirectory, "f%d" % i)
+            data = os.urandom(size)
+
+            with open(path, "wb") as f:
+                f.write(data)
+            cls.expected[path] = zlib.crc32(data)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def parse(self, result):
+        checksums = {}
+
+        for line in result.stdout.splitlines():
+            crc, path = line.split("  ", 1)
+            checksums[path] = int(crc, 16)
+
+        return checksums
+
+    def test_tree(self):
+        for io in ("io_uring", "pread"):
+            for jobs in ("1", "4"):
+                with self.subTest(io=io, jobs=jobs):
+                    result = run("batch", self.path("tree"), "--io", io,
+                                 "-j", jobs)
+
+                    self.assertEqual(result.returncode, 0, result.stderr)
+                    self.assertEqual(self.parse(result), self.expected)
+
+    def test_order(self):
+        paths = sorted(self.expected)[::-1][:50]
+        result = run("batch", *paths, "-j", "3")
+
+        self.assertEqual([line.split("  ", 1)[1]
+                          for line in result.stdout.splitlines()], paths)
+
+    def test_files_from(self):
+        paths = sorted(self.expected)[:100]
+
+        with open(self.path("list"), "w") as f:
+            f.write("\n".join(paths[:60]) + "\n")
+
+        result = run("batch", "--files-from", self.path("list"), *paths[60:])
+        self.assertEqual(self.parse(result),
+                         {path: self.expected[path] for path in paths})
+
+        result = run("batch", "--files-from", "-",
+                     input="\n".join(paths) + "\n")
+        self.assertEqual(self.parse(result),
+                         {path: self.expected[path] for path in paths})
+
+    def test_missing_file(self):
+        paths = sorted(self.expected)[:3]
+        missing = self.path("missing")
+
+        for io in ("io_uring", "pread"):
+            with self.subTest(io=io):
+                result = run("batch", paths[0], missing, *paths[1:],
+                             "--io", io)
+
+                self.assertEqual(result.returncode, 1)
+                self.assertIn(missing + ": No such file or directory",
+                              result.stderr)
+                self.assertEqual(self.parse(result),
+                                 {path: self.expected[path]
+                                  for path in paths})
+
+    def test_other_io_methods(self):
+        result = run("batch", self.path("tree"), "--io", "mmap")
+
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("read with io_uring or pread", result.stderr)
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
@@ -0,0 +1,147 @@
+"""Checks the cache subcommand: that the checksums it prints are those of
+zlib, that it only reads blocks not cached yet, with every I/O method, and
+that it starts over when the input or the block size changes.
+
+    python3 test_cache.py PATH_TO_SIGNATURE
+"""
+
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import unittest
+import zlib
+
+SIGNATURE = None
+
+BLOCK_SIZE = 65536
+
+# Not a multiple of the block size, so that the last block is short.
+DATA_SIZE = 40 * BLOCK_SIZE + 4321
+NUM_BLOCKS = 41
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+class CacheTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+        self.write_data(os.urandom(DATA_SIZE))
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def write_data(self, data, path=None):
+        with open(path or self.path("data"), "wb") as f:
+            f.write(data)
+
+        self.data = data
+
+    def expected(self, blocks, block_size=BLOCK_SIZE):
+        return ["%d %08x" % (block, zlib.crc32(
+            self.data[block * block_size:(block + 1) * block_size]))
+            for block in blocks]
+
+    def lookup(self, blocks, *args, block_size=BLOCK_SIZE):
+        """Looks up the blocks, returning how many were read and how many
+        are now cached."""
+        result = run("cache", self.path("data"),
+                     *("%d-%d" % (b[0], b[-1]) if isinstance(b, range)
+                       else str(b) for b in blocks),
+                     "--block-size", str(block_size), "-j", "3", *args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+
+        flat = [block for b in blocks
+                for block in (b if isinstance(b, range) else [b])]
+        self.assertEqual(result.stdout.splitlines(),
+                         self.expected(flat, block_size))
+
+        match = re.search(r"read (\d+) blocks, (\d+) of (\d+) now cached",
+                          result.stderr)
+        self.assertEqual(int(match.group(3)),
+                         (len(self.data) + block_size - 1) // block_size)
+        return int(match.group(1)), int(match.group(2))
+
+    def test_lazy(self):
+        self.assertEqual(self.lookup([3, range(10, 15), 40]), (7, 7))
+        self.assertEqual(self.lookup([3, 40, 12]), (0, 7))
+        self.assertEqual(self.lookup([range(0, 12)]), (9, 16))
+        self.assertEqual(self.lookup([range(0, NUM_BLOCKS)]),
+                         (NUM_BLOCKS - 16, NUM_BLOCKS))
+        self.assertEqual(self.lookup([range(0, NUM_BLOCKS)]),
+                         (0, NUM_BLOCKS))
+
+    def test_io_methods(self):
+        for io in ("pread", "mmap", "io_uring", "direct", "memory"):
+            with self.subTest(io=io):
+                if os.path.exists(self.path("data.sigcache")):
+                    os.remove(self.path("data.sigcache"))
+
+                self.assertEqual(self.lookup([0, range(5, 9), 40],
+                                             "--io", io), (6, 6))
+
+    def test_modified(self):
+        self.lookup([range(0, 10)])
+
+        data = bytearray(self.data)
+        data[5 * BLOCK_SIZE] ^= 1
+        self.write_data(bytes(data))
+        stat = os.stat(self.path("data"))
+        os.utime(self.path("data"), ns=(stat.st_atime_ns,
+                                        stat.st_mtime_ns + 10 ** 9))
+
+        self.assertEqual(self.lookup([range(0, 10)]), (10, 10))
+
+    def test_resized(self):
+        self.lookup([range(0, 10)])
+        self.write_data(self.data + b"more")
+
+        self.assertEqual(self.lookup([range(0, 10)]), (10, 10))
+
+    def test_replaced(self):
+        self.lookup([range(0, 10)])
+
+        # Same size and modification time, but another inode.
+        stat = os.stat(self.path("data"))
+        self.write_data(os.urandom(DATA_SIZE), self.path("new"))
+        os.utime(self.path("new"), ns=(stat.st_atime_ns, stat.st_mtime_ns))
+        os.rename(self.path("new"), self.path("data"))
+
+        self.assertEqual(self.lookup([range(0, 10)]), (10, 10))
+
+    def test_block_size_changed(self):
+        self.lookup([range(0, 10)])
+
+        self.assertEqual(self.lookup([range(0, 3)], block_size=4096), (3, 3))
+        self.assertEqual(self.lookup([range(0, 10)]), (10, 10))
+
+    def test_past_the_end(self):
+        result = run("cache", self.path("data"), str(NUM_BLOCKS),
+                     "--block-size", str(BLOCK_SIZE))
+
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("block %d is past the end" % NUM_BLOCKS, result.stderr)
+
+    def test_separate_cache(self):
+        result = run("cache", self.path("data"), "1",
+                     "--block-size", str(BLOCK_SIZE),
+                     "--cache", self.path("other"))
+
+        self.assertEqual(result.stdout.splitlines(), self.expected([1]))
+        self.assertTrue(os.path.exists(self.path("other")))
+        self.assertFalse(os.path.exists(self.path("data.sigcache")))
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
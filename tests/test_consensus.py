@@ -0,0 +1,158 @@
+"""Checks the consensus subcommand on crafted signatures of replicas against
+votes counted in Python, with one job and several, including ranges that
+cross the windows the signatures are voted on in.
+
+    python3 test_consensus.py PATH_TO_SIGNATURE
+"""
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+
+SIGNATURE = None
+
+# Checksums voted on at a time; see consensus.cpp.
+WINDOW = 1 << 20
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def write_checksums(path, checksums):
+    with open(path, "wb") as f:
+        f.write(struct.pack("<%dI" % len(checksums), *checksums))
+
+
+def vote(replicas, block):
+    present = [r for r in replicas if block < len(r)]
+    best = None
+    best_votes = 0
+
+    for replica in present:
+        votes = sum(other[block] == replica[block] for other in present)
+        if votes > best_votes:
+            best, best_votes = replica[block], votes
+
+    disagreeing = tuple(i for i, r in enumerate(replicas)
+                        if block >= len(r) or r[block] != best)
+    return disagreeing, 2 * best_votes <= len(replicas)
+
+
+def expected_output(replicas, names, block_size):
+    ranges = []
+
+    for block in range(max(len(r) for r in replicas)):
+        disagreeing, no_majority = vote(replicas, block)
+        if not disagreeing:
+            continue
+
+        if ranges and ranges[-1][1] == block and \
+                ranges[-1][2:] == [disagreeing, no_majority]:
+            ranges[-1][1] = block + 1
+        else:
+            ranges.append([block, block + 1, disagreeing, no_majority])
+
+    return ["%d %d %s %s" % (start * block_size, end * block_size,
+                             "no majority:" if no_majority else "wrong:",
+                             " ".join(names[i] for i in disagreeing))
+            for start, end, disagreeing, no_majority in ranges]
+
+
+class ConsensusTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def consensus(self, replicas, *args):
+        names = []
+
+        for i, checksums in enumerate(replicas):
+            names.append(self.path("replica%d.sig" % i))
+            write_checksums(names[-1], checksums)
+
+        return names, run("consensus", *names, *args)
+
+    def check(self, replicas, block_size=4096):
+        for jobs in ("1", "4"):
+            with self.subTest(jobs=jobs):
+                names, result = self.consensus(
+                    replicas, "--block-size", str(block_size), "-j", jobs)
+                expected = expected_output(replicas, names, block_size)
+
+                self.assertEqual(result.stdout.splitlines(), expected)
+                self.assertEqual(result.returncode, 1 if expected else 0,
+                                 result.stderr)
+        return expected
+
+    def test_agreeing(self):
+        self.check([[1, 2, 3]] * 3)
+
+    def test_one_wrong(self):
+        good = list(range(100, 130))
+        bad = list(good)
+        bad[3] = 0
+        bad[10:13] = [0, 0, 0]
+
+        expected = self.check([good, bad, good])
+        self.assertEqual([line.split(" ", 2)[:2] for line in expected],
+                         [["12288", "16384"], ["40960", "53248"]])
+
+    def test_different_replicas_wrong(self):
+        a = list(range(20))
+        b = list(a)
+        c = list(a)
+        b[5] = 0
+        c[6] = 0
+        b[7] = c[7] = 0
+
+        self.check([a, b, c, list(a)])
+
+    def test_no_majority(self):
+        # Two against two, and all different.
+        self.check([[1, 2, 3], [1, 5, 6], [1, 2, 7], [1, 5, 8]])
+
+    def test_lengths_differ(self):
+        self.check([list(range(10)), list(range(8)), list(range(12))])
+
+    def test_across_windows(self):
+        good = [i * 2654435761 % (1 << 32) for i in range(2 * WINDOW + 10)]
+        bad = list(good)
+
+        for i in range(WINDOW - 3, WINDOW + 5):
+            bad[i] ^= 1
+        bad[2 * WINDOW] ^= 1
+
+        for jobs in ("1", "4"):
+            with self.subTest(jobs=jobs):
+                names, result = self.consensus([good, good, bad],
+                                               "--block-size", "1", "-j", jobs)
+
+                self.assertEqual(result.stdout.splitlines(), [
+                    "%d %d wrong: %s" % (WINDOW - 3, WINDOW + 5, names[2]),
+                    "%d %d wrong: %s" % (2 * WINDOW, 2 * WINDOW + 1,
+                                         names[2]),
+                ])
+
+    def test_single_signature(self):
+        _, result = self.consensus([[1, 2]])
+
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("2 to 64 signatures", result.stderr)
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
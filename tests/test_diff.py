@@ -0,0 +1,166 @@
+"""Checks the diff subcommand on crafted signatures against ranges computed
+in Python, with one job and several, and on signatures of real files.
+
+    python3 test_diff.py PATH_TO_SIGNATURE
+"""
+
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+
+SIGNATURE = None
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def write_checksums(path, checksums):
+    with open(path, "wb") as f:
+        f.write(struct.pack("<%dI" % len(checksums), *checksums))
+
+
+def expected_output(old, new, block_size):
+    lines = []
+    start = None
+
+    for i in range(min(len(old), len(new)) + 1):
+        differs = i < min(len(old), len(new)) and old[i] != new[i]
+
+        if differs and start is None:
+            start = i
+        elif not differs and start is not None:
+            lines.append("changed %d %d" % (start * block_size,
+                                            i * block_size))
+            start = None
+
+    if len(new) > len(old):
+        lines.append("added %d %d" % (len(old) * block_size,
+                                      len(new) * block_size))
+    elif len(old) > len(new):
+        lines.append("removed %d %d" % (len(new) * block_size,
+                                        len(old) * block_size))
+
+    return lines
+
+
+class DiffTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def diff(self, old, new, *args):
+        write_checksums(self.path("old.sig"), old)
+        write_checksums(self.path("new.sig"), new)
+
+        return run("diff", self.path("old.sig"), self.path("new.sig"), *args)
+
+    def check(self, old, new, block_size=1024 * 1024):
+        expected = expected_output(old, new, block_size)
+
+        for jobs in ("1", "4"):
+            with self.subTest(jobs=jobs):
+                result = self.diff(old, new, "--block-size", str(block_size),
+                                   "-j", jobs)
+
+                self.assertEqual(result.stdout.splitlines(), expected)
+                self.assertEqual(result.returncode, 1 if expected else 0,
+                                 result.stderr)
+
+    def test_identical(self):
+        self.check([1, 2, 3, 4], [1, 2, 3, 4])
+
+    def test_empty(self):
+        self.check([], [])
+        self.check([], [5, 6])
+        self.check([5, 6], [])
+
+    def test_crafted(self):
+        old = list(range(100, 120))
+        new = list(old)
+
+        # A single block, a run of three, and the last block.
+        new[0] = 0
+        new[5:8] = [0, 0, 0]
+        new[19] = 0
+
+        self.check(old, new, 4096)
+        self.assertEqual(expected_output(old, new, 4096),
+                         ["changed 0 4096", "changed 20480 32768",
+                          "changed 77824 81920"])
+
+    def test_added_and_removed(self):
+        self.check([1, 2, 3], [1, 9, 3, 4, 5], 4096)
+        self.check([1, 2, 3, 4, 5], [1, 2, 9], 4096)
+
+    def test_large(self):
+        # Enough blocks to be split between jobs, with runs crossing any
+        # split point.
+        rng = random.Random(1)
+        old = [rng.getrandbits(32) for _ in range(1 << 20)]
+        new = list(old)
+
+        for _ in range(200):
+            start = rng.randrange(len(new))
+            for i in range(start, min(len(new), start + rng.choice(
+                    (1, 2, 100, 5000)))):
+                new[i] ^= 1
+
+        new[100000:700000] = [0] * 600000
+        self.check(old, new)
+
+    def test_not_a_signature(self):
+        with open(self.path("odd.sig"), "wb") as f:
+            f.write(b"12345")
+        write_checksums(self.path("new.sig"), [1])
+
+        result = run("diff", self.path("odd.sig"), self.path("new.sig"))
+        self.assertEqual(result.returncode, 1)
+        self.assertIn("isn't a multiple of 4", result.stderr)
+
+    def test_signed_files(self):
+        block_size = 65536
+        data = bytearray(os.urandom(40 * block_size + 100))
+
+        with open(self.path("old"), "wb") as f:
+            f.write(data)
+
+        data[3 * block_size + 7] ^= 1
+        data[10 * block_size:12 * block_size + 1] = bytes(2 * block_size + 1)
+        data += b"more"
+
+        with open(self.path("new"), "wb") as f:
+            f.write(data)
+
+        for name in ("old", "new"):
+            result = run("-i", self.path(name), "-o", self.path(name + ".sig"),
+                         "--block-size", str(block_size))
+            self.assertEqual(result.returncode, 0, result.stderr)
+
+        result = run("diff", self.path("old.sig"), self.path("new.sig"),
+                     "--block-size", str(block_size))
+
+        # The last block changes too, having grown.
+        self.assertEqual(result.stdout.splitlines(), [
+            "changed %d %d" % (3 * block_size, 4 * block_size),
+            "changed %d %d" % (10 * block_size, 13 * block_size),
+            "changed %d %d" % (40 * block_size, 41 * block_size),
+        ])
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
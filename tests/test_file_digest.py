@@ -0,0 +1,111 @@
+"""Checks the block checksums and the whole-file CRC-32 that --file-digest
+derives from them against zlib, over block sizes, job counts, several
+inputs signed as one, and inputs read as a stream.
+
+    python3 test_file_digest.py PATH_TO_SIGNATURE
+"""
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+import zlib
+
+SIGNATURE = None
+
+
+def run(*args, **kwargs):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          **kwargs)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def block_checksums(data, block_size):
+    return b"".join(struct.pack("<I", zlib.crc32(data[i:i + block_size]))
+                    for i in range(0, len(data), block_size))
+
+
+class FileDigestTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.directory = tempfile.TemporaryDirectory()
+        cls.root = cls.directory.name
+        cls.data = os.urandom(5 * 1024 * 1024 + 777)
+
+        with open(os.path.join(cls.root, "data"), "wb") as f:
+            f.write(cls.data)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def digest(self, *args, **kwargs):
+        result = run("-o", self.path("out.sig"), "--file-digest", *args,
+                     **kwargs)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        return int(result.stdout.split()[0], 16)
+
+    def test_matches_zlib(self):
+        expected = zlib.crc32(self.data)
+
+        # Down to blocks so small that the digest folds more checksums than
+        # it combines on one thread.
+        for block_size in ("1M", "64K", "4095", "64"):
+            for jobs in ("1", "3"):
+                with self.subTest(block_size=block_size, jobs=jobs):
+                    digest = self.digest("-i", self.path("data"),
+                                         "--block-size", block_size,
+                                         "-j", jobs)
+                    self.assertEqual(digest, expected)
+
+    def test_block_checksums(self):
+        for block_size in (65536, 4095):
+            with self.subTest(block_size=block_size):
+                self.digest("-i", self.path("data"),
+                            "--block-size", str(block_size))
+                self.assertEqual(read(self.path("out.sig")),
+                                 block_checksums(self.data, block_size))
+
+    def test_stream(self):
+        digest = self.digest("-i", "/dev/stdin", "--block-size", "64K",
+                             input=self.data)
+        self.assertEqual(digest, zlib.crc32(self.data))
+        self.assertEqual(read(self.path("out.sig")),
+                         block_checksums(self.data, 65536))
+
+    def test_concatenated_inputs(self):
+        parts = [self.data[:1000000], self.data[1000000:1000001],
+                 self.data[1000001:]]
+        args = []
+
+        for i, part in enumerate(parts):
+            with open(self.path("part%d" % i), "wb") as f:
+                f.write(part)
+            args += ["-i", self.path("part%d" % i)]
+
+        digest = self.digest(*args, "--block-size", "64K", "-j", "3")
+        self.assertEqual(digest, zlib.crc32(self.data))
+        self.assertEqual(read(self.path("out.sig")),
+                         block_checksums(self.data, 65536))
+
+    def test_empty(self):
+        open(self.path("empty"), "wb").close()
+
+        self.assertEqual(self.digest("-i", self.path("empty")), 0)
+        self.assertEqual(read(self.path("out.sig")), b"")
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
@@ -0,0 +1,200 @@
+"""Checks the history subcommand on crafted signatures: that every version
+it stores comes back byte for byte, and that list and log report the
+changes computed in Python.
+
+    python3 test_history.py PATH_TO_SIGNATURE
+"""
+
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+
+SIGNATURE = None
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def pack(checksums):
+    return struct.pack("<%dI" % len(checksums), *checksums)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def changes(old, new):
+    """The log lines of the blocks that differ from old to new, without the
+    version and label."""
+    lines = []
+
+    for block in range(max(len(old), len(new))):
+        if block >= len(old):
+            lines.append("%d appeared %08x" % (block, new[block]))
+        elif block >= len(new):
+            lines.append("%d removed %08x" % (block, old[block]))
+        elif old[block] != new[block]:
+            lines.append("%d %08x -> %08x" % (block, old[block], new[block]))
+
+    return lines
+
+
+class HistoryTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+        self.store = self.path("store")
+        self.versions = []
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def history(self, *args):
+        result = run("history", *args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        return result.stdout
+
+    def record(self, checksums, label):
+        with open(self.path("in.sig"), "wb") as f:
+            f.write(pack(checksums))
+
+        if self.versions:
+            output = self.history("add", self.store, self.path("in.sig"),
+                                  "--label", label, "-j", "3")
+            self.assertEqual(output, "version %d: %d changed blocks\n" % (
+                len(self.versions), len(changes(self.versions[-1],
+                                                checksums))))
+        else:
+            self.history("init", self.store, self.path("in.sig"),
+                         "--label", label)
+
+        self.versions.append(list(checksums))
+
+    def check_versions(self):
+        for number, checksums in enumerate(self.versions):
+            with self.subTest(version=number):
+                self.history("get", self.store, str(number),
+                             "-o", self.path("out.sig"))
+                self.assertEqual(read(self.path("out.sig")), pack(checksums))
+
+    def log(self, first, count):
+        expected = []
+
+        for number in range(1, len(self.versions)):
+            for line in changes(self.versions[number - 1],
+                                self.versions[number]):
+                if first <= int(line.split()[0]) < first + count:
+                    expected.append("%d v%d %s" % (number, number, line))
+
+        output = self.history("log", self.store, "--block", str(first),
+                              "--count", str(count))
+        self.assertEqual(output.splitlines(), expected)
+        return expected
+
+    def test_crafted(self):
+        v0 = list(range(100, 110))
+        v1 = list(v0)
+        v1[2] = 7
+        v1[9] = 8
+        v2 = v1[:6]
+        v3 = v2 + [1, 2, 3, 4, 5, 6, 7, 8]
+        v3[0] = 9
+
+        for number, checksums in enumerate((v0, v1, v2, v3)):
+            self.record(checksums, "v%d" % number)
+
+        self.assertEqual(self.history("list", self.store).splitlines(), [
+            "0 v0 10 blocks, 10 changed",
+            "1 v1 10 blocks, 2 changed",
+            "2 v2 6 blocks, 4 changed",
+            "3 v3 14 blocks, 9 changed",
+        ])
+
+        self.check_versions()
+
+        self.assertEqual(self.log(2, 1), [
+            "1 v1 2 00000066 -> 00000007",
+        ])
+        self.assertEqual(self.log(9, 1), [
+            "1 v1 9 0000006d -> 00000008",
+            "2 v2 9 removed 00000008",
+            "3 v3 9 appeared 00000004",
+        ])
+        self.log(0, 100)
+
+    def test_many_versions(self):
+        # Enough blocks for several fences of the index, and versions whose
+        # changes vary in size, so that some are rebuilt from the base and
+        # some from the head.
+        rng = random.Random(1)
+        checksums = [rng.getrandbits(32) for _ in range(300000)]
+        self.record(checksums, "v0")
+
+        for number in range(1, 6):
+            checksums = list(checksums)
+            size = 50000 if number == 2 else 100
+
+            for _ in range(size):
+                checksums[rng.randrange(len(checksums))] ^= 1
+
+            if number == 4:
+                checksums += [rng.getrandbits(32) for _ in range(70000)]
+
+            self.record(checksums, "v%d" % number)
+
+        self.check_versions()
+        self.log(65530, 20)
+        self.log(131072, 70000)
+        self.log(299990, 100)
+
+    def test_empty_label(self):
+        self.record([1, 2], "")
+        self.record([1, 3], "")
+
+        self.assertEqual(self.history("list", self.store).splitlines(), [
+            "0 - 2 blocks, 2 changed",
+            "1 - 2 blocks, 1 changed",
+        ])
+        self.assertEqual(self.history("log", self.store, "--block", "1"),
+                         "1 - 1 00000002 -> 00000003\n")
+
+    def test_init_twice(self):
+        self.record([1], "v0")
+
+        result = run("history", "init", self.store, self.path("in.sig"))
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("already holds a signature history", result.stderr)
+
+    def test_long_label(self):
+        with open(self.path("in.sig"), "wb") as f:
+            f.write(pack([1]))
+
+        result = run("history", "init", self.store, self.path("in.sig"),
+                     "--label", "x" * 25)
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("label is longer than 24", result.stderr)
+
+    def test_missing_version(self):
+        self.record([1], "v0")
+
+        result = run("history", "get", self.store, "1",
+                     "-o", self.path("out.sig"))
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("no version 1", result.stderr)
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
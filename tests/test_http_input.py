@@ -0,0 +1,137 @@
+"""Checks that signing over HTTP (--url) gives the same signature as signing
+the same file locally, and that connections are reused, against the server
+in http_range_server.py. Reports the throughput of both.
+
+    python3 test_http_input.py PATH_TO_SIGNATURE
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import time
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from http_range_server import RangeServer  # noqa: E402
+
+SIGNATURE = None
+
+# Not a multiple of any block size tested, so that the last block is short.
+DATA_SIZE = 48 * 1024 * 1024 + 12345
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+class HttpInputTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.directory = tempfile.TemporaryDirectory()
+        cls.root = cls.directory.name
+
+        with open(os.path.join(cls.root, "data"), "wb") as f:
+            f.write(os.urandom(DATA_SIZE))
+
+        open(os.path.join(cls.root, "empty"), "wb").close()
+
+        cls.server = RangeServer(cls.root).start()
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.server.shutdown()
+        cls.server.server_close()
+        cls.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def sign(self, output, *args):
+        result = run("-o", self.path(output), *args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        return result
+
+    def compare(self, url_path, block_size, jobs, *args):
+        local = self.sign("local.sig", "-i", self.path("data"),
+                          "--block-size", block_size, "-j", jobs, *args)
+        remote = self.sign("remote.sig", "--url", self.server.url(url_path),
+                           "--block-size", block_size, "-j", jobs, *args)
+
+        self.assertEqual(read(self.path("local.sig")),
+                         read(self.path("remote.sig")))
+        return local, remote
+
+    def test_matches_local_file(self):
+        for block_size in ("1M", "64K", "333333"):
+            for jobs in ("1", "4"):
+                with self.subTest(block_size=block_size, jobs=jobs):
+                    local, remote = self.compare("data", block_size, jobs,
+                                                 "--file-digest")
+                    self.assertEqual(local.stdout.split()[0],
+                                     remote.stdout.split()[0])
+
+    def test_reuses_connections(self):
+        self.server.reset_counts()
+        self.compare("data", "64K", "3")
+        connections, requests = self.server.counts()
+
+        # One connection probes the size, then every job keeps its own.
+        self.assertLessEqual(connections, 1 + 3)
+        self.assertGreater(requests, 2 * connections)
+
+    def test_connection_close(self):
+        self.server.reset_counts()
+        self.compare("close/data", "1M", "3")
+        connections, requests = self.server.counts()
+
+        self.assertEqual(connections, requests)
+
+    def test_server_ignoring_ranges(self):
+        result = run("--url", self.server.url("no-range/data"),
+                     "-o", self.path("remote.sig"))
+
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("ignores range requests", result.stderr)
+
+    def test_empty_object(self):
+        # The size probe gets a 416 for an empty object.
+        self.sign("remote.sig", "--url", self.server.url("empty"))
+        self.assertEqual(read(self.path("remote.sig")), b"")
+
+    def test_missing_object(self):
+        result = run("--url", self.server.url("missing"),
+                     "-o", self.path("remote.sig"))
+
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("404", result.stderr)
+
+    def test_throughput(self):
+        def timed(*args):
+            started = time.monotonic()
+            self.sign("timed.sig", "--block-size", "1M", "-j", "4", *args)
+            return DATA_SIZE / (time.monotonic() - started) / 1e6
+
+        # Once first, so that the file is in the page cache for both.
+        timed("-i", self.path("data"))
+
+        local = timed("-i", self.path("data"))
+        remote = timed("--url", self.server.url("data"))
+
+        sys.stderr.write("\nthroughput: local %.0f MB/s, HTTP %.0f MB/s "
+                         "(%.0f%%) ... " % (local, remote,
+                                            100 * remote / local))
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
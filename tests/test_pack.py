@@ -0,0 +1,169 @@
+"""Checks the pack written with --pack and --recipe: that the input can be
+put back together byte for byte from the recipe and the pack, that every
+distinct block is stored once, across runs too, and that the index holds
+the SHA-256 of each block.
+
+    python3 test_pack.py PATH_TO_SIGNATURE
+"""
+
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+import zlib
+
+SIGNATURE = None
+
+BLOCK_SIZE = 65536
+
+INDEX_HEADER_SIZE = 64
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def recipe_entries(recipe):
+    return [struct.unpack_from("<QII", recipe, i)
+            for i in range(0, len(recipe), 16)]
+
+
+def restore(recipe, pack):
+    return b"".join(pack[offset:offset + length]
+                    for offset, length, _ in recipe_entries(recipe))
+
+
+def index_entries(index):
+    count, = struct.unpack_from("<Q", index, 8)
+    return [struct.unpack_from("<QII8I", index, INDEX_HEADER_SIZE + i * 48)
+            for i in range(count)]
+
+
+class PackTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+
+        self.a, self.b, self.c = (os.urandom(BLOCK_SIZE) for _ in range(3))
+        self.zero = bytes(BLOCK_SIZE)
+        self.tail = os.urandom(1000)
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def sign(self, name, data, *args):
+        with open(self.path(name), "wb") as f:
+            f.write(data)
+
+        result = run("-i", self.path(name), "-o", self.path(name + ".sig"),
+                     "--block-size", str(BLOCK_SIZE),
+                     "--pack", self.path("pack"),
+                     "--recipe", self.path(name + ".recipe"), *args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        return result
+
+    def check_restored(self, name, data):
+        recipe = read(self.path(name + ".recipe"))
+        self.assertEqual(restore(recipe, read(self.path("pack"))), data)
+
+        # The recipe holds the same checksums as the signature.
+        crcs = [crc for _, _, crc in recipe_entries(recipe)]
+        self.assertEqual(read(self.path(name + ".sig")),
+                         struct.pack("<%dI" % len(crcs), *crcs))
+
+    def test_restore(self):
+        blocks = [self.a, self.b, self.a, self.c, self.b, self.a, self.zero,
+                  self.zero]
+        data = b"".join(blocks) + self.tail
+
+        for jobs in ("1", "4"):
+            with self.subTest(jobs=jobs):
+                for name in ("pack", "pack.idx"):
+                    if os.path.exists(self.path(name)):
+                        os.remove(self.path(name))
+
+                result = self.sign("data", data, "-j", jobs)
+                self.check_restored("data", data)
+
+                # A, B, C, zeros and the tail.
+                self.assertIn("packed 5 new blocks, %d bytes" % (
+                    4 * BLOCK_SIZE + len(self.tail)), result.stderr)
+                self.assertEqual(os.path.getsize(self.path("pack")),
+                                 4 * BLOCK_SIZE + len(self.tail))
+
+    def test_second_run(self):
+        first = self.a + self.b + self.tail
+        second = self.b + self.c + self.a + self.c
+
+        self.sign("first", first)
+        result = self.sign("second", second)
+
+        self.assertIn("packed 1 new blocks, %d bytes" % BLOCK_SIZE,
+                      result.stderr)
+        self.check_restored("first", first)
+        self.check_restored("second", second)
+
+        result = self.sign("again", first)
+        self.assertIn("packed 0 new blocks, 0 bytes", result.stderr)
+        self.check_restored("again", first)
+
+    def test_index(self):
+        data = self.a + self.b + self.a + self.tail
+        self.sign("data", data)
+
+        pack = read(self.path("pack"))
+        entries = index_entries(read(self.path("pack.idx")))
+        self.assertEqual(len(entries), 3)
+
+        for offset, length, crc, *digest in entries:
+            block = pack[offset:offset + length]
+
+            self.assertEqual(crc, zlib.crc32(block))
+            self.assertEqual(tuple(digest), struct.unpack(
+                ">8I", hashlib.sha256(block).digest()))
+
+        self.assertEqual([crc for _, _, crc, *_ in entries],
+                         sorted(crc for _, _, crc, *_ in entries))
+
+    def test_older_index(self):
+        self.sign("data", self.a)
+
+        with open(self.path("pack.idx"), "r+b") as f:
+            f.seek(7)
+            f.write(b"\x01")
+
+        with open(self.path("data"), "wb") as f:
+            f.write(self.b)
+
+        result = run("-i", self.path("data"), "-o", self.path("data.sig"),
+                     "--pack", self.path("pack"))
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("index of an older version", result.stderr)
+
+    def test_recipe_requires_pack(self):
+        with open(self.path("data"), "wb") as f:
+            f.write(self.a)
+
+        result = run("-i", self.path("data"), "-o", self.path("data.sig"),
+                     "--recipe", self.path("data.recipe"))
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("--recipe requires --pack", result.stderr)
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
@@ -0,0 +1,146 @@
+"""Checks the parity written with --parity: that XOR parity is the XOR of
+the blocks of each group, and that the rebuild subcommand restores damaged
+blocks from XOR and Reed-Solomon parity byte for byte.
+
+    python3 test_parity.py PATH_TO_SIGNATURE
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import unittest
+
+SIGNATURE = None
+
+BLOCK_SIZE = 4096
+HEADER_SIZE = 64
+
+# Not a multiple of the block size, so that the last block is short.
+DATA_SIZE = 70 * BLOCK_SIZE + 1234
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def xor(blocks):
+    result = bytearray(BLOCK_SIZE)
+
+    for block in blocks:
+        for i, byte in enumerate(block):
+            result[i] ^= byte
+
+    return bytes(result)
+
+
+class ParityTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+        self.data = os.urandom(DATA_SIZE)
+
+        with open(self.path("data"), "wb") as f:
+            f.write(self.data)
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def sign(self, group, count, *args):
+        result = run("-i", self.path("data"), "-o", self.path("data.sig"),
+                     "--block-size", str(BLOCK_SIZE),
+                     "--parity", self.path("data.par"),
+                     "--parity-group", str(group),
+                     "--parity-count", str(count), *args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+
+    def damage(self, blocks):
+        with open(self.path("data"), "r+b") as f:
+            for block in blocks:
+                f.seek(block * BLOCK_SIZE)
+                length = min(BLOCK_SIZE, DATA_SIZE - block * BLOCK_SIZE)
+                f.write(bytes(length))
+
+    def rebuild(self):
+        return run("rebuild", "-i", self.path("data"),
+                   "-s", self.path("data.sig"), "-p", self.path("data.par"))
+
+    def check_rebuilt(self, group, count, blocks):
+        self.sign(group, count)
+        self.damage(blocks)
+        self.assertNotEqual(read(self.path("data")), self.data)
+
+        result = self.rebuild()
+        self.assertEqual(result.returncode, 0, result.stdout + result.stderr)
+
+        rebuilt = sorted(int(line.split()[-1])
+                         for line in result.stdout.splitlines())
+        self.assertEqual(rebuilt, sorted(blocks))
+        self.assertEqual(read(self.path("data")), self.data)
+
+    def test_xor_parity(self):
+        self.sign(8, 1)
+        parity = read(self.path("data.par"))
+        num_blocks = (DATA_SIZE + BLOCK_SIZE - 1) // BLOCK_SIZE
+
+        for group in range((num_blocks + 7) // 8):
+            blocks = [self.data[i * BLOCK_SIZE:(i + 1) * BLOCK_SIZE]
+                      for i in range(group * 8, min(num_blocks,
+                                                    group * 8 + 8))]
+            offset = HEADER_SIZE + group * BLOCK_SIZE
+
+            self.assertEqual(parity[offset:offset + BLOCK_SIZE], xor(blocks))
+
+    def test_parity_independent_of_jobs(self):
+        self.sign(8, 3, "-j", "1")
+        single = read(self.path("data.par"))
+        self.sign(8, 3, "-j", "4")
+
+        self.assertEqual(read(self.path("data.par")), single)
+
+    def test_xor_rebuild(self):
+        # One block in each of several groups, including the short last.
+        self.check_rebuilt(8, 1, [0, 13, 42, 70])
+
+    def test_reed_solomon_rebuild(self):
+        # As many blocks as there are parity blocks in a group.
+        self.check_rebuilt(8, 3, [8, 11, 15, 30, 68, 69, 70])
+
+    def test_xor_large_group(self):
+        # XOR isn't limited to the 256 blocks Reed-Solomon is.
+        self.check_rebuilt(300, 1, [5])
+
+    def test_reed_solomon_group_limit(self):
+        result = run("-i", self.path("data"), "-o", self.path("data.sig"),
+                     "--parity", self.path("data.par"),
+                     "--parity-group", "254", "--parity-count", "3")
+
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("at most 256", result.stderr)
+
+    def test_too_many_erasures(self):
+        self.sign(8, 2)
+        self.damage([16, 17, 18, 40])
+
+        result = self.rebuild()
+        self.assertNotEqual(result.returncode, 0)
+
+        for block in (16, 17, 18):
+            self.assertIn("cannot rebuild block %d" % block, result.stdout)
+        self.assertIn("rebuilt block 40", result.stdout)
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
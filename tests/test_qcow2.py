@@ -0,0 +1,344 @@
+"""Checks that signing a qcow2 image with --format qcow2 gives the same
+signature as signing the raw disk it holds, for version 2 and 3 images
+written by the test, with unallocated clusters, missing L2 tables, zero
+clusters and data clusters out of order in the image.
+
+    python3 test_qcow2.py PATH_TO_SIGNATURE
+"""
+
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+
+SIGNATURE = None
+
+COPIED = 1 << 63
+COMPRESSED = 1 << 62
+ZERO = 1
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+class Image:
+    """A qcow2 image under construction, with the raw disk it stands for.
+
+    Every guest cluster is given a kind: "data" with random contents,
+    "zeros" allocated but holding zeros, "unallocated", "zero" for a v3 zero
+    cluster with no data, or "preallocated" for a v3 zero cluster whose
+    allocated data is garbage. Data is laid out in the image in a shuffled
+    order, but in runs of consecutive clusters, as writes tend to leave it.
+    """
+
+    def __init__(self, version, cluster_bits, virtual_size, kinds, rng):
+        self.version = version
+        self.cluster_size = 1 << cluster_bits
+        self.cluster_bits = cluster_bits
+        self.virtual_size = virtual_size
+        self.l2_entries = self.cluster_size // 8
+
+        clusters = -(-virtual_size // self.cluster_size)
+        self.l1_size = -(-clusters // self.l2_entries)
+        self.raw = bytearray(virtual_size)
+
+        # Header, L1, then the L2 tables of the groups with any cluster
+        # allocated or zero, then the data; refcounts go last.
+        self.host = [bytes(self.cluster_size)] * (1 + self.l1_clusters())
+        l1 = [0] * self.l1_size
+        l2 = {}
+
+        for group in range(self.l1_size):
+            group_kinds = kinds[group * self.l2_entries:
+                                (group + 1) * self.l2_entries]
+
+            if any(kind != "unallocated" for kind in group_kinds):
+                l1[group] = self.allocate(bytes(self.cluster_size)) | COPIED
+                l2[group] = [0] * self.l2_entries
+
+        runs = []
+        cluster = 0
+
+        while cluster < clusters:
+            length = min(rng.choice((1, 2, 5, 16)), clusters - cluster)
+            runs.append(range(cluster, cluster + length))
+            cluster += length
+
+        rng.shuffle(runs)
+
+        for run_clusters in runs:
+            for cluster in run_clusters:
+                kind = kinds[cluster]
+                entry = 0
+
+                if kind == "data":
+                    data = os.urandom(self.cluster_size)
+                    begin = cluster * self.cluster_size
+                    end = min(begin + self.cluster_size, virtual_size)
+                    self.raw[begin:end] = data[:end - begin]
+                    entry = self.allocate(data) | COPIED
+                elif kind == "zeros":
+                    entry = self.allocate(bytes(self.cluster_size)) | COPIED
+                elif kind == "zero":
+                    entry = ZERO
+                elif kind == "preallocated":
+                    entry = self.allocate(os.urandom(self.cluster_size)) | \
+                        COPIED | ZERO
+
+                if entry:
+                    l2[cluster // self.l2_entries][
+                        cluster % self.l2_entries] = entry
+
+        for group, entries in l2.items():
+            self.host[(l1[group] & ~COPIED) >> cluster_bits] = \
+                struct.pack(">%dQ" % self.l2_entries, *entries)
+
+        self.l1 = l1
+        self.add_refcounts()
+
+    def l1_clusters(self):
+        return -(-self.l1_size * 8 // self.cluster_size)
+
+    def allocate(self, data):
+        self.host.append(data)
+        return (len(self.host) - 1) * self.cluster_size
+
+    # Adds a refcount table and blocks giving every cluster a count of one,
+    # themselves included, with the default 16-bit refcounts.
+    def add_refcounts(self):
+        per_block = self.cluster_size // 2
+        data_clusters = len(self.host)
+        blocks = table = 0
+
+        while True:
+            total = data_clusters + blocks + table
+            needed_blocks = -(-total // per_block)
+            needed_table = -(-needed_blocks * 8 // self.cluster_size)
+
+            if (needed_blocks, needed_table) == (blocks, table):
+                break
+            blocks, table = needed_blocks, needed_table
+
+        self.refcount_table_offset = len(self.host) * self.cluster_size
+        self.refcount_table_clusters = table
+        first_block = len(self.host) + table
+
+        entries = [(first_block + i) * self.cluster_size
+                   for i in range(blocks)]
+        entries += [0] * (table * self.cluster_size // 8 - len(entries))
+        table_data = struct.pack(">%dQ" % len(entries), *entries)
+
+        for i in range(table):
+            self.host.append(table_data[i * self.cluster_size:
+                                        (i + 1) * self.cluster_size])
+
+        counts = [1] * total + [0] * (blocks * per_block - total)
+        count_data = struct.pack(">%dH" % len(counts), *counts)
+
+        for i in range(blocks):
+            self.host.append(count_data[i * self.cluster_size:
+                                        (i + 1) * self.cluster_size])
+
+    def header(self, incompatible=0, backing_file=0):
+        header = struct.pack(">IIQIIQIIQQIIQ", 0x514649fb, self.version,
+                             backing_file, 0, self.cluster_bits,
+                             self.virtual_size, 0, self.l1_size,
+                             self.cluster_size, self.refcount_table_offset,
+                             self.refcount_table_clusters, 0, 0)
+
+        if self.version == 3:
+            header += struct.pack(">QQQII", incompatible, 0, 0, 4, 104)
+
+            # The end of the header extensions.
+            header += bytes(8)
+
+        return header
+
+    def write(self, path, **header):
+        l1 = struct.pack(">%dQ" % self.l1_size, *self.l1)
+        l1 += bytes(self.l1_clusters() * self.cluster_size - len(l1))
+
+        host = list(self.host)
+        host[0] = self.header(**header)
+        host[0] += bytes(self.cluster_size - len(host[0]))
+
+        for i in range(self.l1_clusters()):
+            host[1 + i] = l1[i * self.cluster_size:
+                             (i + 1) * self.cluster_size]
+
+        with open(path, "wb") as f:
+            f.write(b"".join(host))
+
+    def host_offset(self, cluster):
+        l2_offset = self.l1[cluster // self.l2_entries] & ~COPIED
+        entry, = struct.unpack_from(">Q", self.host[
+            l2_offset >> self.cluster_bits], cluster % self.l2_entries * 8)
+        return entry & 0x00fffffffffffe00
+
+
+def random_kinds(rng, clusters, kinds, missing_groups, l2_entries):
+    result = [rng.choice(kinds) for _ in range(clusters)]
+
+    # A few runs long enough to leave signature blocks without data.
+    for _ in range(4):
+        start = rng.randrange(clusters)
+        for cluster in range(start, min(clusters, start + 40)):
+            result[cluster] = "unallocated"
+
+    for group in missing_groups:
+        for cluster in range(group * l2_entries,
+                             min(clusters, (group + 1) * l2_entries)):
+            result[cluster] = "unallocated"
+
+    return result
+
+
+class Qcow2Test(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def make_image(self, version, cluster_bits, virtual_size, kinds):
+        rng = random.Random(version * 100 + cluster_bits)
+        cluster_size = 1 << cluster_bits
+        clusters = -(-virtual_size // cluster_size)
+
+        image = Image(version, cluster_bits, virtual_size,
+                      random_kinds(rng, clusters, kinds, [1],
+                                   cluster_size // 8), rng)
+        image.write(self.path("disk.qcow2"))
+
+        with open(self.path("disk.raw"), "wb") as f:
+            f.write(image.raw)
+
+        return image
+
+    def sign(self, output, *args):
+        result = run("-o", self.path(output), *args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+
+    def check_same_signature(self, *args):
+        self.sign("raw.sig", "-i", self.path("disk.raw"), *args)
+        self.sign("qcow2.sig", "-i", self.path("disk.qcow2"),
+                  "--format", "qcow2", *args)
+
+        self.assertEqual(read(self.path("qcow2.sig")),
+                         read(self.path("raw.sig")))
+
+    def check_image(self):
+        for block_size in ("64K", "4095", "1M"):
+            for jobs in ("1", "4"):
+                with self.subTest(block_size=block_size, jobs=jobs):
+                    self.check_same_signature("--block-size", block_size,
+                                              "-j", jobs)
+
+    def test_version_2(self):
+        # 4 KiB clusters, so that an L2 table covers 2 MiB, and there are
+        # several, one of them missing; the last cluster is short.
+        self.make_image(2, 12, 9 * 1024 * 1024 + 1536,
+                        ["data", "data", "zeros", "unallocated"])
+        self.check_image()
+
+    def test_version_3(self):
+        self.make_image(3, 12, 9 * 1024 * 1024 + 1536,
+                        ["data", "zeros", "unallocated", "zero",
+                         "preallocated"])
+        self.check_image()
+
+    def test_large_clusters(self):
+        # A single L2 table, with clusters larger than some signature
+        # blocks.
+        self.make_image(3, 16, 20 * 1024 * 1024 + 512,
+                        ["data", "unallocated", "zero", "preallocated"])
+        self.check_image()
+
+    def test_parity(self):
+        # Parity reads the zeros themselves rather than skipping them.
+        self.make_image(3, 12, 9 * 1024 * 1024 + 1536,
+                        ["data", "unallocated", "zero", "preallocated"])
+
+        for name in ("raw", "qcow2"):
+            path = self.path("disk." + name)
+            self.sign(name + ".sig", "-i", path, "--block-size", "64K",
+                      "--format", name, "--parity", self.path(name + ".par"))
+
+        self.assertEqual(read(self.path("qcow2.sig")),
+                         read(self.path("raw.sig")))
+        self.assertEqual(read(self.path("qcow2.par")),
+                         read(self.path("raw.par")))
+
+    def test_verify(self):
+        image = self.make_image(3, 12, 9 * 1024 * 1024 + 1536,
+                                ["data", "unallocated", "zero"])
+        self.sign("raw.sig", "-i", self.path("disk.raw"), "--block-size",
+                  "64K")
+
+        verify = ("verify", "-i", self.path("disk.qcow2"),
+                  "-s", self.path("raw.sig"), "--block-size", "64K",
+                  "--format", "qcow2", "--coverage", "1")
+
+        result = run(*verify)
+        self.assertEqual(result.returncode, 0, result.stdout + result.stderr)
+
+        cluster = next(c for c in range(len(image.raw) >> 12)
+                       if image.raw[c << 12:(c + 1) << 12] != bytes(4096))
+
+        with open(self.path("disk.qcow2"), "r+b") as f:
+            f.seek(image.host_offset(cluster) + 100)
+            f.write(b"corrupted")
+
+        result = run(*verify)
+        self.assertEqual(result.returncode, 1, result.stdout + result.stderr)
+
+    def test_unsupported(self):
+        image = self.make_image(3, 12, 1024 * 1024, ["data"])
+        cases = [
+            ({"backing_file": 512}, "with a backing file"),
+            ({"incompatible": 2}, "marked corrupt"),
+            ({"incompatible": 4}, "unsupported qcow2 features"),
+        ]
+
+        for header, message in cases:
+            with self.subTest(message=message):
+                image.write(self.path("bad.qcow2"), **header)
+
+                result = run("-i", self.path("bad.qcow2"),
+                             "-o", self.path("bad.sig"), "--format", "qcow2")
+                self.assertNotEqual(result.returncode, 0)
+                self.assertIn(message, result.stderr)
+
+    def test_compressed(self):
+        image = self.make_image(2, 12, 1024 * 1024, ["data"])
+        l2 = image.l1[0] & ~COPIED
+
+        with open(self.path("disk.qcow2"), "r+b") as f:
+            f.seek(l2)
+            f.write(struct.pack(">Q", COMPRESSED | image.host_offset(0)))
+
+        result = run("-i", self.path("disk.qcow2"), "-o", self.path("out.sig"),
+                     "--format", "qcow2")
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("compressed qcow2 clusters", result.stderr)
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
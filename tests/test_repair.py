@@ -0,0 +1,137 @@
+"""Checks that the repair subcommand makes a damaged copy byte for byte
+equal to a good one, with and without a signature of the good data, and
+that it leaves alone what the good copy can't fix.
+
+    python3 test_repair.py PATH_TO_SIGNATURE
+"""
+
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import unittest
+
+SIGNATURE = None
+
+BLOCK_SIZE = 65536
+
+# Not a multiple of the block size, so that the last block is short.
+DATA_SIZE = 50 * BLOCK_SIZE + 999
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def damage(data, offsets):
+    data = bytearray(data)
+
+    for offset in offsets:
+        data[offset] ^= 0xff
+
+    return bytes(data)
+
+
+class RepairTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+        self.data = os.urandom(DATA_SIZE)
+
+        write(self.path("good"), self.data)
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def sign_good(self):
+        result = run("-i", self.path("good"), "-o", self.path("good.sig"),
+                     "--block-size", str(BLOCK_SIZE))
+        self.assertEqual(result.returncode, 0, result.stderr)
+
+    def repair(self, *args):
+        return run("repair", self.path("target"), self.path("good"), *args,
+                   "--block-size", str(BLOCK_SIZE), "-j", "3")
+
+    def repaired_ranges(self, result):
+        return [tuple(int(n) for n in match)
+                for match in re.findall(r"^repaired (\d+) (\d+)$",
+                                        result.stdout, re.M)]
+
+    def check_repaired(self, target, *args):
+        write(self.path("target"), target)
+
+        result = self.repair(*args)
+        self.assertEqual(result.returncode, 0, result.stdout + result.stderr)
+        self.assertEqual(read(self.path("target")), self.data)
+        return result
+
+    def test_without_signature(self):
+        target = damage(self.data, [0, 5 * BLOCK_SIZE + 1, 6 * BLOCK_SIZE,
+                                    DATA_SIZE - 1])
+        result = self.check_repaired(target)
+
+        # Ranges are whole blocks, the short last one included.
+        self.assertEqual(self.repaired_ranges(result), [
+            (0, BLOCK_SIZE),
+            (5 * BLOCK_SIZE, 7 * BLOCK_SIZE),
+            (50 * BLOCK_SIZE, 51 * BLOCK_SIZE),
+        ])
+
+    def test_with_signature(self):
+        self.sign_good()
+        target = damage(self.data, [17 * BLOCK_SIZE + 100])
+        result = self.check_repaired(target, self.path("good.sig"))
+
+        self.assertEqual(self.repaired_ranges(result),
+                         [(17 * BLOCK_SIZE, 18 * BLOCK_SIZE)])
+        self.assertIn("%d bytes written" % BLOCK_SIZE, result.stderr)
+
+    def test_undamaged(self):
+        result = self.check_repaired(self.data)
+
+        self.assertEqual(self.repaired_ranges(result), [])
+        self.assertIn("0 bytes written", result.stderr)
+
+    def test_truncated_target(self):
+        self.check_repaired(self.data[:20 * BLOCK_SIZE + 5])
+
+    def test_longer_target(self):
+        self.check_repaired(self.data + os.urandom(3 * BLOCK_SIZE))
+
+    def test_corrupted_good_copy(self):
+        self.sign_good()
+
+        # Block 3 is bad in both copies; block 8 only in the target.
+        target = damage(self.data, [3 * BLOCK_SIZE, 8 * BLOCK_SIZE])
+        write(self.path("target"), target)
+        write(self.path("good"), damage(self.data, [3 * BLOCK_SIZE + 1]))
+
+        result = self.repair(self.path("good.sig"))
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("good copy of block 3 is corrupted too", result.stdout)
+
+        expected = bytearray(self.data)
+        expected[3 * BLOCK_SIZE] ^= 0xff
+        self.assertEqual(read(self.path("target")), bytes(expected))
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
@@ -0,0 +1,288 @@
+"""Checks that signing a filesystem image with --skip-free gives the same
+signature as signing a copy of it with the free blocks zeroed, and that it
+finds as much allocated as the filesystem's own tools do, or as was laid
+out in the XFS images the test writes itself.
+
+    python3 test_skip_free.py PATH_TO_SIGNATURE
+"""
+
+import os
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+
+SIGNATURE = None
+
+# Larger than the filesystem blocks, so that some signature blocks are
+# partly free, and read whole.
+BLOCK_SIZE = 64 * 1024
+
+HAVE_E2FSPROGS = all(shutil.which(tool)
+                     for tool in ("mke2fs", "debugfs", "dumpe2fs"))
+
+
+def run(*args):
+    return subprocess.run([SIGNATURE] + list(args),
+                          stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+# Writes an XFS image with random data everywhere but in the headers the
+# free-space B+tree by block number is found through, and that tree, with
+# `free` holding the free extents of each allocation group. The tree's
+# blocks follow the four header sectors of each group, and point at each
+# other by block within the group; leaves hold up to `per_leaf`
+# records, under a root node if there is more than one.
+def write_xfs(path, version, block_size, ag_blocks, dblocks, free, per_leaf):
+    sector_size = 512
+    header_size = 56 if version >= 5 else 16
+    magic = b"AB3B" if version >= 5 else b"ABTB"
+    max_node_records = (block_size - header_size) // 12
+    ag_count = len(free)
+    start = (4 * sector_size + block_size - 1) // block_size
+
+    data = bytearray(os.urandom(dblocks * block_size))
+    data[:sector_size] = bytes(sector_size)
+    struct.pack_into(">4sIQ", data, 0, b"XFSB", block_size, dblocks)
+    struct.pack_into(">II", data, 84, ag_blocks, ag_count)
+    struct.pack_into(">HH", data, 100, version, sector_size)
+
+    def btree_block(number, level, records, left, right):
+        offset = number * block_size
+        data[offset:offset + block_size] = bytes(block_size)
+        struct.pack_into(">4sHHII", data, offset, magic, level, len(records),
+                         left, right)
+        return offset + header_size
+
+    for ag, extents in enumerate(free):
+        ag_offset = ag * ag_blocks * block_size
+        length = min(ag_blocks, dblocks - ag * ag_blocks)
+
+        leaves = [extents[i:i + per_leaf]
+                  for i in range(0, len(extents), per_leaf)] or [[]]
+        root = start if len(leaves) == 1 else start + len(leaves)
+
+        for i, records in enumerate(leaves):
+            left = start + i - 1 if i else 0xffffffff
+            right = start + i + 1 if i + 1 < len(leaves) else 0xffffffff
+            offset = btree_block(ag * ag_blocks + start + i, 0, records, left,
+                                 right)
+
+            for first, count in records:
+                struct.pack_into(">II", data, offset, first, count)
+                offset += 8
+
+        if len(leaves) > 1:
+            offset = btree_block(ag * ag_blocks + root, 1, leaves,
+                                 0xffffffff, 0xffffffff)
+
+            for i, records in enumerate(leaves):
+                struct.pack_into(">II", data, offset + i * 8, *records[0])
+                struct.pack_into(">I", data,
+                                 offset + max_node_records * 8 + i * 4,
+                                 start + i)
+
+        agf = ag_offset + sector_size
+        data[agf:agf + sector_size] = bytes(sector_size)
+        struct.pack_into(">4sIIII", data, agf, b"XAGF", 1, ag, length, root)
+        struct.pack_into(">I", data, agf + 28, 1 if len(leaves) == 1 else 2)
+
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+# Free extents of an allocation group of `length` blocks, past the first
+# `reserved`, some of them long enough to hold whole signature blocks.
+def random_free_extents(rng, length, reserved, long_extent):
+    extents = []
+    block = reserved
+
+    while True:
+        block += rng.randrange(1, 40)
+        count = rng.choice((1, 3, 17, long_extent))
+
+        if block + count > length:
+            return extents
+
+        extents.append((block, count))
+        block += count
+
+
+# Zeroes the signature blocks that lie wholly in free space, which are the
+# ones --skip-free doesn't read.
+def zero_free_blocks(source, destination, ranges, block_size):
+    data = bytearray(read(source))
+    merged = []
+
+    for start, length in sorted(ranges):
+        if merged and merged[-1][1] >= start:
+            merged[-1][1] = max(merged[-1][1], start + length)
+        else:
+            merged.append([start, start + length])
+
+    for start, end in merged:
+        first = (start + block_size - 1) // block_size * block_size
+        last = min(end, len(data)) // block_size * block_size
+
+        if first < last:
+            data[first:last] = bytes(last - first)
+
+    with open(destination, "wb") as f:
+        f.write(data)
+
+
+class SkipFreeTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.root = self.directory.name
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.root, name)
+
+    def sign(self, output, *args):
+        result = run("-o", self.path(output), "--block-size", str(BLOCK_SIZE),
+                     *args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        return result
+
+    # Signs the image both ways, and returns the allocated bytes reported.
+    def check_image(self, image, free_ranges):
+        zero_free_blocks(image, self.path("zeroed.img"), free_ranges,
+                         BLOCK_SIZE)
+
+        skipped = self.sign("skipped.sig", "-i", image, "--skip-free")
+        self.sign("zeroed.sig", "-i", self.path("zeroed.img"))
+        self.sign("raw.sig", "-i", image)
+
+        self.assertEqual(read(self.path("skipped.sig")),
+                         read(self.path("zeroed.sig")))
+
+        # Deleted files leave data in the free blocks, so this shows that
+        # some were actually skipped.
+        self.assertNotEqual(read(self.path("skipped.sig")),
+                            read(self.path("raw.sig")))
+
+        match = re.search(r"(\d+) of (\d+) bytes allocated", skipped.stderr)
+        self.assertIsNotNone(match, skipped.stderr)
+        return int(match.group(1))
+
+    def make_ext4(self, *options):
+        files = self.path("files")
+        image = self.path("ext4.img")
+
+        os.mkdir(files)
+        for name, size in (("kept", 3000000), ("deleted", 5000000)):
+            with open(os.path.join(files, name), "wb") as f:
+                f.write(os.urandom(size))
+
+        with open(image, "wb") as f:
+            f.truncate(32 * 1024 * 1024)
+
+        subprocess.run(["mke2fs", "-q", "-F", "-t", "ext4", "-d", files] +
+                       list(options) + [image], check=True)
+        subprocess.run(["debugfs", "-w", "-R", "rm deleted", image],
+                       check=True, stdout=subprocess.DEVNULL,
+                       stderr=subprocess.DEVNULL)
+        return image
+
+    def check_ext4(self, *options):
+        image = self.make_ext4(*options)
+        listing = subprocess.run(["dumpe2fs", image], check=True,
+                                 stdout=subprocess.PIPE,
+                                 stderr=subprocess.DEVNULL,
+                                 universal_newlines=True).stdout
+
+        block_size = int(re.search(r"^Block size:\s+(\d+)", listing,
+                                   re.M).group(1))
+        blocks = int(re.search(r"^Block count:\s+(\d+)", listing,
+                               re.M).group(1))
+        free = int(re.search(r"^Free blocks:\s+(\d+)", listing,
+                             re.M).group(1))
+
+        ranges = []
+        for line in re.findall(r"^  Free blocks: (.+)$", listing, re.M):
+            for item in line.split(", "):
+                first, _, last = item.partition("-")
+                last = last or first
+                ranges.append((int(first) * block_size,
+                               (int(last) - int(first) + 1) * block_size))
+
+        allocated = self.check_image(image, ranges)
+        self.assertEqual(allocated, (blocks - free) * block_size)
+
+    @unittest.skipUnless(HAVE_E2FSPROGS, "needs e2fsprogs")
+    def test_ext4(self):
+        self.check_ext4("-b", "4096")
+
+    @unittest.skipUnless(HAVE_E2FSPROGS, "needs e2fsprogs")
+    def test_ext4_1k_blocks(self):
+        self.check_ext4("-b", "1024")
+
+    @unittest.skipUnless(HAVE_E2FSPROGS, "needs e2fsprogs")
+    def test_ext4_1k_bigalloc(self):
+        # The first data block is 0, but the descriptors still follow the
+        # superblock in block 1.
+        self.check_ext4("-b", "1024", "-O", "bigalloc", "-C", "16384")
+
+    @unittest.skipUnless(HAVE_E2FSPROGS, "needs e2fsprogs")
+    def test_ext4_meta_bg(self):
+        self.check_ext4("-b", "1024", "-O", "meta_bg,^resize_inode")
+
+    def check_xfs(self, version, block_size, per_leaf):
+        rng = random.Random(version)
+        ag_blocks = 4 * 1024 * 1024 // block_size
+
+        # The last group is shorter than the others. The first 16 blocks of
+        # each are left to the headers and the tree.
+        dblocks = 3 * ag_blocks + ag_blocks // 3
+        free = [random_free_extents(rng, min(ag_blocks,
+                                             dblocks - ag * ag_blocks),
+                                    16, 3 * BLOCK_SIZE // block_size)
+                for ag in range(4)]
+
+        image = self.path("xfs.img")
+        write_xfs(image, version, block_size, ag_blocks, dblocks, free,
+                  per_leaf)
+
+        ranges = [((ag * ag_blocks + first) * block_size, count * block_size)
+                  for ag, extents in enumerate(free)
+                  for first, count in extents]
+
+        allocated = self.check_image(image, ranges)
+        self.assertEqual(allocated, dblocks * block_size -
+                         sum(length for _, length in ranges))
+
+    def test_xfs_v4(self):
+        # 512-byte blocks hold 62 records, so the tree has a root node.
+        self.check_xfs(4, 512, 62)
+
+    def test_xfs_v5(self):
+        self.check_xfs(5, 4096, 10)
+
+    def test_neither(self):
+        with open(self.path("zeros.img"), "wb") as f:
+            f.truncate(1024 * 1024)
+
+        result = run("-i", self.path("zeros.img"), "-o", self.path("out.sig"),
+                     "--skip-free")
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("neither an ext4 nor an XFS image", result.stderr)
+
+
+if __name__ == "__main__":
+    SIGNATURE = os.path.abspath(sys.argv.pop(1))
+    unittest.main()